@@ -0,0 +1,137 @@
+/* SPDX-License-Identifier: MIT */
+
+/*
+ * Microbenchmark for the CRC32 implementations in crc32.c; also checks that
+ * they all agree with each other (and with crc32_combine) before timing them.
+ */
+
+#include "crc32.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define BUFFER_SIZE (64U * 1024U * 1024U)
+
+static const struct {
+	const char *name;
+	uint32_t (*update)(uint32_t, const void *, size_t);
+} impls[] = {
+	{"bytewise", crc32_update_bytewise},
+	{"slice16", crc32_update_slice16},
+	{"hardware", crc32_update_hardware},
+	{"default", crc32_update},
+};
+
+#define NUM_IMPLS (sizeof(impls) / sizeof(impls[0]))
+
+/* keeps the compiler from optimizing the benchmark away */
+volatile uint32_t sink;
+
+static double
+now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int
+check(const uint8_t *buf)
+{
+	/* "123456789" is the classic check value */
+	uint32_t crc = crc32_final(crc32_update(crc32_init(), "123456789", 9));
+	if (crc != 0xcbf43926) {
+		fprintf(stderr, "check value is %08x, not cbf43926\n", crc);
+		return -1;
+	}
+
+	/* odd sizes and offsets to exercise all the tails */
+	for (size_t len = 0; len < 1024; len += 1 + len / 8) {
+		for (size_t off = 0; off < 16; off++) {
+			uint32_t want = crc32_final(crc32_update_bytewise(
+				crc32_init(), buf + off, len));
+			for (size_t i = 1; i < NUM_IMPLS; i++) {
+				uint32_t got = crc32_final(impls[i].update(
+					crc32_init(), buf + off, len));
+				if (got != want) {
+					fprintf(stderr,
+						"%s: %08x instead of %08x for "
+						"%zu bytes at offset %zu\n",
+						impls[i].name, got, want, len,
+						off);
+					return -1;
+				}
+			}
+
+			size_t half = len / 3;
+			uint32_t a = crc32_final(
+				crc32_update(crc32_init(), buf + off, half));
+			uint32_t b = crc32_final(crc32_update(
+				crc32_init(), buf + off + half, len - half));
+			if (crc32_combine(a, b, len - half) != want) {
+				fprintf(stderr, "crc32_combine failed for %zu "
+						"bytes\n",
+					len);
+				return -1;
+			}
+		}
+	}
+
+	static const uint8_t zeros[4096];
+	uint32_t z = crc32_update(crc32_init(), buf, 100);
+	if (crc32_update_zeros(z, sizeof(zeros)) !=
+		crc32_update(z, zeros, sizeof(zeros))) {
+		fprintf(stderr, "crc32_update_zeros failed\n");
+		return -1;
+	}
+
+	return 0;
+}
+
+int
+main(void)
+{
+	uint8_t *buf = malloc(BUFFER_SIZE);
+	if (buf == NULL) {
+		fprintf(stderr, "out of memory\n");
+		exit(EXIT_FAILURE);
+	}
+	srandom(42);
+	for (size_t i = 0; i < BUFFER_SIZE; i++) {
+		buf[i] = random();
+	}
+
+	if (check(buf) != 0) {
+		exit(EXIT_FAILURE);
+	}
+	printf("hardware crc32: %s\n", crc32_hardware() ? "yes" : "no");
+
+	static const size_t sizes[] = {92, 4096, 16384, 1024 * 1024,
+		BUFFER_SIZE};
+	printf("%-10s %10s %10s\n", "method", "size", "GB/s");
+	for (size_t i = 0; i < NUM_IMPLS; i++) {
+		for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+			size_t rounds = 4 * (size_t)BUFFER_SIZE / sizes[s];
+			if (i == 0) {
+				rounds /= 8; /* bytewise is slow */
+			}
+			if (rounds == 0) {
+				rounds = 1;
+			}
+			uint32_t crc = crc32_init();
+			double start = now();
+			for (size_t r = 0; r < rounds; r++) {
+				crc = impls[i].update(crc, buf, sizes[s]);
+			}
+			double secs = now() - start;
+			sink = crc;
+			printf("%-10s %10zu %10.2f\n", impls[i].name, sizes[s],
+				rounds * sizes[s] / secs / 1e9);
+		}
+	}
+
+	free(buf);
+	exit(EXIT_SUCCESS);
+}
@@ -0,0 +1,438 @@
+/* SPDX-License-Identifier: MIT */
+
+/*
+ * Benchmark driver for mkgpt itself: generates a set of partition images
+ * (with a fixed seed, so every run sees the same data), then builds an image
+ * from them with every combination of --io method, sector size and number of
+ * jobs asked for, and reports wall time, throughput, CPU time, peak RSS and
+ * the read and write syscalls of the median run of each as CSV or JSON.
+ */
+
+#define _GNU_SOURCE /* wait4() */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#define EXTENT_SIZE (1024U * 1024U)
+#define MAX_RUNS (100)
+#define MAX_PARTS (128)
+
+struct result {
+	double wall; /* seconds */
+	double user;
+	double sys;
+	long max_rss; /* KiB */
+	unsigned long long syscr; /* from /proc/<pid>/io */
+	unsigned long long syscw;
+	unsigned long long rchar;
+	unsigned long long wchar;
+};
+
+static const char *dir = "/tmp/bench-mkgpt";
+static const char *mkgpt = "./mkgpt";
+static int parts = 4;
+static long part_mib = 64;
+static int holes = 25; /* percent of extents left as holes */
+static const char *io_list =
+	"auto,reflink,copy-range,sendfile,buffered,mmap,uring";
+static const char *sector_list = "512,4096";
+static const char *jobs_list = "1,4";
+static int runs = 3;
+static int sparse = 0;
+static int json = 0;
+
+static double
+now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* xorshift64, good enough for data nobody looks at */
+static uint64_t
+next_random(uint64_t *state)
+{
+	*state ^= *state << 13;
+	*state ^= *state >> 7;
+	*state ^= *state << 17;
+	return *state;
+}
+
+static void
+part_path(char *buf, size_t size, int i)
+{
+	snprintf(buf, size, "%s/part%d.img", dir, i);
+}
+
+/*
+ * Write the partition images: part_mib extents of random data each, with
+ * holes in place of the given percentage of them.
+ */
+static int
+generate(void)
+{
+	uint64_t state = 0x6d6b677074ULL; /* fixed, so runs are comparable */
+	uint64_t *buf = malloc(EXTENT_SIZE);
+	char path[PATH_MAX];
+
+	if (buf == NULL) {
+		fprintf(stderr, "out of memory\n");
+		return -1;
+	}
+	if (mkdir(dir, 0777) != 0 && errno != EEXIST) {
+		fprintf(stderr, "unable to create %s (%s)\n", dir,
+			strerror(errno));
+		free(buf);
+		return -1;
+	}
+
+	for (int i = 0; i < parts; i++) {
+		part_path(path, sizeof(path), i);
+		int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+		if (fd < 0) {
+			fprintf(stderr, "unable to create %s (%s)\n", path,
+				strerror(errno));
+			free(buf);
+			return -1;
+		}
+		for (long e = 0; e < part_mib; e++) {
+			if ((int)(next_random(&state) % 100) < holes) {
+				continue;
+			}
+			for (size_t w = 0; w < EXTENT_SIZE / sizeof(*buf);
+				w++) {
+				buf[w] = next_random(&state);
+			}
+			if (pwrite(fd, buf, EXTENT_SIZE, e * EXTENT_SIZE) !=
+				EXTENT_SIZE) {
+				fprintf(stderr, "unable to write %s\n", path);
+				close(fd);
+				free(buf);
+				return -1;
+			}
+		}
+		if (ftruncate(fd, part_mib * EXTENT_SIZE) != 0 ||
+			fsync(fd) != 0) {
+			fprintf(stderr, "unable to finish %s\n", path);
+			close(fd);
+			free(buf);
+			return -1;
+		}
+		close(fd);
+	}
+
+	free(buf);
+	return 0;
+}
+
+static void
+cleanup(void)
+{
+	char path[PATH_MAX];
+
+	for (int i = 0; i < parts; i++) {
+		part_path(path, sizeof(path), i);
+		unlink(path);
+	}
+	snprintf(path, sizeof(path), "%s/out.img", dir);
+	unlink(path);
+	rmdir(dir);
+}
+
+/* The syscall and byte counts of a process that exited but wasn't reaped. */
+static void
+read_io(pid_t pid, struct result *res)
+{
+	char path[64], line[128];
+
+	snprintf(path, sizeof(path), "/proc/%d/io", (int)pid);
+	FILE *f = fopen(path, "r");
+	if (f == NULL) {
+		return;
+	}
+	while (fgets(line, sizeof(line), f) != NULL) {
+		sscanf(line, "syscr: %llu", &res->syscr);
+		sscanf(line, "syscw: %llu", &res->syscw);
+		sscanf(line, "rchar: %llu", &res->rchar);
+		sscanf(line, "wchar: %llu", &res->wchar);
+	}
+	fclose(f);
+}
+
+static int
+run(const char *io, const char *sect_size, const char *jobs,
+	struct result *res)
+{
+	char out[PATH_MAX];
+	char paths[MAX_PARTS][PATH_MAX];
+	const char *argv[16 + 4 * MAX_PARTS];
+	int argc = 0;
+
+	snprintf(out, sizeof(out), "%s/out.img", dir);
+	unlink(out);
+
+	argv[argc++] = mkgpt;
+	argv[argc++] = "-o";
+	argv[argc++] = out;
+	argv[argc++] = "--sector-size";
+	argv[argc++] = sect_size;
+	argv[argc++] = "--io";
+	argv[argc++] = io;
+	argv[argc++] = "-j";
+	argv[argc++] = jobs;
+	if (sparse) {
+		argv[argc++] = "--sparse";
+	}
+	for (int i = 0; i < parts; i++) {
+		part_path(paths[i], sizeof(paths[i]), i);
+		argv[argc++] = "--part";
+		argv[argc++] = paths[i];
+		argv[argc++] = "--type";
+		argv[argc++] = "linux";
+	}
+	argv[argc] = NULL;
+
+	memset(res, 0, sizeof(*res));
+	double start = now();
+	pid_t pid = fork();
+	if (pid < 0) {
+		fprintf(stderr, "fork failed (%s)\n", strerror(errno));
+		return -1;
+	}
+	if (pid == 0) {
+		execv(mkgpt, (char *const *)argv);
+		fprintf(stderr, "unable to run %s (%s)\n", mkgpt,
+			strerror(errno));
+		_exit(127);
+	}
+
+	/* leave it a zombie until we've read its /proc/<pid>/io */
+	siginfo_t info;
+	if (waitid(P_PID, pid, &info, WEXITED | WNOWAIT) != 0) {
+		fprintf(stderr, "waitid failed (%s)\n", strerror(errno));
+		return -1;
+	}
+	res->wall = now() - start;
+	read_io(pid, res);
+
+	int status;
+	struct rusage ru;
+	if (wait4(pid, &status, 0, &ru) != pid) {
+		fprintf(stderr, "wait4 failed (%s)\n", strerror(errno));
+		return -1;
+	}
+	if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+		fprintf(stderr,
+			"mkgpt --io %s --sector-size %s -j %s failed\n", io,
+			sect_size, jobs);
+		return -1;
+	}
+
+	res->user = ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1e6;
+	res->sys = ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1e6;
+	res->max_rss = ru.ru_maxrss;
+	return 0;
+}
+
+static int
+compare_wall(const void *a, const void *b)
+{
+	const struct result *x = a, *y = b;
+	return x->wall < y->wall ? -1 : x->wall > y->wall;
+}
+
+static void
+report(const char *io, const char *sect_size, const char *jobs,
+	const struct result *res, int first)
+{
+	double mib = (double)parts * part_mib;
+
+	if (json) {
+		printf("%s\n\t{\"io\": \"%s\", \"sector_size\": %s, "
+		       "\"jobs\": %s, \"sparse\": %s, \"wall_s\": %.3f, "
+		       "\"mib_s\": %.1f, \"user_s\": %.3f, \"sys_s\": %.3f, "
+		       "\"max_rss_kib\": %ld, \"read_syscalls\": %llu, "
+		       "\"write_syscalls\": %llu, \"read_mib\": %.1f, "
+		       "\"write_mib\": %.1f}",
+			first ? "[" : ",", io, sect_size, jobs,
+			sparse ? "true" : "false", res->wall, mib / res->wall,
+			res->user, res->sys, res->max_rss, res->syscr,
+			res->syscw, res->rchar / 1048576.0,
+			res->wchar / 1048576.0);
+		return;
+	}
+
+	if (first) {
+		printf("io,sector_size,jobs,sparse,wall_s,mib_s,user_s,sys_s,"
+		       "max_rss_kib,read_syscalls,write_syscalls,read_mib,"
+		       "write_mib\n");
+	}
+	printf("%s,%s,%s,%d,%.3f,%.1f,%.3f,%.3f,%ld,%llu,%llu,%.1f,%.1f\n",
+		io, sect_size, jobs, sparse, res->wall, mib / res->wall,
+		res->user, res->sys, res->max_rss, res->syscr, res->syscw,
+		res->rchar / 1048576.0, res->wchar / 1048576.0);
+}
+
+static void
+dump_help(const char *fname)
+{
+	printf("Usage: %s [--mkgpt path] [--dir dir] [--parts n] "
+	       "[--part-size MiB] [--holes percent] [--io list] "
+	       "[--sector-sizes list] [--jobs list] [--runs n] [--sparse] "
+	       "[--json]\n"
+	       "  Lists are comma separated, see the README file for the "
+	       "defaults\n",
+		fname);
+}
+
+static int
+parse_opts(int argc, char *argv[])
+{
+	for (int i = 1; i < argc; i++) {
+		const char *arg = argv[i];
+		const char *val = i + 1 < argc ? argv[i + 1] : "";
+
+		if (!strcmp(arg, "--sparse")) {
+			sparse = 1;
+			continue;
+		} else if (!strcmp(arg, "--json")) {
+			json = 1;
+			continue;
+		} else if (!strcmp(arg, "--help") || !strcmp(arg, "-h")) {
+			dump_help(argv[0]);
+			exit(EXIT_SUCCESS);
+		}
+
+		i++;
+		if (!strcmp(arg, "--mkgpt")) {
+			mkgpt = val;
+		} else if (!strcmp(arg, "--dir")) {
+			dir = val;
+		} else if (!strcmp(arg, "--parts")) {
+			parts = atoi(val);
+			if (parts < 1 || parts > MAX_PARTS) {
+				fprintf(stderr, "need 1 to %d parts\n",
+					MAX_PARTS);
+				return -1;
+			}
+		} else if (!strcmp(arg, "--part-size")) {
+			part_mib = atol(val);
+			if (part_mib < 1) {
+				fprintf(stderr, "invalid part size (%s)\n",
+					val);
+				return -1;
+			}
+		} else if (!strcmp(arg, "--holes")) {
+			holes = atoi(val);
+			if (holes < 0 || holes > 100) {
+				fprintf(stderr, "holes must be 0 to 100%%\n");
+				return -1;
+			}
+		} else if (!strcmp(arg, "--io")) {
+			io_list = val;
+		} else if (!strcmp(arg, "--sector-sizes")) {
+			sector_list = val;
+		} else if (!strcmp(arg, "--jobs")) {
+			jobs_list = val;
+		} else if (!strcmp(arg, "--runs")) {
+			runs = atoi(val);
+			if (runs < 1 || runs > MAX_RUNS) {
+				fprintf(stderr, "need 1 to %d runs\n",
+					MAX_RUNS);
+				return -1;
+			}
+		} else {
+			fprintf(stderr, "unknown argument - %s\n", arg);
+			dump_help(argv[0]);
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/* Split a copy of a comma separated list, returns the number of items. */
+static int
+split(const char *str, char **items, int max)
+{
+	int n = 0;
+	char *save = NULL;
+	char *list = strdup(str);
+	if (list == NULL) {
+		return 0;
+	}
+	for (char *p = strtok_r(list, ",", &save); p != NULL && n < max;
+		p = strtok_r(NULL, ",", &save)) {
+		items[n++] = p;
+	}
+	return n;
+}
+
+int
+main(int argc, char *argv[])
+{
+	char *ios[16], *sects[16], *jobs[16];
+	struct result results[MAX_RUNS];
+	int first = 1, failed = 0;
+
+	if (parse_opts(argc, argv) != 0) {
+		exit(EXIT_FAILURE);
+	}
+	int n_io = split(io_list, ios, 16);
+	int n_sect = split(sector_list, sects, 16);
+	int n_jobs = split(jobs_list, jobs, 16);
+	if (n_io == 0 || n_sect == 0 || n_jobs == 0) {
+		fprintf(stderr, "nothing to benchmark\n");
+		exit(EXIT_FAILURE);
+	}
+
+	if (access(mkgpt, X_OK) != 0) {
+		fprintf(stderr, "no %s to run\n", mkgpt);
+		exit(EXIT_FAILURE);
+	}
+	if (generate() != 0) {
+		cleanup();
+		exit(EXIT_FAILURE);
+	}
+
+	for (int i = 0; i < n_io; i++) {
+		for (int s = 0; s < n_sect; s++) {
+			for (int j = 0; j < n_jobs; j++) {
+				int r;
+				for (r = 0; r < runs; r++) {
+					if (run(ios[i], sects[s], jobs[j],
+						    &results[r]) != 0) {
+						break;
+					}
+				}
+				if (r < runs) {
+					failed = 1;
+					continue;
+				}
+				qsort(results, runs, sizeof(*results),
+					compare_wall);
+				report(ios[i], sects[s], jobs[j],
+					&results[runs / 2], first);
+				first = 0;
+				fflush(stdout);
+			}
+		}
+	}
+	if (json && !first) {
+		printf("\n]\n");
+	}
+
+	cleanup();
+	exit(failed ? EXIT_FAILURE : EXIT_SUCCESS);
+}
@@ -0,0 +1,796 @@
+/* SPDX-License-Identifier: MIT */
+
+#define _GNU_SOURCE /* copy_file_range, SEEK_DATA, SEEK_HOLE */
+
+#include "copy.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#if defined(__linux__)
+#include <linux/fs.h>
+#include <sys/ioctl.h>
+#include <sys/sendfile.h>
+#endif
+
+/*
+ * Is the buffer all zeros? (Compares the buffer against itself shifted by one
+ * byte which lets memcmp do the heavy lifting.)
+ */
+int
+is_zero(const void *buf, size_t len)
+{
+	const uint8_t *p = buf;
+	return len == 0 || (p[0] == 0 && !memcmp(p, p + 1, len - 1));
+}
+
+/*
+ * Share as many whole file system blocks as possible between the files. Both
+ * offsets have to be block aligned for that, the unaligned tail (if any) is
+ * left for somebody else.
+ */
+static off_t
+copy_reflink(int out_fd, off_t out_off, int in_fd, off_t in_off, off_t length)
+{
+#if defined(__linux__) && defined(FICLONERANGE)
+	struct stat st;
+	if (fstat(out_fd, &st) != 0 || st.st_blksize <= 0) {
+		return 0;
+	}
+
+	off_t block = st.st_blksize;
+	off_t aligned = length - length % block;
+	if (out_off % block || in_off % block || aligned == 0) {
+		return 0;
+	}
+
+	struct file_clone_range range = {
+		.src_fd = in_fd,
+		.src_offset = in_off,
+		.src_length = aligned,
+		.dest_offset = out_off,
+	};
+	if (ioctl(out_fd, FICLONERANGE, &range) != 0) {
+		return 0;
+	}
+	return aligned;
+#else
+	(void)out_fd;
+	(void)out_off;
+	(void)in_fd;
+	(void)in_off;
+	(void)length;
+	return 0;
+#endif
+}
+
+/*
+ * Let the kernel copy, possibly without involving the page cache at all if
+ * the file system can do server-side or reflink copies.
+ */
+static off_t
+copy_file(int out_fd, off_t out_off, int in_fd, off_t in_off, off_t length)
+{
+#if defined(__linux__)
+	off_t done = 0;
+	while (done < length) {
+		loff_t in = in_off + done;
+		loff_t out = out_off + done;
+		ssize_t n = copy_file_range(
+			in_fd, &in, out_fd, &out, length - done, 0);
+		if (n < 0 && errno == EINTR) {
+			continue;
+		}
+		if (n <= 0) {
+			break; /* EOF, or not supported between these files */
+		}
+		done += n;
+	}
+	return done;
+#else
+	(void)out_fd;
+	(void)out_off;
+	(void)in_fd;
+	(void)in_off;
+	(void)length;
+	return 0;
+#endif
+}
+
+/*
+ * Older kernels can't copy_file_range across file systems but sendfile works
+ * for any regular input file. Note that this moves the output file offset.
+ */
+static off_t
+copy_sendfile(int out_fd, off_t out_off, int in_fd, off_t in_off, off_t length)
+{
+#if defined(__linux__)
+	if (lseek(out_fd, out_off, SEEK_SET) != out_off) {
+		return 0;
+	}
+
+	off_t done = 0;
+	while (done < length) {
+		off_t in = in_off + done;
+		ssize_t n = sendfile(out_fd, in_fd, &in, length - done);
+		if (n < 0 && errno == EINTR) {
+			continue;
+		}
+		if (n <= 0) {
+			break;
+		}
+		done += n;
+	}
+	return done;
+#else
+	(void)out_fd;
+	(void)out_off;
+	(void)in_fd;
+	(void)in_off;
+	(void)length;
+	return 0;
+#endif
+}
+
+static int
+write_all(int fd, const uint8_t *buf, size_t len, off_t off)
+{
+	while (len > 0) {
+		ssize_t n = pwrite(fd, buf, len, off);
+		if (n < 0 && errno == EINTR) {
+			continue;
+		}
+		if (n <= 0) {
+			return -1;
+		}
+		buf += n;
+		len -= n;
+		off += n;
+	}
+	return 0;
+}
+
+/*
+ * A pool of aligned buffers shared by all threads, so we don't allocate a new
+ * buffer for every chunk we copy.
+ */
+#define POOL_SIZE (64)
+
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static void *buffers[POOL_SIZE];
+static int pooled = 0;
+
+static void *
+buffer_get(void)
+{
+	void *buf = NULL;
+
+	pthread_mutex_lock(&pool_lock);
+	if (pooled > 0) {
+		buf = buffers[--pooled];
+	}
+	pthread_mutex_unlock(&pool_lock);
+
+	if (buf == NULL &&
+		posix_memalign(&buf, COPY_BUFFER_ALIGN, COPY_BUFFER_SIZE) != 0) {
+		return NULL;
+	}
+	return buf;
+}
+
+static void
+buffer_put(void *buf)
+{
+	pthread_mutex_lock(&pool_lock);
+	if (pooled < POOL_SIZE) {
+		buffers[pooled++] = buf;
+		buf = NULL;
+	}
+	pthread_mutex_unlock(&pool_lock);
+
+	free(buf);
+}
+
+/*
+ * Write the data runs in buf to out_fd; in sparse mode all-zero blocks are
+ * skipped (and added to *zeros), the output better be zero there already.
+ */
+static int
+write_runs(int out_fd, const uint8_t *buf, size_t len, off_t off,
+	size_t block, int sparse, off_t *zeros)
+{
+	size_t start = 0;
+	while (start < len) {
+		size_t end = len;
+		if (sparse) {
+			/* skip zero blocks, then find a data run */
+			while (start < len) {
+				size_t n = len - start < block ? len - start
+							       : block;
+				if (!is_zero(buf + start, n)) {
+					break;
+				}
+				start += n;
+				*zeros += n;
+			}
+			end = start;
+			while (end < len) {
+				size_t n = len - end < block ? len - end : block;
+				if (is_zero(buf + end, n)) {
+					break;
+				}
+				end += n;
+			}
+		}
+
+		if (end > start &&
+			write_all(out_fd, buf + start, end - start, off + start) !=
+				0) {
+			return -1;
+		}
+		start = end;
+	}
+	return 0;
+}
+
+/*
+ * The classic read/write loop.
+ */
+static off_t
+copy_buffered(const struct copy_output *out, off_t out_off, int in_fd,
+	off_t in_off, off_t length, size_t block, int sparse, off_t *zeros)
+{
+	uint8_t *buf = buffer_get();
+	if (buf == NULL) {
+		return -1;
+	}
+
+	off_t done = 0;
+	while (done < length) {
+		size_t want = COPY_BUFFER_SIZE;
+		if ((off_t)want > length - done) {
+			want = length - done;
+		}
+
+		ssize_t got = pread(in_fd, buf, want, in_off + done);
+		if (got < 0 && errno == EINTR) {
+			continue;
+		}
+		if (got < 0) {
+			buffer_put(buf);
+			return -1;
+		}
+		if (got == 0) {
+			break; /* image shrunk under us */
+		}
+
+		if (out->observe != NULL) {
+			out->observe(out->observe_ctx, buf, got, out_off + done);
+		}
+		if (out->sink != NULL) {
+			if (out->sink(out->sink_ctx, buf, got, out_off + done) !=
+				0) {
+				buffer_put(buf);
+				return -1;
+			}
+		} else if (write_runs(out->fd, buf, got, out_off + done, block,
+				   sparse, zeros) != 0) {
+			buffer_put(buf);
+			return -1;
+		}
+
+		done += got;
+	}
+
+	buffer_put(buf);
+	return done;
+}
+
+/*
+ * The read/write loop once more, but writing (and maybe reading) with
+ * O_DIRECT to stay out of the page cache. That only works for offsets and
+ * sizes that are multiples of the alignment, so the unaligned head and tail
+ * of the region still go through the page cache.
+ */
+static off_t
+copy_direct(const struct copy_output *out, off_t out_off, int in_fd,
+	int in_direct_fd, off_t in_off, off_t length, size_t block, int sparse,
+	off_t *zeros)
+{
+	off_t align = out->direct_align;
+	off_t head = (align - out_off % align) % align;
+	if (head > length) {
+		head = length;
+	}
+	off_t body = head + (length - head) - (length - head) % align;
+	off_t done = 0;
+
+	if (head > 0) {
+		done = copy_buffered(out, out_off, in_fd, in_off, head, block,
+			sparse, zeros);
+		if (done < head) {
+			return done;
+		}
+	}
+
+	uint8_t *buf = buffer_get();
+	if (buf == NULL) {
+		return -1;
+	}
+	if (block < (size_t)align) {
+		block = align; /* we can only skip whole aligned blocks */
+	}
+
+	while (done < body) {
+		size_t want = COPY_BUFFER_SIZE;
+		if ((off_t)want > body - done) {
+			want = body - done;
+		}
+
+		off_t pos = in_off + done;
+		int fd = in_direct_fd >= 0 && pos % align == 0 ? in_direct_fd
+							       : in_fd;
+		ssize_t got = pread(fd, buf, want, pos);
+		if (got < 0 && errno == EINTR) {
+			continue;
+		}
+		if (got < 0) {
+			buffer_put(buf);
+			return -1;
+		}
+		if (got == 0) {
+			break; /* image shrunk under us */
+		}
+
+		if (out->observe != NULL) {
+			out->observe(out->observe_ctx, buf, got, out_off + done);
+		}
+
+		size_t aligned = got - got % align;
+		if (write_runs(out->direct_fd, buf, aligned, out_off + done,
+			    block, sparse, zeros) != 0 ||
+			write_runs(out->fd, buf + aligned, got - aligned,
+				out_off + done + aligned, block, sparse,
+				zeros) != 0) {
+			buffer_put(buf);
+			return -1;
+		}
+
+		done += got;
+		if (aligned < (size_t)got) {
+			buffer_put(buf);
+			return done; /* short read, image shrunk */
+		}
+	}
+
+	buffer_put(buf);
+
+	if (done == body && done < length) {
+		off_t tail = copy_buffered(out, out_off + done, in_fd,
+			in_off + done, length - done, block, sparse, zeros);
+		if (tail < 0) {
+			return -1;
+		}
+		done += tail;
+	}
+
+	return done;
+}
+
+/*
+ * Copy len bytes into the output mapping; in sparse mode all-zero blocks are
+ * not copied (but added to *zeros) so their pages are never touched.
+ */
+static void
+put_mapped(uint8_t *out, const uint8_t *in, size_t len, size_t block,
+	int sparse, off_t *zeros)
+{
+	if (!sparse) {
+		memcpy(out, in, len);
+		return;
+	}
+
+	for (size_t i = 0; i < len; i += block) {
+		size_t n = len - i < block ? len - i : block;
+		if (!is_zero(in + i, n)) {
+			memcpy(out + i, in + i, n);
+		} else {
+			*zeros += n;
+		}
+	}
+}
+
+/*
+ * Copy from the input into the memory mapped output by mapping the input as
+ * well. If the input can't be mapped, we read it into a buffer instead.
+ */
+static off_t
+copy_mapped(const struct copy_output *out, off_t out_off, int in_fd,
+	off_t in_off, off_t length, size_t block, int sparse, off_t *zeros)
+{
+	uint8_t *out_map = out->map;
+	off_t delta = in_off % sysconf(_SC_PAGESIZE);
+	uint8_t *in = mmap(NULL, length + delta, PROT_READ, MAP_PRIVATE, in_fd,
+		in_off - delta);
+	if (in != MAP_FAILED) {
+		madvise(in, length + delta, MADV_SEQUENTIAL);
+		if (out->observe != NULL) {
+			out->observe(out->observe_ctx, in + delta, length,
+				out_off);
+		}
+		put_mapped(out_map + out_off, in + delta, length, block, sparse,
+			zeros);
+		munmap(in, length + delta);
+		return length;
+	}
+
+	uint8_t *buf = buffer_get();
+	if (buf == NULL) {
+		return -1;
+	}
+
+	off_t done = 0;
+	while (done < length) {
+		size_t want = COPY_BUFFER_SIZE;
+		if ((off_t)want > length - done) {
+			want = length - done;
+		}
+
+		ssize_t got = pread(in_fd, buf, want, in_off + done);
+		if (got < 0 && errno == EINTR) {
+			continue;
+		}
+		if (got < 0) {
+			buffer_put(buf);
+			return -1;
+		}
+		if (got == 0) {
+			break;
+		}
+
+		if (out->observe != NULL) {
+			out->observe(out->observe_ctx, buf, got, out_off + done);
+		}
+		put_mapped(out_map + out_off + done, buf, got, block, sparse,
+			zeros);
+		done += got;
+	}
+
+	buffer_put(buf);
+	return done;
+}
+
+/*
+ * Copy from a pipe (or anything else we can't seek in), which leaves read()
+ * as the only option. Everything else is just like the read/write loop.
+ */
+static off_t
+copy_stream(const struct copy_output *out, off_t out_off, int in_fd,
+	off_t length, size_t block, int sparse, off_t *zeros)
+{
+	uint8_t *buf = buffer_get();
+	if (buf == NULL) {
+		return -1;
+	}
+
+	off_t done = 0;
+	while (done < length) {
+		size_t want = COPY_BUFFER_SIZE;
+		if ((off_t)want > length - done) {
+			want = length - done;
+		}
+
+		ssize_t got = read(in_fd, buf, want);
+		if (got < 0 && errno == EINTR) {
+			continue;
+		}
+		if (got < 0) {
+			buffer_put(buf);
+			return -1;
+		}
+		if (got == 0) {
+			break; /* stream ended early */
+		}
+
+		if (out->observe != NULL) {
+			out->observe(out->observe_ctx, buf, got, out_off + done);
+		}
+		int err = 0;
+		if (out->sink != NULL) {
+			err = out->sink(out->sink_ctx, buf, got, out_off + done);
+		} else if (out->map != NULL) {
+			put_mapped((uint8_t *)out->map + out_off + done, buf, got,
+				block, sparse, zeros);
+		} else {
+			err = write_runs(out->fd, buf, got, out_off + done, block,
+				sparse, zeros);
+		}
+		if (err != 0) {
+			buffer_put(buf);
+			return -1;
+		}
+
+		done += got;
+	}
+
+	buffer_put(buf);
+	return done;
+}
+
+/*
+ * Copy a single data region, trying each of the allowed methods in turn and
+ * handing whatever is left to the next one. Zero blocks that sparse mode
+ * skipped are added to *zeros.
+ */
+static off_t
+copy_region(const struct copy_output *out, off_t out_off, int in_fd,
+	int in_direct_fd, off_t in_off, off_t length, size_t block, int flags,
+	off_t *zeros)
+{
+	int sparse = flags & COPY_SPARSE;
+	off_t done = 0;
+
+	if (out->sink != NULL) {
+		return copy_buffered(out, out_off, in_fd, in_off, length, block,
+			sparse, zeros);
+	}
+	if (out->map != NULL) {
+		return copy_mapped(out, out_off, in_fd, in_off, length, block,
+			sparse, zeros);
+	}
+
+	if (flags & COPY_REFLINK) {
+		done += copy_reflink(out->fd, out_off, in_fd, in_off, length);
+	}
+	/*
+	 * In sparse mode only the buffered loop can see zero blocks, and with
+	 * O_DIRECT we don't want the kernel to copy through the page cache.
+	 */
+	if (!sparse && out->direct_fd < 0) {
+		if (flags & COPY_RANGE && done < length) {
+			done += copy_file(out->fd, out_off + done, in_fd,
+				in_off + done, length - done);
+		}
+		if (flags & COPY_SENDFILE && done < length) {
+			done += copy_sendfile(out->fd, out_off + done, in_fd,
+				in_off + done, length - done);
+		}
+	}
+	if (done < length) {
+		off_t rest;
+		if (out->direct_fd >= 0) {
+			rest = copy_direct(out, out_off + done, in_fd,
+				in_direct_fd, in_off + done, length - done,
+				block, sparse, zeros);
+		} else {
+			rest = copy_buffered(out, out_off + done, in_fd,
+				in_off + done, length - done, block, sparse,
+				zeros);
+		}
+		if (rest < 0) {
+			return -1;
+		}
+		done += rest;
+	}
+
+	return done;
+}
+
+/*
+ * Copy length bytes at offset into the chunk, from a stream or otherwise.
+ */
+static off_t
+copy_piece(const struct copy_output *out, const struct copy_chunk *chunk,
+	off_t offset, off_t length, size_t block, int flags, off_t *zeros)
+{
+	if (chunk->in_stream) {
+		return copy_stream(out, chunk->out_off + offset, chunk->in_fd,
+			length, block, flags & COPY_SPARSE, zeros);
+	}
+	return copy_region(out, chunk->out_off + offset, chunk->in_fd,
+		chunk->in_direct_fd, chunk->in_off + offset, length, block,
+		flags, zeros);
+}
+
+/*
+ * copy_piece(), but if somebody wants to know how far along we are, in steps
+ * of COPY_PROGRESS_STEP with a report after each.
+ */
+static off_t
+copy_steps(const struct copy_output *out, const struct copy_chunk *chunk,
+	off_t offset, off_t length, size_t block, int flags)
+{
+	off_t zeros = 0;
+
+	if (out->progress == NULL) {
+		return copy_piece(
+			out, chunk, offset, length, block, flags, &zeros);
+	}
+
+	off_t done = 0;
+	while (done < length) {
+		off_t n = length - done;
+		if (n > COPY_PROGRESS_STEP) {
+			n = COPY_PROGRESS_STEP;
+		}
+		zeros = 0;
+		off_t got = copy_piece(
+			out, chunk, offset + done, n, block, flags, &zeros);
+		if (got < 0) {
+			return -1;
+		}
+		/* zero blocks sparse mode didn't write count as holes */
+		out->progress(out->progress_ctx, chunk, got - zeros, zeros);
+		done += got;
+		if (got < n) {
+			break; /* input ended early */
+		}
+	}
+	return done;
+}
+
+/* Tell whoever is interested that we skipped a hole. */
+static void
+skipped(const struct copy_output *out, const struct copy_chunk *chunk,
+	off_t length)
+{
+	if (out->progress != NULL && length > 0) {
+		out->progress(out->progress_ctx, chunk, 0, length);
+	}
+}
+
+/*
+ * Copy the chunk from its input to the output using the methods allowed by
+ * flags. In sparse mode, holes in the input (and blocks full of zeros) are
+ * skipped rather than written. Returns the number of bytes copied (or
+ * skipped), which is only short if the input is, or -1 on errors.
+ */
+off_t
+copy_range(const struct copy_output *out, const struct copy_chunk *chunk,
+	size_t block, int flags)
+{
+	int in_fd = chunk->in_fd;
+	off_t in_off = chunk->in_off;
+	off_t length = chunk->length;
+
+	if (out->progress != NULL) {
+		out->progress(out->progress_ctx, chunk, 0, 0);
+	}
+
+	if (chunk->in_stream || !(flags & COPY_SPARSE)) {
+		return copy_steps(out, chunk, 0, length, block, flags);
+	}
+
+	off_t offset = 0;
+	while (offset < length) {
+		off_t end = length;
+#if defined(SEEK_DATA) && defined(SEEK_HOLE)
+		off_t data = lseek(in_fd, in_off + offset, SEEK_DATA);
+		if (data < 0 && errno == ENXIO) {
+			skipped(out, chunk, length - offset);
+			break; /* only a hole left */
+		}
+		if (data >= 0) {
+			data -= in_off;
+			data -= data % block; /* may not be block aligned */
+			if (data > length) {
+				data = length;
+			}
+			if (data > offset) {
+				skipped(out, chunk, data - offset);
+				offset = data;
+			}
+			off_t hole = lseek(in_fd, in_off + offset, SEEK_HOLE);
+			if (hole >= 0 && hole - in_off < end) {
+				end = hole - in_off;
+			}
+		}
+#endif
+		if (offset >= length) {
+			break;
+		}
+
+		off_t done = copy_steps(
+			out, chunk, offset, end - offset, block, flags);
+		if (done < 0) {
+			return -1;
+		}
+		offset += done;
+		if (offset < end) {
+			return offset; /* input ended early */
+		}
+	}
+
+	return length;
+}
+
+/*
+ * State shared by the copy_chunks() workers. Chunks are handed out in order
+ * through next, so a worker that finishes early simply grabs more work.
+ */
+struct workers {
+	const struct copy_chunk *chunks;
+	size_t count;
+	atomic_size_t next;
+	atomic_int failed;
+	const struct copy_output *out;
+	size_t block;
+	int flags;
+};
+
+static void *
+worker(void *arg)
+{
+	struct workers *pool = arg;
+
+	while (!atomic_load(&pool->failed)) {
+		size_t i = atomic_fetch_add(&pool->next, 1);
+		if (i >= pool->count) {
+			break;
+		}
+
+		const struct copy_chunk *c = &pool->chunks[i];
+		if (copy_range(pool->out, c, pool->block, pool->flags) < 0) {
+			atomic_store(&pool->failed, 1);
+		}
+	}
+
+	return NULL;
+}
+
+/*
+ * Copy all the chunks using up to jobs threads. Everything is positional so
+ * the chunks can be copied in any order, but sendfile is out since it moves
+ * the shared output file offset. Returns 0 on success, -1 on errors.
+ */
+int
+copy_chunks(const struct copy_output *out, const struct copy_chunk *chunks,
+	size_t count, int jobs, size_t block, int flags)
+{
+	struct workers pool = {
+		.chunks = chunks,
+		.count = count,
+		.out = out,
+		.block = block,
+		.flags = flags,
+	};
+	atomic_init(&pool.next, 0);
+	atomic_init(&pool.failed, 0);
+
+	if (jobs > 1) {
+		pool.flags &= ~COPY_SENDFILE;
+	}
+	if ((size_t)jobs > count) {
+		jobs = count;
+	}
+
+	pthread_t *threads = NULL;
+	int started = 0;
+	if (jobs > 1) {
+		threads = calloc(jobs - 1, sizeof(*threads));
+	}
+	if (threads != NULL) {
+		while (started < jobs - 1 &&
+			pthread_create(&threads[started], NULL, worker,
+				&pool) == 0) {
+			started++;
+		}
+	}
+
+	/* the calling thread pitches in, so jobs == 1 needs no threads */
+	worker(&pool);
+
+	for (int i = 0; i < started; i++) {
+		pthread_join(threads[i], NULL);
+	}
+	free(threads);
+
+	return atomic_load(&pool.failed) ? -1 : 0;
+}
@@ -0,0 +1,88 @@
+#pragma once
+
+/* SPDX-License-Identifier: MIT */
+
+#ifndef COPY_H
+#define COPY_H
+
+#include <stddef.h>
+#include <sys/types.h>
+
+/*
+ * Ways of getting data from one file into another, tried in the order listed
+ * here. A plain read/write loop is always the last resort and therefore not
+ * a flag.
+ */
+#define COPY_REFLINK 0x01 /* share extents (FICLONERANGE) */
+#define COPY_RANGE 0x02 /* copy_file_range(2) */
+#define COPY_SENDFILE 0x04 /* sendfile(2), moves the output file offset! */
+#define COPY_SPARSE 0x08 /* skip holes and all-zero blocks */
+
+#define COPY_AUTO (COPY_REFLINK | COPY_RANGE | COPY_SENDFILE)
+
+/* Size and alignment of the buffers used by the read/write loop. */
+#define COPY_BUFFER_SIZE (1024U * 1024U)
+#define COPY_BUFFER_ALIGN (4096U)
+
+/* Size of the pieces copy_chunks() splits large copies into. */
+#define COPY_CHUNK_SIZE (16U * 1024U * 1024U)
+
+/* How much gets copied between calls to the progress callback (at most). */
+#define COPY_PROGRESS_STEP (16U * 1024U * 1024U)
+
+struct copy_chunk;
+
+/* Where copies go. */
+struct copy_output {
+	int fd;
+	int direct_fd; /* the same file opened with O_DIRECT, or -1 */
+	size_t direct_align; /* offsets and sizes for direct_fd */
+	void *map; /* the file mapped into memory, or NULL */
+	/*
+	 * If not NULL, called with the data we copy as we read it. In order
+	 * only if we copy with a single job, and never for data the kernel
+	 * copies for us.
+	 */
+	void (*observe)(void *ctx, const void *buf, size_t len, off_t off);
+	void *observe_ctx;
+	/*
+	 * If not NULL, the data goes here instead of into fd: a writer that
+	 * can only go forward, so this means a single job and the read/write
+	 * loop. Whatever is skipped over (holes in sparse mode) is zeros.
+	 */
+	int (*sink)(void *ctx, const void *buf, size_t len, off_t off);
+	void *sink_ctx;
+	/*
+	 * If not NULL, called whenever a piece of a chunk is done: data bytes
+	 * were copied, holes bytes (holes in the input, or blocks of zeros)
+	 * were skipped in sparse mode. Called once
+	 * with both 0 when work on the chunk starts, and from whichever thread
+	 * does the work.
+	 */
+	void (*progress)(void *ctx, const struct copy_chunk *chunk, off_t data,
+		off_t holes);
+	void *progress_ctx;
+};
+
+/* A piece of work for copy_chunks(). */
+struct copy_chunk {
+	off_t out_off;
+	off_t in_off;
+	off_t length;
+	int in_fd;
+	int in_direct_fd; /* the same file opened with O_DIRECT, or -1 */
+	int in_stream; /* in_fd is a pipe, read it in order (in_off is 0) */
+};
+
+int
+is_zero(const void *buf, size_t len);
+
+off_t
+copy_range(const struct copy_output *out, const struct copy_chunk *chunk,
+	size_t block, int flags);
+
+int
+copy_chunks(const struct copy_output *out, const struct copy_chunk *chunks,
+	size_t count, int jobs, size_t block, int flags);
+
+#endif
@@ -19,11 +19,29 @@ Abstract:
 
   Modified to avoid EFI dependencies for mkgpt
   Modified to include a proper header file
+  Modified to add a streaming interface with slice-by-16 and hardware
+  (PCLMULQDQ, ARMv8 CRC32) implementations
 
 --*/
 
 #include "crc32.h"
 
+#include <pthread.h>
+#include <string.h>
+
+#if defined(__GNUC__) && defined(__x86_64__)
+#include <immintrin.h>
+#define HAVE_PCLMUL
+#endif
+
+#if defined(__GNUC__) && defined(__aarch64__) && defined(__linux__)
+#include <arm_acle.h>
+#include <sys/auxv.h>
+#if defined(HWCAP_CRC32)
+#define HAVE_ARM_CRC32
+#endif
+#endif
+
 static uint32_t mCrcTable[256] = {0x00000000, 0x77073096, 0xEE0E612C,
 	0x990951BA, 0x076DC419, 0x706AF48F, 0xE963A535, 0x9E6495A3, 0x0EDB8832,
 	0x79DCB8A4, 0xE0D5E91E, 0x97D2D988, 0x09B64C2B, 0x7EB17CBD, 0xE7B82D07,
@@ -69,6 +87,319 @@ static uint32_t mCrcTable[256] = {0x00000000, 0x77073096, 0xEE0E612C,
 	0xC4614AB8, 0x5D681B02, 0x2A6F2B94, 0xB40BBE37, 0xC30C8EA1, 0x5A05DF1B,
 	0x2D02EF8D};
 
+/* The reflected polynomial, mCrcTable[128] */
+#define POLY (0xedb88320U)
+
+/*
+ * mCrcTable is the first of these, the others are derived from it on first
+ * use so we don't have to carry 15 more pages of hex numbers around.
+ */
+static uint32_t sliceTable[16][256];
+
+/* x2nTable[n] is x^(2^n) modulo POLY, used for combining CRCs */
+static uint32_t x2nTable[32];
+
+static uint32_t (*update)(uint32_t, const uint8_t *, size_t);
+
+static pthread_once_t once = PTHREAD_ONCE_INIT;
+
+uint32_t
+crc32_update_bytewise(uint32_t crc, const void *buf, size_t len)
+{
+	const uint8_t *p = buf;
+
+	while (len--) {
+		crc = (crc >> 8) ^ mCrcTable[(uint8_t)crc ^ *p++];
+	}
+	return crc;
+}
+
+static uint32_t
+slice16(uint32_t crc, const uint8_t *p, size_t len)
+{
+	while (len >= 16) {
+		uint32_t a = crc ^ ((uint32_t)p[0] | (uint32_t)p[1] << 8 |
+					   (uint32_t)p[2] << 16 |
+					   (uint32_t)p[3] << 24);
+		crc = sliceTable[15][a & 0xff] ^ sliceTable[14][a >> 8 & 0xff] ^
+		      sliceTable[13][a >> 16 & 0xff] ^ sliceTable[12][a >> 24] ^
+		      sliceTable[11][p[4]] ^ sliceTable[10][p[5]] ^
+		      sliceTable[9][p[6]] ^ sliceTable[8][p[7]] ^
+		      sliceTable[7][p[8]] ^ sliceTable[6][p[9]] ^
+		      sliceTable[5][p[10]] ^ sliceTable[4][p[11]] ^
+		      sliceTable[3][p[12]] ^ sliceTable[2][p[13]] ^
+		      sliceTable[1][p[14]] ^ sliceTable[0][p[15]];
+		p += 16;
+		len -= 16;
+	}
+	return crc32_update_bytewise(crc, p, len);
+}
+
+#if defined(HAVE_PCLMUL)
+/*
+ * Folding with carry-less multiplication as described in Intel's "Fast CRC
+ * Computation for Generic Polynomials Using PCLMULQDQ Instruction" paper; the
+ * constants are the bit-reflected ones for POLY from its appendix. Handles
+ * 64 bytes or more, in multiples of 16.
+ */
+__attribute__((target("pclmul,sse4.1"))) static uint32_t
+fold(uint32_t crc, const uint8_t *p, size_t len)
+{
+	const __m128i k1k2 = _mm_set_epi64x(0x01c6e41596, 0x0154442bd4);
+	const __m128i k3k4 = _mm_set_epi64x(0x00ccaa009e, 0x01751997d0);
+	const __m128i k5k0 = _mm_set_epi64x(0x0000000000, 0x0163cd6124);
+	const __m128i poly = _mm_set_epi64x(0x01f7011641, 0x01db710641);
+	const __m128i mask = _mm_setr_epi32(~0, 0, ~0, 0);
+	__m128i x1, x2, x3, x4, x5, x6, x7, x8;
+
+	x1 = _mm_loadu_si128((const __m128i *)(p + 0x00));
+	x2 = _mm_loadu_si128((const __m128i *)(p + 0x10));
+	x3 = _mm_loadu_si128((const __m128i *)(p + 0x20));
+	x4 = _mm_loadu_si128((const __m128i *)(p + 0x30));
+	x1 = _mm_xor_si128(x1, _mm_cvtsi32_si128(crc));
+	p += 64;
+	len -= 64;
+
+	/* fold 64 bytes at a time */
+	while (len >= 64) {
+		x5 = _mm_clmulepi64_si128(x1, k1k2, 0x00);
+		x6 = _mm_clmulepi64_si128(x2, k1k2, 0x00);
+		x7 = _mm_clmulepi64_si128(x3, k1k2, 0x00);
+		x8 = _mm_clmulepi64_si128(x4, k1k2, 0x00);
+		x1 = _mm_clmulepi64_si128(x1, k1k2, 0x11);
+		x2 = _mm_clmulepi64_si128(x2, k1k2, 0x11);
+		x3 = _mm_clmulepi64_si128(x3, k1k2, 0x11);
+		x4 = _mm_clmulepi64_si128(x4, k1k2, 0x11);
+		x1 = _mm_xor_si128(_mm_xor_si128(x1, x5),
+			_mm_loadu_si128((const __m128i *)(p + 0x00)));
+		x2 = _mm_xor_si128(_mm_xor_si128(x2, x6),
+			_mm_loadu_si128((const __m128i *)(p + 0x10)));
+		x3 = _mm_xor_si128(_mm_xor_si128(x3, x7),
+			_mm_loadu_si128((const __m128i *)(p + 0x20)));
+		x4 = _mm_xor_si128(_mm_xor_si128(x4, x8),
+			_mm_loadu_si128((const __m128i *)(p + 0x30)));
+		p += 64;
+		len -= 64;
+	}
+
+	/* fold the four lanes into one */
+	x5 = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+	x1 = _mm_clmulepi64_si128(x1, k3k4, 0x11);
+	x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+	x5 = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+	x1 = _mm_clmulepi64_si128(x1, k3k4, 0x11);
+	x1 = _mm_xor_si128(_mm_xor_si128(x1, x3), x5);
+	x5 = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+	x1 = _mm_clmulepi64_si128(x1, k3k4, 0x11);
+	x1 = _mm_xor_si128(_mm_xor_si128(x1, x4), x5);
+
+	/* fold 16 bytes at a time */
+	while (len >= 16) {
+		x2 = _mm_loadu_si128((const __m128i *)p);
+		x5 = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+		x1 = _mm_clmulepi64_si128(x1, k3k4, 0x11);
+		x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+		p += 16;
+		len -= 16;
+	}
+
+	/* fold 128 bits down to 64 bits */
+	x2 = _mm_clmulepi64_si128(x1, k3k4, 0x10);
+	x1 = _mm_xor_si128(_mm_srli_si128(x1, 8), x2);
+	x2 = _mm_srli_si128(x1, 4);
+	x1 = _mm_and_si128(x1, mask);
+	x1 = _mm_clmulepi64_si128(x1, k5k0, 0x00);
+	x1 = _mm_xor_si128(x1, x2);
+
+	/* Barrett reduction down to 32 bits */
+	x2 = _mm_and_si128(x1, mask);
+	x2 = _mm_clmulepi64_si128(x2, poly, 0x10);
+	x2 = _mm_and_si128(x2, mask);
+	x2 = _mm_clmulepi64_si128(x2, poly, 0x00);
+	x1 = _mm_xor_si128(x1, x2);
+
+	return _mm_extract_epi32(x1, 1);
+}
+
+static uint32_t
+hardware(uint32_t crc, const uint8_t *p, size_t len)
+{
+	if (len >= 64) {
+		size_t n = len & ~(size_t)15;
+		crc = fold(crc, p, n);
+		p += n;
+		len -= n;
+	}
+	return slice16(crc, p, len);
+}
+
+static int
+have_hardware(void)
+{
+	__builtin_cpu_init();
+	return __builtin_cpu_supports("pclmul") &&
+	       __builtin_cpu_supports("sse4.1");
+}
+#elif defined(HAVE_ARM_CRC32)
+/*
+ * ARMv8 has instructions for exactly this polynomial.
+ */
+__attribute__((target("+crc"))) static uint32_t
+hardware(uint32_t crc, const uint8_t *p, size_t len)
+{
+	while (len >= 8) {
+		uint64_t v;
+		memcpy(&v, p, sizeof(v));
+		crc = __crc32d(crc, v);
+		p += 8;
+		len -= 8;
+	}
+	while (len--) {
+		crc = __crc32b(crc, *p++);
+	}
+	return crc;
+}
+
+static int
+have_hardware(void)
+{
+	return (getauxval(AT_HWCAP) & HWCAP_CRC32) != 0;
+}
+#else
+static uint32_t
+hardware(uint32_t crc, const uint8_t *p, size_t len)
+{
+	return slice16(crc, p, len);
+}
+
+static int
+have_hardware(void)
+{
+	return 0;
+}
+#endif
+
+/*
+ * Multiply a and b modulo POLY (all bit-reflected, so x^0 is 1 << 31).
+ */
+static uint32_t
+multmodp(uint32_t a, uint32_t b)
+{
+	uint32_t m = (uint32_t)1 << 31;
+	uint32_t p = 0;
+
+	for (;;) {
+		if (a & m) {
+			p ^= b;
+			if ((a & (m - 1)) == 0) {
+				break;
+			}
+		}
+		m >>= 1;
+		b = b & 1 ? (b >> 1) ^ POLY : b >> 1;
+	}
+	return p;
+}
+
+/*
+ * Return x^(n * 2^k) modulo POLY.
+ */
+static uint32_t
+x2nmodp(uint64_t n, unsigned k)
+{
+	uint32_t p = (uint32_t)1 << 31;
+
+	while (n) {
+		if (n & 1) {
+			p = multmodp(x2nTable[k & 31], p);
+		}
+		n >>= 1;
+		k++;
+	}
+	return p;
+}
+
+static void
+init(void)
+{
+	memcpy(sliceTable[0], mCrcTable, sizeof(mCrcTable));
+	for (int k = 1; k < 16; k++) {
+		for (int i = 0; i < 256; i++) {
+			uint32_t c = sliceTable[k - 1][i];
+			sliceTable[k][i] = (c >> 8) ^ mCrcTable[c & 0xff];
+		}
+	}
+
+	uint32_t p = (uint32_t)1 << 30; /* x^1 */
+	x2nTable[0] = p;
+	for (int n = 1; n < 32; n++) {
+		x2nTable[n] = p = multmodp(p, p);
+	}
+
+	update = have_hardware() ? hardware : slice16;
+}
+
+uint32_t
+crc32_update_slice16(uint32_t crc, const void *buf, size_t len)
+{
+	pthread_once(&once, init);
+	return slice16(crc, buf, len);
+}
+
+uint32_t
+crc32_update_hardware(uint32_t crc, const void *buf, size_t len)
+{
+	pthread_once(&once, init);
+	return hardware(crc, buf, len);
+}
+
+int
+crc32_hardware(void)
+{
+	pthread_once(&once, init);
+	return update == hardware;
+}
+
+uint32_t
+crc32_init(void)
+{
+	return 0xffffffff;
+}
+
+uint32_t
+crc32_update(uint32_t crc, const void *buf, size_t len)
+{
+	pthread_once(&once, init);
+	return update(crc, buf, len);
+}
+
+/*
+ * Same as crc32_update() with len zero bytes, but in O(log(len)) time.
+ */
+uint32_t
+crc32_update_zeros(uint32_t crc, uint64_t len)
+{
+	pthread_once(&once, init);
+	return multmodp(x2nmodp(len, 3), crc);
+}
+
+uint32_t
+crc32_final(uint32_t crc)
+{
+	return crc ^ 0xffffffff;
+}
+
+/*
+ * Given the (final) CRCs of two blocks of data, the second len2 bytes long,
+ * return the CRC of both blocks back to back.
+ */
+uint32_t
+crc32_combine(uint32_t crc1, uint32_t crc2, uint64_t len2)
+{
+	pthread_once(&once, init);
+	return multmodp(x2nmodp(len2, 3), crc1) ^ crc2;
+}
+
 int
 CalculateCrc32(uint8_t *Data, size_t DataSize, uint32_t *CrcOut)
 /*++
@@ -87,24 +418,15 @@ Arguments:
 Returns:
 
   EFI_SUCCESS               - Calculation is successful.
-  EFI_INVALID_PARAMETER     - Data / CrcOut = NULL, or DataSize = 0
+  EFI_INVALID_PARAMETER     - Data / CrcOut = NULL
 
 --*/
 {
-	uint32_t Crc;
-	size_t Index;
-	uint8_t *Ptr;
-
-	if ((DataSize == 0) || (Data == NULL) || (CrcOut == NULL)) {
+	if ((Data == NULL && DataSize != 0) || (CrcOut == NULL)) {
 		return -1;
 	}
 
-	Crc = 0xffffffff;
-	for (Index = 0, Ptr = Data; Index < DataSize; Index++, Ptr++) {
-		Crc = (Crc >> 8) ^ mCrcTable[(uint8_t)Crc ^ *Ptr];
-	}
-
-	*CrcOut = Crc ^ 0xffffffff;
+	*CrcOut = crc32_final(crc32_update(crc32_init(), Data, DataSize));
 
 	return 0;
 }
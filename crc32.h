@@ -8,6 +8,32 @@
 #include <stddef.h>
 #include <stdint.h>
 
+/*
+ * Streaming interface: start with crc32_init(), feed data through any number
+ * of crc32_update() calls, then get the CRC from crc32_final().
+ */
+uint32_t
+crc32_init(void);
+uint32_t
+crc32_update(uint32_t crc, const void *buf, size_t len);
+uint32_t
+crc32_update_zeros(uint32_t crc, uint64_t len);
+uint32_t
+crc32_final(uint32_t crc);
+
+uint32_t
+crc32_combine(uint32_t crc1, uint32_t crc2, uint64_t len2);
+
+/* The individual implementations, for testing and benchmarking. */
+uint32_t
+crc32_update_bytewise(uint32_t crc, const void *buf, size_t len);
+uint32_t
+crc32_update_slice16(uint32_t crc, const void *buf, size_t len);
+uint32_t
+crc32_update_hardware(uint32_t crc, const void *buf, size_t len);
+int
+crc32_hardware(void);
+
 int
 CalculateCrc32(uint8_t *Data, size_t DataSize, uint32_t *CrcOut);
 
@@ -1,4 +1,15 @@
+bench-crc32.o: bench-crc32.c crc32.h
+bench-mkgpt.o: bench-mkgpt.c
+copy.o: copy.c copy.h
 crc32.o: crc32.c crc32.h
+gpt.o: gpt.c gpt.h guid.h crc32.h unaligned.h
 guid.o: guid.c guid.h unaligned.h
-mkgpt.o: mkgpt.c crc32.h guid.h part_ids.h unaligned.h
+libmkgpt.o: libmkgpt.c libmkgpt.h guid.h gpt.h unaligned.h
+mkgpt.o: mkgpt.c copy.h crc32.h gpt.h guid.h libmkgpt.h part_ids.h \
+ qcow2.h sha256.h simg.h unaligned.h uring.h verify.h
 part_ids.o: part_ids.c part_ids.h guid.h
+qcow2.o: qcow2.c qcow2.h copy.h unaligned.h
+sha256.o: sha256.c sha256.h unaligned.h
+simg.o: simg.c simg.h crc32.h unaligned.h
+uring.o: uring.c uring.h copy.h
+verify.o: verify.c verify.h gpt.h guid.h unaligned.h
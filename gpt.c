@@ -0,0 +1,214 @@
+/* SPDX-License-Identifier: MIT */
+
+/*
+ * Reading back a GPT we (or somebody else) wrote earlier.
+ */
+
+#include "gpt.h"
+#include "crc32.h"
+#include "unaligned.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+static int
+read_all(int fd, void *buf, size_t len, off_t off)
+{
+	uint8_t *p = buf;
+
+	while (len > 0) {
+		ssize_t n = pread(fd, p, len, off);
+		if (n < 0 && errno == EINTR) {
+			continue;
+		}
+		if (n <= 0) {
+			return -1;
+		}
+		p += n;
+		len -= n;
+		off += n;
+	}
+	return 0;
+}
+
+static int
+write_all(int fd, const void *buf, size_t len, off_t off)
+{
+	const uint8_t *p = buf;
+
+	while (len > 0) {
+		ssize_t n = pwrite(fd, p, len, off);
+		if (n < 0 && errno == EINTR) {
+			continue;
+		}
+		if (n <= 0) {
+			return -1;
+		}
+		p += n;
+		len -= n;
+		off += n;
+	}
+	return 0;
+}
+
+/*
+ * Read the GPT header at lba and the entry array it points to. Complains on
+ * stderr and returns -1 if anything doesn't check out.
+ */
+int
+gpt_read(int fd, size_t sect_size, uint64_t lba, struct gpt *gpt)
+{
+	uint8_t hdr[4096];
+
+	memset(gpt, 0, sizeof(*gpt));
+
+	if (sect_size > sizeof(hdr) ||
+		read_all(fd, hdr, sect_size, (off_t)(lba * sect_size)) != 0) {
+		fprintf(stderr, "unable to read GPT header at LBA %llu\n",
+			(unsigned long long)lba);
+		return -1;
+	}
+
+	if (get_u64(hdr + 0) != 0x5452415020494645ULL) {
+		fprintf(stderr, "no GPT header at LBA %llu\n",
+			(unsigned long long)lba);
+		return -1;
+	}
+
+	uint32_t hdr_size = get_u32(hdr + 12);
+	if (hdr_size < 92 || hdr_size > sect_size ||
+		hdr_size > sizeof(gpt->header)) {
+		fprintf(stderr, "invalid GPT header size (%u)\n", hdr_size);
+		return -1;
+	}
+	uint32_t crc = get_u32(hdr + 16);
+	set_u32(hdr + 16, 0);
+	if (crc32_final(crc32_update(crc32_init(), hdr, hdr_size)) != crc) {
+		fprintf(stderr, "bad GPT header CRC at LBA %llu\n",
+			(unsigned long long)lba);
+		return -1;
+	}
+	set_u32(hdr + 16, crc);
+
+	memcpy(gpt->header, hdr, hdr_size);
+	gpt->header_size = hdr_size;
+	gpt->my_lba = get_u64(hdr + 24);
+	gpt->alternate_lba = get_u64(hdr + 32);
+	gpt->first_usable_lba = get_u64(hdr + 40);
+	gpt->last_usable_lba = get_u64(hdr + 48);
+	bytestring_to_guid(&gpt->disk_guid, hdr + 56);
+	gpt->entries_lba = get_u64(hdr + 72);
+	gpt->entry_count = get_u32(hdr + 80);
+	gpt->entry_size = get_u32(hdr + 84);
+
+	if (gpt->my_lba != lba) {
+		fprintf(stderr, "GPT header at LBA %llu claims to be at %llu\n",
+			(unsigned long long)lba,
+			(unsigned long long)gpt->my_lba);
+		return -1;
+	}
+	if (gpt->entry_size < 128 || gpt->entry_size % 8 ||
+		gpt->entry_count > GPT_MAX_ENTRIES) {
+		fprintf(stderr, "unsupported GPT entry array (%u x %u bytes)\n",
+			gpt->entry_count, gpt->entry_size);
+		return -1;
+	}
+
+	size_t len = (size_t)gpt->entry_count * gpt->entry_size;
+	gpt->entries = malloc(len > 0 ? len : 1);
+	if (gpt->entries == NULL) {
+		fprintf(stderr, "out of memory reading GPT\n");
+		return -1;
+	}
+	if (read_all(fd, gpt->entries, len,
+		    (off_t)(gpt->entries_lba * sect_size)) != 0) {
+		fprintf(stderr, "unable to read GPT entries at LBA %llu\n",
+			(unsigned long long)gpt->entries_lba);
+		gpt_free(gpt);
+		return -1;
+	}
+	if (crc32_final(crc32_update(crc32_init(), gpt->entries, len)) !=
+		get_u32(hdr + 88)) {
+		fprintf(stderr, "bad GPT entry array CRC at LBA %llu\n",
+			(unsigned long long)gpt->entries_lba);
+		gpt_free(gpt);
+		return -1;
+	}
+
+	return 0;
+}
+
+void
+gpt_free(struct gpt *gpt)
+{
+	free(gpt->entries);
+	gpt->entries = NULL;
+}
+
+/*
+ * Fill in PartitionEntryArrayCRC32 and then HeaderCRC32 of a header whose
+ * other fields are all set; entries is the array the header describes.
+ */
+void
+gpt_seal(uint8_t *header, const uint8_t *entries)
+{
+	size_t len = (size_t)get_u32(header + 80) * get_u32(header + 84);
+
+	set_u32(header + 88,
+		crc32_final(crc32_update(crc32_init(), entries, len)));
+	set_u32(header + 16, 0);
+	set_u32(header + 16, crc32_final(crc32_update(crc32_init(), header,
+					     get_u32(header + 12))));
+}
+
+/*
+ * Seal header and write it to its MyLBA, after writing entries to its
+ * PartitionEntryLBA; the header only goes out once the entries are in place.
+ */
+int
+gpt_write(int fd, size_t sect_size, uint8_t *header, const uint8_t *entries)
+{
+	size_t len = (size_t)get_u32(header + 80) * get_u32(header + 84);
+
+	gpt_seal(header, entries);
+
+	if (write_all(fd, entries, len,
+		    (off_t)(get_u64(header + 72) * sect_size)) != 0 ||
+		write_all(fd, header, get_u32(header + 12),
+			(off_t)(get_u64(header + 24) * sect_size)) != 0) {
+		fprintf(stderr, "unable to write GPT at LBA %llu (%s)\n",
+			(unsigned long long)get_u64(header + 24),
+			strerror(errno));
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Store name as the PartitionName of a GPT entry, replacing whatever was there.
+ */
+void
+gpt_set_name(uint8_t *entry, const char *name)
+{
+	/*
+	 * TODO settle missing UTF-16LE conversion issue somehow,
+	 * possibly by simply limiting the tool to ASCII here?
+	 * TODO used to be "&& char_id < 35" but GPT_NAME_LENGTH is 36
+	 * now so which is correct? do we need a "double zero" at the
+	 * end or not? what does the spec say? sfdisk works with 36
+	 * chars and if we try 37 it just ignores the extra one, so
+	 * there's some indication that no "double zero" is needed and
+	 * that 36 is indeed the correct limit
+	 */
+	memset(entry + GPT_ENTRY_NAME, 0, GPT_ENTRY_SIZE - GPT_ENTRY_NAME);
+	size_t len = strlen(name);
+	if (len > GPT_NAME_LENGTH) {
+		len = GPT_NAME_LENGTH;
+	}
+	for (size_t char_id = 0; char_id < len; char_id++) {
+		set_u16(entry + GPT_ENTRY_NAME + char_id * 2, name[char_id]);
+	}
+}
@@ -0,0 +1,75 @@
+#pragma once
+
+/* SPDX-License-Identifier: MIT */
+
+#ifndef GPT_H
+#define GPT_H
+
+#include "guid.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * An existing GPT as found on disk: the interesting header fields and the raw
+ * partition entry array, both checked against their CRCs.
+ */
+struct gpt {
+	uint8_t header[512]; /* raw, the first header_size bytes matter */
+	uint32_t header_size;
+	uint64_t my_lba;
+	uint64_t alternate_lba;
+	uint64_t first_usable_lba;
+	uint64_t last_usable_lba;
+	GUID disk_guid;
+	uint64_t entries_lba;
+	uint32_t entry_count;
+	uint32_t entry_size;
+	uint8_t *entries; /* entry_count * entry_size bytes */
+};
+
+/*
+ * UEFI says 128 is the "minimum size" but since we're generating the image we
+ * get to pick; and we're fine with 128 for now; anything else would probably
+ * also mess with other GPT tools?
+ */
+#define GPT_ENTRY_SIZE (128U)
+
+/*
+ * TODO Everything else says 92 instead, and that's also what gdisk does when
+ * it creates a GPT. It's a mystery why the code here uses 96 instead.
+ */
+#define GPT_HEADER_SIZE (96U)
+
+/* Sanity limit, that's 32 MiB worth of 128 byte entries. */
+#define GPT_MAX_ENTRIES (256U * 1024U)
+
+/* PartitionName is 36 UTF-16LE code units. */
+#define GPT_NAME_LENGTH (36U)
+
+/* Offsets of the fields in a partition entry. */
+#define GPT_ENTRY_TYPE 0
+#define GPT_ENTRY_UUID 16
+#define GPT_ENTRY_FIRST_LBA 32
+#define GPT_ENTRY_LAST_LBA 40
+#define GPT_ENTRY_ATTRS 48
+#define GPT_ENTRY_NAME 56
+
+int
+gpt_read(int fd, size_t sect_size, uint64_t lba, struct gpt *gpt);
+void
+gpt_free(struct gpt *gpt);
+void
+gpt_seal(uint8_t *header, const uint8_t *entries);
+int
+gpt_write(int fd, size_t sect_size, uint8_t *header, const uint8_t *entries);
+void
+gpt_set_name(uint8_t *entry, const char *name);
+
+static inline uint8_t *
+gpt_entry(const struct gpt *gpt, uint32_t i)
+{
+	return gpt->entries + (size_t)i * gpt->entry_size;
+}
+
+#endif
@@ -27,6 +27,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <time.h>
+#include <unistd.h>
 
 #define GUID_FMT                                                               \
 	"%08X-%04hX-%04hX-%02hhX%02hhX-%02hhX%02hhX%02hhX%02hhX%02hhX%02hhX"
@@ -66,6 +67,26 @@ string_to_guid(GUID *guid, const char *str)
 	return 0;
 }
 
+int
+bytestring_to_guid(GUID *guid, const uint8_t *bytes)
+{
+	if (guid == NULL) {
+		return -1;
+	}
+	if (bytes == NULL) {
+		return -1;
+	}
+
+	guid->data1 = get_u32(bytes + 0);
+	guid->data2 = get_u16(bytes + 4);
+	guid->data3 = get_u16(bytes + 6);
+	for (int i = 0; i < 8; i++) {
+		guid->data4[i] = bytes[8 + i];
+	}
+
+	return 0;
+}
+
 int
 guid_to_bytestring(uint8_t *bytes, const GUID *guid)
 {
@@ -112,6 +133,19 @@ rnd()
 	return random() & 0xff; /* just a byte please */
 }
 
+static int initialized = 0;
+
+/*
+ * A forked child starts out with its parent's random() state and would hand
+ * out the same GUIDs as its siblings; mixing in the pid keeps them apart.
+ */
+void
+reseed_guid(void)
+{
+	srandom(time(NULL) ^ (unsigned)getpid() << 16);
+	initialized = 1;
+}
+
 int
 random_guid(GUID *guid)
 {
@@ -119,7 +153,6 @@ random_guid(GUID *guid)
 		return -1;
 	}
 
-	static int initialized = 0;
 	if (!initialized) {
 		srandom(time(NULL));
 		initialized = 1;
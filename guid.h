@@ -39,7 +39,6 @@ typedef struct _guid {
 #define GUID_STRING_LENGTH 36
 #define GUID_BYTESTRING_LENGTH 16
 
-/* TODO never actually used? */
 int
 guid_to_string(char *str, const GUID *guid);
 
@@ -48,7 +47,11 @@ string_to_guid(GUID *guid, const char *str);
 int
 guid_to_bytestring(uint8_t *bytes, const GUID *guid);
 int
+bytestring_to_guid(GUID *guid, const uint8_t *bytes);
+int
 random_guid(GUID *guid);
+void
+reseed_guid(void);
 int
 guid_is_zero(const GUID *guid);
 
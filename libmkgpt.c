@@ -0,0 +1,290 @@
+/* SPDX-License-Identifier: MIT */
+
+/*
+ * The part of mkgpt that doesn't touch any files: working out where the
+ * partitions and both GPTs go, and turning that into the protective MBR and
+ * the GPT headers and entries. Writing is up to a callback, so this can be
+ * used by whatever wants to build images without running mkgpt.
+ */
+
+#include "libmkgpt.h"
+#include "gpt.h"
+#include "unaligned.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define MIN_SECTOR_SIZE (512U)
+#define MAX_SECTOR_SIZE (4096U)
+
+/*
+ * The GPT entry array must be a minimum of 16,384 bytes (reports wikipedia and
+ * testdisk, but not the UEFI spec)
+ */
+#define MIN_ENTRIES_SIZE (16384U)
+
+static int
+fail(struct mkgpt_layout *layout, enum mkgpt_error error, size_t part)
+{
+	layout->error = error;
+	layout->failed = part;
+	return -1;
+}
+
+/* Find the first sector after cur that's a multiple of align. */
+static uint64_t
+align_up(uint64_t cur, uint64_t align)
+{
+	return (cur + align - 1) / align * align;
+}
+
+/*
+ * Place the partitions one after the other, each at its start_lba or the next
+ * aligned sector after the previous one, and the secondary GPT at the end of
+ * the disk; the gaps are left alone.
+ */
+int
+mkgpt_layout(struct mkgpt_layout *layout)
+{
+	size_t sect_size = layout->sect_size;
+	size_t align = layout->align != 0 ? layout->align
+					  : MKGPT_DEFAULT_ALIGNMENT;
+
+	layout->error = MKGPT_OK;
+	layout->failed = 0;
+
+	if (sect_size < MIN_SECTOR_SIZE || sect_size > MAX_SECTOR_SIZE ||
+		(sect_size & (sect_size - 1)) != 0) {
+		return fail(layout, MKGPT_ERR_SECTOR_SIZE, 0);
+	}
+	if (align % sect_size != 0) {
+		return fail(layout, MKGPT_ERR_ALIGNMENT, 0);
+	}
+	uint64_t align_sects = align / sect_size;
+
+	if (layout->entries == 0) {
+		layout->entries = layout->count;
+	}
+	if (layout->entries < layout->count ||
+		layout->entries > GPT_MAX_ENTRIES) {
+		return fail(layout, MKGPT_ERR_ENTRIES, 0);
+	}
+
+	/* MBR, GPT header and the partition entries */
+	uint64_t entries_length = (uint64_t)layout->entries * GPT_ENTRY_SIZE;
+	layout->entries_sectors = (entries_length + sect_size - 1) / sect_size;
+	if (layout->entries_sectors < MIN_ENTRIES_SIZE / sect_size) {
+		layout->entries_sectors = MIN_ENTRIES_SIZE / sect_size;
+	}
+	layout->first_usable_lba = 2 + layout->entries_sectors;
+
+	/* "rest" goes up to the secondary GPT's entries */
+	uint64_t disk = layout->sectors != 0 ? layout->sectors
+					     : layout->min_sectors;
+	uint64_t end = disk - 1 - layout->entries_sectors;
+	uint64_t cur = layout->first_usable_lba;
+
+	for (size_t i = 0; i < layout->count; i++) {
+		struct mkgpt_part *part = &layout->parts[i];
+		uint64_t sectors;
+
+		if (part->start_lba == 0) {
+			part->first_lba = align_up(cur, align_sects);
+		} else if (part->start_lba < cur) {
+			return fail(layout, MKGPT_ERR_START, i);
+		} else {
+			part->first_lba = part->start_lba;
+		}
+
+		if (part->rest) {
+			if (i + 1 != layout->count) {
+				return fail(layout, MKGPT_ERR_REST, i);
+			}
+			if (disk < layout->entries_sectors + 1 ||
+				end <= part->first_lba) {
+				return fail(layout, MKGPT_ERR_NO_ROOM, i);
+			}
+			sectors = end - part->first_lba;
+		} else {
+			sectors = (part->bytes + sect_size - 1) / sect_size;
+		}
+
+		if (guid_is_zero(&part->type)) {
+			return fail(layout, MKGPT_ERR_TYPE, i);
+		}
+
+		part->last_lba = part->first_lba + sectors - 1;
+		cur = part->first_lba + sectors;
+	}
+
+	/* Add space for the secondary GPT */
+	uint64_t needed = cur + 1 + layout->entries_sectors;
+
+	if (layout->sectors == 0) {
+		layout->sectors = needed > layout->min_sectors
+					  ? needed
+					  : layout->min_sectors;
+	} else if (layout->sectors < needed) {
+		return fail(layout, MKGPT_ERR_TOO_SMALL, layout->count);
+	}
+
+	layout->secondary_entries_lba =
+		layout->sectors - 1 - layout->entries_sectors;
+	layout->secondary_header_lba = layout->sectors - 1;
+	layout->last_usable_lba = layout->secondary_entries_lba - 1;
+
+	return 0;
+}
+
+const char *
+mkgpt_strerror(enum mkgpt_error error)
+{
+	static const char *const messages[] = {
+		[MKGPT_OK] = "success",
+		[MKGPT_ERR_SECTOR_SIZE] = "unsupported sector size",
+		[MKGPT_ERR_ALIGNMENT] =
+			"alignment is not a multiple of the sector size",
+		[MKGPT_ERR_ENTRIES] = "unsupported number of partition entries",
+		[MKGPT_ERR_START] = "partition would conflict with other data",
+		[MKGPT_ERR_REST] = "only the last partition can have the rest "
+				   "of the disk",
+		[MKGPT_ERR_NO_ROOM] = "no room left on the disk for partition",
+		[MKGPT_ERR_TYPE] = "partition type not specified",
+		[MKGPT_ERR_TOO_SMALL] =
+			"disk is too small to hold the partitions",
+		[MKGPT_ERR_NOMEM] = "out of memory",
+		[MKGPT_ERR_WRITE] = "write failed",
+	};
+
+	if ((size_t)error >= sizeof(messages) / sizeof(messages[0])) {
+		return "unknown error";
+	}
+	return messages[error];
+}
+
+/*
+ * Build a GPT header and the partition entry array it describes, for the
+ * primary GPT or the secondary one. The entries are the same for both.
+ */
+static uint8_t *
+build_gpt(const struct mkgpt_layout *layout, uint8_t *gpt, int secondary)
+{
+	uint8_t *parts = calloc(layout->entries_sectors, layout->sect_size);
+	if (parts == NULL) {
+		return NULL;
+	}
+
+	for (size_t i = 0; i < layout->count; i++) {
+		const struct mkgpt_part *part = &layout->parts[i];
+		uint8_t *entry = parts + i * GPT_ENTRY_SIZE;
+
+		guid_to_bytestring(entry + GPT_ENTRY_TYPE, &part->type);
+		guid_to_bytestring(entry + GPT_ENTRY_UUID, &part->uuid);
+		set_u64(entry + GPT_ENTRY_FIRST_LBA, part->first_lba);
+		set_u64(entry + GPT_ENTRY_LAST_LBA, part->last_lba);
+		set_u64(entry + GPT_ENTRY_ATTRS, part->attrs);
+		gpt_set_name(entry, part->name != NULL ? part->name : "");
+	}
+
+	memset(gpt, 0, layout->sect_size);
+	set_u64(gpt + 0, 0x5452415020494645ULL); /* Signature */
+	set_u32(gpt + 8, 0x00010000UL); /* Revision */
+	set_u32(gpt + 12, GPT_HEADER_SIZE); /* HeaderSize */
+	set_u32(gpt + 16, 0); /* HeaderCRC32 */
+	set_u32(gpt + 20, 0); /* Reserved */
+	if (secondary) {
+		set_u64(gpt + 24, layout->secondary_header_lba); /* MyLBA */
+		set_u64(gpt + 32, 0x1); /* AlternateLBA */
+	} else {
+		set_u64(gpt + 24, 0x1); /* MyLBA */
+		/* AlternateLBA */
+		set_u64(gpt + 32, layout->secondary_header_lba);
+	}
+	set_u64(gpt + 40, layout->first_usable_lba); /* FirstUsableLBA */
+	set_u64(gpt + 48, layout->last_usable_lba); /* LastUsableLBA */
+	guid_to_bytestring(gpt + 56, &layout->disk_guid); /* DiskGUID */
+	if (secondary) {
+		/* PartitionEntryLBA */
+		set_u64(gpt + 72, layout->secondary_entries_lba);
+	} else {
+		set_u64(gpt + 72, 0x2); /* PartitionEntryLBA */
+	}
+	set_u32(gpt + 80, layout->entries); /* NumberOfPartitionEntries */
+	set_u32(gpt + 84, GPT_ENTRY_SIZE); /* SizeOfPartitionEntry */
+	set_u32(gpt + 88, 0); /* PartitionEntryArrayCRC32 */
+
+	gpt_seal(gpt, parts);
+	return parts;
+}
+
+/*
+ * Write the "protective MBR", the primary GPT header and the partition
+ * entries, the first entries_sectors + 2 sectors of the disk.
+ */
+int
+mkgpt_write_primary(struct mkgpt_layout *layout,
+	int (*write)(void *ctx, const void *buf, size_t len, off_t off),
+	void *ctx)
+{
+	size_t sect_size = layout->sect_size;
+	uint8_t mbr[MAX_SECTOR_SIZE] = {0};
+	uint8_t gpt[MAX_SECTOR_SIZE];
+
+	/* entry for "Partition 1" starts here */
+	uint8_t *p1 = mbr + 446;
+
+	/* boot indicator = 0, start CHS = 0x000200 */
+	set_u32(p1 + 0, 0x00020000);
+	/* OSType 0xee = GPT Protective, EndingCHS = 0xffffff */
+	set_u32(p1 + 4, 0xffffffee);
+	/* StartingLBA = 1 */
+	set_u32(p1 + 8, 0x00000001);
+	/* number of sectors in partition */
+	if (layout->sectors > 0xffffffff) {
+		set_u32(p1 + 12, 0xffffffff);
+	} else {
+		set_u32(p1 + 12, layout->sectors - 1);
+	}
+	/* Signature */
+	set_u16(mbr + 510, 0xaa55);
+
+	uint8_t *parts = build_gpt(layout, gpt, 0);
+	if (parts == NULL) {
+		return fail(layout, MKGPT_ERR_NOMEM, 0);
+	}
+
+	int ret = write(ctx, mbr, sect_size, 0) != 0 ||
+		  write(ctx, gpt, sect_size, sect_size) != 0 ||
+		  write(ctx, parts, layout->entries_sectors * sect_size,
+			  2 * sect_size) != 0;
+	free(parts);
+
+	return ret ? fail(layout, MKGPT_ERR_WRITE, 0) : 0;
+}
+
+/*
+ * Write the secondary partition entries and then the secondary GPT header, the
+ * last entries_sectors + 1 sectors of the disk.
+ */
+int
+mkgpt_write_secondary(struct mkgpt_layout *layout,
+	int (*write)(void *ctx, const void *buf, size_t len, off_t off),
+	void *ctx)
+{
+	size_t sect_size = layout->sect_size;
+	uint8_t gpt[MAX_SECTOR_SIZE];
+
+	uint8_t *parts = build_gpt(layout, gpt, 1);
+	if (parts == NULL) {
+		return fail(layout, MKGPT_ERR_NOMEM, 0);
+	}
+
+	off_t entries = (off_t)(layout->secondary_entries_lba * sect_size);
+	off_t header = (off_t)(layout->secondary_header_lba * sect_size);
+	int ret = write(ctx, parts, layout->entries_sectors * sect_size,
+			  entries) != 0 ||
+		  write(ctx, gpt, sect_size, header) != 0;
+	free(parts);
+
+	return ret ? fail(layout, MKGPT_ERR_WRITE, 0) : 0;
+}
@@ -0,0 +1,90 @@
+#pragma once
+
+/* SPDX-License-Identifier: MIT */
+
+#ifndef LIBMKGPT_H
+#define LIBMKGPT_H
+
+#include "guid.h"
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+/*
+ * Where partitions start unless told otherwise: 1 MiB is what everybody else
+ * uses, and it's a multiple of any physical block, erase block or RAID stripe
+ * size we're likely to run into.
+ */
+#define MKGPT_DEFAULT_ALIGNMENT (1024U * 1024U)
+
+/* Why mkgpt_layout() or one of the writers failed. */
+enum mkgpt_error {
+	MKGPT_OK,
+	MKGPT_ERR_SECTOR_SIZE, /* not a power of two from 512 to 4096 */
+	MKGPT_ERR_ALIGNMENT, /* not a multiple of the sector size */
+	MKGPT_ERR_ENTRIES, /* more partitions than entries, or too many */
+	MKGPT_ERR_START, /* start_lba is inside the GPT or another partition */
+	MKGPT_ERR_REST, /* rest given for a partition that isn't the last */
+	MKGPT_ERR_NO_ROOM, /* nothing left for the rest of the disk */
+	MKGPT_ERR_TYPE, /* no partition type */
+	MKGPT_ERR_TOO_SMALL, /* sectors can't hold the partitions */
+	MKGPT_ERR_NOMEM,
+	MKGPT_ERR_WRITE, /* the write callback failed */
+};
+
+struct mkgpt_part {
+	GUID type;
+	GUID uuid;
+	uint64_t attrs;
+	const char *name; /* up to 36 ASCII characters, or NULL */
+	uint64_t start_lba; /* 0 for the next aligned sector */
+	uint64_t bytes; /* rounded up to whole sectors */
+	int rest; /* ignore bytes and go up to the secondary GPT */
+
+	/* filled in by mkgpt_layout() */
+	uint64_t first_lba;
+	uint64_t last_lba; /* first_lba - 1 if bytes is 0 */
+};
+
+/*
+ * A disk to be partitioned. Nothing in the library keeps any state outside of
+ * it, so separate layouts can be worked on from separate threads; nothing in
+ * here is random either, the caller picks all the GUIDs.
+ */
+struct mkgpt_layout {
+	size_t sect_size;
+	size_t align; /* in bytes, 0 for MKGPT_DEFAULT_ALIGNMENT */
+	uint64_t sectors; /* size of the disk, 0 to fit it to the partitions */
+	uint64_t min_sectors; /* when fitting it */
+	GUID disk_guid;
+	struct mkgpt_part *parts;
+	size_t count;
+	size_t entries; /* in the entry arrays, 0 for one per partition */
+
+	/* filled in by mkgpt_layout(), along with entries and sectors */
+	uint64_t entries_sectors; /* of each partition entry array */
+	uint64_t first_usable_lba;
+	uint64_t last_usable_lba;
+	uint64_t secondary_entries_lba;
+	uint64_t secondary_header_lba;
+
+	/* set when something returns -1 */
+	enum mkgpt_error error;
+	size_t failed; /* index of the partition it's about */
+};
+
+int
+mkgpt_layout(struct mkgpt_layout *layout);
+const char *
+mkgpt_strerror(enum mkgpt_error error);
+int
+mkgpt_write_primary(struct mkgpt_layout *layout,
+	int (*write)(void *ctx, const void *buf, size_t len, off_t off),
+	void *ctx);
+int
+mkgpt_write_secondary(struct mkgpt_layout *layout,
+	int (*write)(void *ctx, const void *buf, size_t len, off_t off),
+	void *ctx);
+
+#endif
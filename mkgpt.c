@@ -21,662 +21,3570 @@
  * THE SOFTWARE.
  */
 
+#define _GNU_SOURCE /* O_DIRECT */
+
+#include "copy.h"
 #include "crc32.h"
+#include "gpt.h"
 #include "guid.h"
+#include "libmkgpt.h"
 #include "part_ids.h"
+#include "qcow2.h"
+#include "sha256.h"
+#include "simg.h"
 #include "unaligned.h"
+#include "uring.h"
+#include "verify.h"
 
 #include <assert.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <limits.h>
+#include <pthread.h>
+#include <stdarg.h>
 #include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <time.h>
 #include <unistd.h>
 
+#if defined(__linux__)
+#include <linux/fs.h>
+#include <sys/ioctl.h>
+#endif
+
+/*
+ * Partition images are measured once per file no matter how many partitions
+ * or --batch images use them. Only pipes and stdin stay open, everything else
+ * is opened again when it's copied.
+ */
+struct source {
+	char *path;
+	dev_t dev;
+	ino_t ino;
+	int fd; /* -1 unless it has to stay open */
+	long length; /* -1 for streams */
+	struct timespec mtime;
+	struct timespec ctime; /* with the rest, what --update compares */
+	int stream; /* can't seek, so it can only be read once */
+	int used;
+	int hashed; /* sha is set */
+	uint8_t sha[SHA256_DIGEST_LENGTH]; /* for --deterministic, --cache-dir */
+	struct source *same; /* the first one for the same file, maybe itself */
+	struct source *next;
+};
+
+/* What a --size is in, until check_parts() turns it into bytes. */
+enum size_unit { SIZE_BYTES, SIZE_SECTORS, SIZE_PERCENT, SIZE_REST };
+
 struct partition {
 	GUID type;
 	GUID uuid;
 	uint64_t attrs;
 	long src_length;
-	FILE *src;
-	struct partition *next; /* TODO why build a list? */
+	const char *src_path;
+	struct source *source;
+	struct partition *dup_of; /* copy this one's data instead of src */
+	int src; /* while it's copied, for good if the source cache has it */
+	int src_owned; /* src was opened by open_part(), close it */
+	int src_stream; /* src is a pipe, read it once in order */
+	long size; /* --size, or 0 to use src_length */
+	enum size_unit size_unit;
+	int unchanged; /* --update found the data already in place */
+	int src_direct; /* src opened with O_DIRECT, or -1 */
+	uint32_t crc; /* of the partition's sectors, for --manifest */
+	struct sha256 sha;
 	int id;
-	int sect_start;
-	int sect_length;
+	uint64_t sect_start;
+	uint64_t sect_length;
 	char name[52];
+	/* for --stats, --trace and --progress */
+	off_t copied; /* bytes of data */
+	off_t holes; /* bytes skipped */
+	int copy_started;
+	double copy_start; /* seconds since image_start */
+	double copy_end;
 };
 
-#define MAX_PART_NAME (36U)
+/* What parse_part_opt() found. */
+#define PART_OPT_NAME 0x01
+#define PART_OPT_TYPE 0x02
+#define PART_OPT_UUID 0x04
+#define PART_OPT_ATTRS 0x08
+
 #define MIN_SECTOR_SIZE (512U)
 #define MAX_SECTOR_SIZE (4096U)
 
 /*
- * UEFI says 128 is the "minimum size" but since we're generating the image we
- * get to pick; and we're fine with 128 for now; anything else would probably
- * also mess with other GPT tools?
- */
-#define PART_ENTRY_SIZE (128U)
-
-/*
- * TODO Everything else says 92 instead, and that's also what gdisk does when
- * it creates a GPT. It's a mystery why the code here uses 96 instead.
+ * Partition images open at the same time while copying; copy_parts() works
+ * through the partitions that many at a time (fewer if RLIMIT_NOFILE is low)
+ * so hundreds of them don't run out of descriptors.
  */
-#define GPT_HEADER_SIZE (96U)
+#define MAX_OPEN_PARTS (64)
 
+static int
+build_image(int argc, char **argv);
+static int
+run_batch(int argc, char **argv);
+static int
+edit_image(int argc, char **argv);
+static int
+verify_only(int argc, char **argv);
+static int
+parse_part_opt(int argc, char **argv, int *i, struct partition *part);
 static void
 dump_help(char *fname);
 static int
+resolve_size(struct partition *part);
+static int
+check_source(struct partition *part);
+static int
 check_parts();
 static int
+open_direct(void);
+static int
+parse_io(const char *str);
+static int
+parse_format(const char *str);
+static int
+parse_size(const char *str, long *size, enum size_unit *unit);
+static int
 parse_opts(int argc, char **argv);
 static void
+panic(const char *msg);
+static int
+probe_device(void);
+static void
+check_alignment(void);
+static off_t
+output_length(void);
+static void
+read_old_gpt(void);
+static void
+write_at(const void *buf, size_t len, off_t off);
+static void
+plan_update(void);
+static void
+read_sources_list(void);
+static void
+write_sources_list(void);
+static void
 write_output();
-
-static inline int
-min(const int a, const int b)
-{
-	return a < b ? a : b;
-}
+static void
+close_part(struct partition *part);
+static int
+write_manifest(void);
+static int
+hash_sources(void);
+static int
+find_duplicates(void);
+static int
+verify_output(int threads);
+static void
+derive_guids(void);
+static int
+cache_lookup(void);
+static void
+cache_store(void);
+static void
+begin_phase(const char *name);
+static void
+end_phase(void);
+static int
+write_stats(void);
+static int
+write_trace(void);
 
 static size_t sect_size = MIN_SECTOR_SIZE;
 static long image_sects = 0;
 static long min_image_sects = 2048;
-static struct partition *first_part = NULL;
-static struct partition *last_part = NULL;
-static FILE *output = NULL;
+static size_t align_bytes = MKGPT_DEFAULT_ALIGNMENT;
+static long entry_count = 0; /* --entries, 0 for one per partition */
+static struct partition *parts = NULL; /* in command line order */
+static int part_count = 0;
+static int part_alloc = 0; /* room in parts */
+static const char *output_path = NULL;
+static int output = -1;
+static int output_direct = -1;
+static int direct = 0;
 static GUID disk_guid;
-static int part_count;
-static int header_sectors;
-static int first_usable_sector;
-static int secondary_headers_sect;
-static int secondary_gpt_sect;
+static int copy_flags = COPY_AUTO;
+static enum { IO_WRITE, IO_MMAP, IO_URING } io_backend = IO_WRITE;
+static uint8_t *output_map = NULL;
+static size_t direct_align = 0;
+static int jobs = 1;
+static unsigned queue_depth = URING_DEFAULT_DEPTH;
+static const char *manifest_path = NULL;
+static const char *seed = NULL; /* --deterministic */
+static const char *cache_dir = NULL;
+static int dedup = 0; /* --dedup */
+static char cache_key[2 * SHA256_DIGEST_LENGTH + 1];
+static struct sha256 image_sha;
+static uint32_t image_crc;
+static off_t digest_pos = 0; /* everything before has been digested */
+static struct partition *digest_part = NULL;
+static uint64_t header_sectors;
+static uint64_t first_usable_sector;
+static struct mkgpt_layout layout; /* what check_parts() came up with */
+static uint64_t secondary_headers_sect;
+static uint64_t secondary_gpt_sect;
+static struct source *sources = NULL;
+static int update = 0;
+static int disk_guid_given = 0;
+static struct gpt old_gpt; /* what --update found in the output */
+static int have_old_gpt = 0;
+static int streaming = 0; /* output is a pipe, write strictly in order */
+static int blkdev = 0; /* output is a block device */
+static off_t device_bytes;
+static size_t physical_block;
+static int discard = 0;
+static int sect_size_given = 0;
+static off_t stream_pos; /* everything before has been written */
+static enum { FORMAT_RAW, FORMAT_QCOW2, FORMAT_SIMG } format = FORMAT_RAW;
+/* for anything but raw, write_at() hands all the data to format_sink */
+static int (*format_sink)(void *ctx, const void *buf, size_t len, off_t off);
+static void *format_ctx = NULL;
+static const char *stats_path = NULL;
+static const char *trace_path = NULL;
+static int show_progress = 0;
+static int verify = 0; /* --verify after writing */
+
+/* What took how long, for --stats and --trace. */
+#define MAX_PHASES (16)
+static struct phase {
+	const char *name;
+	double start; /* seconds since image_start */
+	double end;
+} phases[MAX_PHASES];
+static int phase_count = 0;
+static int phase_open = 0; /* the last phase hasn't ended yet */
+static struct timespec image_start;
+/* the copy progress, updated from all the copying threads */
+static pthread_mutex_t progress_lock = PTHREAD_MUTEX_INITIALIZER;
+static off_t progress_done;
+static off_t progress_total;
+static double progress_shown;
 
 int
 main(int argc, char *argv[])
 {
 #if defined(__OpenBSD__)
-	if (pledge("stdio cpath rpath wpath", NULL) != 0) {
+	if (pledge("stdio cpath rpath wpath proc", NULL) != 0) {
 		fprintf(stderr, "failed to pledge\n");
 		exit(EXIT_FAILURE);
 	}
 	/* TODO call unveil on each path AHEAD of using it? */
 #endif
 
-	random_guid(&disk_guid);
+	if (argc > 1 && !strcmp(argv[1], "--batch")) {
+		exit(run_batch(argc, argv) == 0 ? EXIT_SUCCESS : EXIT_FAILURE);
+	}
+	if (argc > 1 && !strcmp(argv[1], "--edit")) {
+		exit(edit_image(argc, argv) == 0 ? EXIT_SUCCESS : EXIT_FAILURE);
+	}
+	/* "--verify -o ..." is a build that's verified afterwards */
+	if (argc > 2 && !strcmp(argv[1], "--verify") && argv[2][0] != '-') {
+		exit(verify_only(argc, argv) == 0 ? EXIT_SUCCESS : EXIT_FAILURE);
+	}
+
+	exit(build_image(argc, argv) == 0 ? EXIT_SUCCESS : EXIT_FAILURE);
+}
+
+/*
+ * Put all the per-image settings back to their defaults, closing whatever the
+ * image had open.
+ */
+static void
+reset_image(void)
+{
+	struct partition *cur_part;
+
+	for (cur_part = parts; cur_part < parts + part_count; cur_part++) {
+		close_part(cur_part);
+	}
+	free(parts);
+	parts = NULL;
+	part_count = 0;
+	part_alloc = 0;
+
+	if (output_direct >= 0) {
+		close(output_direct);
+	}
+	if (output >= 0) {
+		close(output);
+	}
+
+	sect_size = MIN_SECTOR_SIZE;
+	image_sects = 0;
+	min_image_sects = 2048;
+	align_bytes = MKGPT_DEFAULT_ALIGNMENT;
+	entry_count = 0;
+	output_path = NULL;
+	output = -1;
+	output_direct = -1;
+	direct = 0;
+	copy_flags = COPY_AUTO;
+	io_backend = IO_WRITE;
+	direct_align = 0;
+	jobs = 1;
+	queue_depth = URING_DEFAULT_DEPTH;
+	manifest_path = NULL;
+	seed = NULL;
+	cache_dir = NULL;
+	dedup = 0;
+	update = 0;
+	disk_guid_given = 0;
+	streaming = 0;
+	blkdev = 0;
+	discard = 0;
+	sect_size_given = 0;
+	format = FORMAT_RAW;
+	stats_path = NULL;
+	trace_path = NULL;
+	show_progress = 0;
+	verify = 0;
+	phase_count = 0;
+	phase_open = 0;
+	free(layout.parts);
+	memset(&layout, 0, sizeof(layout));
+	if (have_old_gpt) {
+		gpt_free(&old_gpt);
+		have_old_gpt = 0;
+	}
+}
+
+static int
+make_image(int argc, char *argv[])
+{
+	clock_gettime(CLOCK_MONOTONIC, &image_start);
+	begin_phase("parse_opts");
 
 	if (parse_opts(argc, argv) != 0) {
-		exit(EXIT_FAILURE);
+		return -1;
 	}
+	int verify_jobs = jobs; /* whatever copying ends up with */
 
-	if (output == NULL) {
+	if (output_path == NULL) {
 		fprintf(stderr, "no output file specified\n");
 		dump_help(argv[0]);
-		exit(EXIT_FAILURE);
+		return -1;
 	}
-	if (first_part == NULL) {
+	if (part_count == 0) {
 		fprintf(stderr, "no partitions specified\n");
 		dump_help(argv[0]);
-		exit(EXIT_FAILURE);
+		return -1;
 	}
 
-	if (check_parts() != 0) {
-		exit(EXIT_FAILURE);
+	begin_phase("open_output");
+	if (!strcmp(output_path, "-")) {
+		output = dup(STDOUT_FILENO);
+	} else {
+		output = open(output_path,
+			O_RDWR | O_CREAT | (update ? 0 : O_TRUNC), 0666);
+	}
+	if (output < 0) {
+		fprintf(stderr, "unable to open %s for writing (%s)\n",
+			output_path, strerror(errno));
+		return -1;
 	}
 
-	write_output();
-	fclose(output);
+	/* pipes and such can only be written front to back */
+	streaming = lseek(output, 0, SEEK_CUR) < 0 && errno == ESPIPE;
+	if (streaming) {
+		if (update || direct) {
+			fprintf(stderr, "--update and --direct need an output "
+					"we can seek in\n");
+			return -1;
+		}
+		io_backend = IO_WRITE;
+		jobs = 1;
+		stream_pos = 0;
+	}
 
-	exit(EXIT_SUCCESS);
-}
+	if (format != FORMAT_RAW) {
+		if (streaming || update || direct) {
+			fprintf(stderr, "--format can't be combined with "
+					"--update, --direct or a pipe\n");
+			return -1;
+		}
+		/* the format's writer needs the data in order */
+		io_backend = IO_WRITE;
+		jobs = 1;
+	}
 
-static int
-parse_opts(int argc, char *argv[])
-{
-	int i = 1;
-	int cur_part_id = 0;
-	struct partition *cur_part = NULL;
+	if (verify && (streaming || format != FORMAT_RAW)) {
+		fprintf(stderr, "--verify can't be combined with --format "
+				"or a pipe\n");
+		return -1;
+	}
 
-	/* First, parse global options */
-	while (i < argc) {
-		if (!strcmp(argv[i], "--output") || !strcmp(argv[i], "-o")) {
-			i++;
-			if (i == argc || argv[i][0] == '-') {
-				fprintf(stderr, "no output file specified\n");
-				return -1;
-			}
+	if (probe_device() != 0) {
+		return -1;
+	}
 
-			output = fopen(argv[i], "w+");
-			if (output == NULL) {
-				fprintf(stderr,
-					"unable to open %s for writing (%s)\n",
-					argv[i], strerror(errno));
-				return -1;
-			}
-			i++;
-		} else if (!strcmp(argv[i], "--disk-guid")) {
-			i++;
-			if (i == argc || argv[i][0] == '-') {
-				fprintf(stderr,
-					"no disk guid file specified\n");
-				return -1;
-			}
+	if (cache_dir != NULL) {
+		if (streaming || update || blkdev || manifest_path != NULL) {
+			fprintf(stderr, "--cache-dir can't be combined with "
+					"--update, --manifest, a block device "
+					"or a pipe\n");
+			return -1;
+		}
+		/* cached images are only any good if we can make them again */
+		if (seed == NULL) {
+			seed = "";
+		}
+	}
 
-			if (parse_guid(argv[i], &disk_guid) != 0) {
-				fprintf(stderr, "invalid disk uuid (%s)\n",
-					argv[i]);
-				return -1;
-			}
+	if (update) {
+		read_old_gpt();
+	}
 
-			i++;
-		} else if (!strcmp(argv[i], "--help") ||
-			   !strcmp(argv[i], "-h")) {
-			dump_help(argv[0]);
+	begin_phase("check_parts");
+	if (check_parts() != 0) {
+		return -1;
+	}
+
+	if (seed != NULL) {
+		begin_phase("hash_sources");
+		if (hash_sources() != 0) {
 			return -1;
-		} else if (!strcmp(argv[i], "--sector-size")) {
-			i++;
-			if (i == argc || argv[i][0] == '-') {
-				fprintf(stderr, "sector size not specified\n");
-				return -1;
-			}
+		}
+		derive_guids();
+	}
 
-			sect_size = atoi(argv[i]);
+	/* duplicates are copied from the output, so we need to read it back */
+	if (!streaming && format == FORMAT_RAW && manifest_path == NULL &&
+		find_duplicates() != 0) {
+		return -1;
+	}
 
-			if (sect_size < MIN_SECTOR_SIZE ||
-				sect_size > MAX_SECTOR_SIZE ||
-				sect_size % MIN_SECTOR_SIZE) {
-				fprintf(stderr,
-					"invalid sector size (%zu) - must be "
-					">= %u and <= %u and "
-					"a multiple of %u",
-					sect_size, MIN_SECTOR_SIZE,
-					MAX_SECTOR_SIZE, MIN_SECTOR_SIZE);
-				return -1;
-			}
-			i++;
-		} else if (!strcmp(argv[i], "--minimum-image-size") ||
-			   !strcmp(argv[i], "-s")) {
-			i++;
-			if (i == argc || argv[i][0] == '-') {
-				fprintf(stderr,
-					"minimum image size not specified\n");
-				return -1;
-			}
+	if (have_old_gpt) {
+		plan_update();
+	}
+	if (update && !blkdev) {
+		read_sources_list();
+	}
 
-			min_image_sects = atoi(argv[i]);
+	if (blkdev) {
+		check_alignment();
+	}
 
-			if (min_image_sects < 2048) {
-				fprintf(stderr, "minimum image size must be at "
-						"least 2048 sectors\n");
-				return -1;
-			}
+	if (direct && open_direct() != 0) {
+		return -1;
+	}
 
-			i++;
-		} else if (!strcmp(argv[i], "--image-size")) {
-			i++;
-			if (i == argc || argv[i][0] == '-') {
-				fprintf(stderr, "image size not specified\n");
-				return -1;
+	if (io_backend == IO_URING) {
+		for (struct partition *p = parts; p < parts + part_count; p++) {
+			if (p->src_stream) {
+				fprintf(stderr, "io_uring can't read from "
+						"pipes, writing instead\n");
+				io_backend = IO_WRITE;
+				break;
 			}
+		}
+	}
 
-			image_sects = atoi(argv[i]);
+	if (manifest_path != NULL) {
+		/* digests need all the data in order, in user space */
+		copy_flags &= COPY_SPARSE;
+		jobs = 1;
+		if (io_backend == IO_URING) {
+			io_backend = IO_WRITE;
+		}
+	}
 
-			i++;
-		} else if (!strcmp(argv[i], "--part") || !strcmp(argv[i], "-p"))
-			break;
-		else {
-			fprintf(stderr, "unknown argument - %s\n", argv[i]);
-			dump_help(argv[0]);
-			return i;
+	if (cache_dir != NULL) {
+		begin_phase("cache_lookup");
+	}
+	if (cache_dir == NULL || !cache_lookup()) {
+		write_output();
+		if (update && !blkdev) {
+			write_sources_list();
+		}
+		if (cache_dir != NULL) {
+			begin_phase("cache_store");
+			cache_store();
 		}
 	}
 
-	/* Now parse partitions */
-	while (i < argc) {
-		if (!strcmp(argv[i], "--part") || !strcmp(argv[i], "-p")) {
-			/* Store the current partition data if there is one */
-			if (cur_part != NULL) {
-				if (last_part == NULL) {
-					first_part = last_part = cur_part;
-					cur_part->next = NULL;
-				} else {
-					last_part->next = cur_part;
-					last_part = cur_part;
-					cur_part->next = NULL;
-				}
-			}
+	if (manifest_path != NULL) {
+		begin_phase("write_manifest");
+		if (write_manifest() != 0) {
+			return -1;
+		}
+	}
 
-			/* Allocate a new partition structure */
-			cur_part = calloc(1, sizeof(*cur_part));
-			if (cur_part == NULL) {
-				fprintf(stderr, "out of memory allocating "
-						"partition structure\n");
-				return -1;
-			}
-			cur_part_id++;
-			cur_part->id = cur_part_id;
-			snprintf(cur_part->name, sizeof(cur_part->name),
-				"part%i", cur_part_id);
+	if (verify) {
+		begin_phase("verify");
+		if (verify_output(verify_jobs) != 0) {
+			return -1;
+		}
+	}
+	end_phase();
 
-			/* Get the filename of the partition image */
-			i++;
-			if (i == argc || argv[i][0] == '-') {
-				fprintf(stderr,
-					"no partition image specified for "
-					"partition %i\n",
-					cur_part_id);
-				return -1;
-			}
-			cur_part->src = fopen(argv[i], "r");
-			if (cur_part->src == NULL) {
-				fprintf(stderr,
-					"unable to open partition image (%s) "
-					"for partition (%i) - %s\n",
-					argv[i], cur_part_id, strerror(errno));
-				return -1;
-			}
+	if (stats_path != NULL && write_stats() != 0) {
+		return -1;
+	}
+	if (trace_path != NULL && write_trace() != 0) {
+		return -1;
+	}
 
-			i++;
-		} else if (!strcmp(argv[i], "--name") ||
-			   !strcmp(argv[i], "-n")) {
-			if (cur_part == NULL) {
-				fprintf(stderr, "--part must be specified "
-						"before --name argument\n");
-				return -1;
-			}
+	return 0;
+}
 
-			i++;
-			if (i == argc || argv[i][0] == '-') {
-				fprintf(stderr,
-					"partition name not specified %i\n",
-					cur_part_id);
-				return -1;
-			}
+static int
+build_image(int argc, char *argv[])
+{
+	random_guid(&disk_guid);
 
-			/*
-			 * TODO we would really need to check the number of
-			 * UTF-8 characters and not the number of bytes here...
-			 */
-			if (strlen(argv[i]) > MAX_PART_NAME) {
-				fprintf(stderr,
-					"partition name too long (max %u)\n",
-					MAX_PART_NAME);
-				return -1;
-			}
-			static_assert(sizeof(cur_part->name) >= MAX_PART_NAME,
-				"more space for name in struct partition");
-			strcpy(cur_part->name, argv[i]);
+	int ret = make_image(argc, argv);
+	reset_image();
+	return ret;
+}
 
-			i++;
-		} else if (!strcmp(argv[i], "--type") ||
-			   (!strcmp(argv[i], "-t"))) {
-			if (cur_part == NULL) {
-				fprintf(stderr, "--part must be specifed "
-						"before --type argument\n");
-				return -1;
+/*
+ * Look up path in the source cache, measuring it if this is the first time we
+ * see it; different paths naming the same file are only measured once. Pipes
+ * (and "-" for stdin) are allowed, but their length is unknown, and they're
+ * the only ones we keep open, they can't be opened again.
+ */
+static struct source *
+open_source(const char *path)
+{
+	struct source *src;
+	struct stat st;
+
+	for (src = sources; src; src = src->next) {
+		if (!strcmp(src->path, path)) {
+			return src;
+		}
+	}
+
+	int fd = !strcmp(path, "-") ? dup(STDIN_FILENO) : open(path, O_RDONLY);
+	if (fd < 0) {
+		return NULL;
+	}
+	if (fstat(fd, &st) != 0) {
+		close(fd);
+		return NULL;
+	}
+
+	struct source *new = calloc(1, sizeof(*new));
+	if (new == NULL || (new->path = strdup(path)) == NULL) {
+		free(new);
+		close(fd);
+		errno = ENOMEM;
+		return NULL;
+	}
+	new->dev = st.st_dev;
+	new->ino = st.st_ino;
+	new->mtime = st.st_mtim;
+	new->ctime = st.st_ctim;
+	new->fd = -1;
+
+	for (src = sources; src; src = src->next) {
+		if (src->dev == st.st_dev && src->ino == st.st_ino &&
+			!src->stream) {
+			break;
+		}
+	}
+	new->same = new;
+	if (src != NULL) {
+		new->length = src->length;
+		new->same = src->same;
+	} else {
+		new->length = lseek(fd, 0, SEEK_END);
+		if (new->length < 0 && errno == ESPIPE) {
+			new->stream = 1;
+		} else if (new->length < 0) {
+			int err = errno;
+			close(fd);
+			free(new->path);
+			free(new);
+			errno = err;
+			return NULL;
+		}
+	}
+
+	if (new->stream || !strcmp(path, "-")) {
+		new->fd = fd;
+	} else {
+		close(fd);
+	}
+
+	new->next = sources;
+	sources = new;
+	return new;
+}
+
+/*
+ * Split a --batch line into arguments: whitespace separates them, quotes
+ * (single or double) protect it, and # starts a comment. Works in place.
+ */
+static int
+split_line(char *line, char ***argvp, int *argcp)
+{
+	char *r = line;
+
+	for (;;) {
+		while (*r == ' ' || *r == '\t' || *r == '\n' || *r == '\r') {
+			r++;
+		}
+		if (*r == '\0' || *r == '#') {
+			return 0;
+		}
+
+		char *arg = r, *w = r;
+		char quote = 0;
+		while (*r != '\0' &&
+			(quote || (*r != ' ' && *r != '\t' && *r != '\n' &&
+					  *r != '\r'))) {
+			if (quote && *r == quote) {
+				quote = 0;
+				r++;
+			} else if (!quote && (*r == '\'' || *r == '"')) {
+				quote = *r++;
+			} else {
+				*w++ = *r++;
 			}
+		}
+		if (quote) {
+			fprintf(stderr, "unterminated quote\n");
+			return -1;
+		}
+		char end = *r;
+		*w = '\0';
+		if (end != '\0') {
+			r++;
+		}
 
-			i++;
-			if (i == argc || argv[i][0] == '-') {
+		char **argv = realloc(*argvp, (*argcp + 2) * sizeof(*argv));
+		if (argv == NULL) {
+			fprintf(stderr, "out of memory reading batch file\n");
+			return -1;
+		}
+		argv[(*argcp)++] = arg;
+		argv[*argcp] = NULL;
+		*argvp = argv;
+	}
+}
+
+/* An image of a batch file, split into arguments. */
+struct batch_image {
+	int line;
+	int argc;
+	char **argv; /* pointing into text */
+	char *text;
+};
+
+static void
+free_batch(struct batch_image *images, size_t count)
+{
+	for (size_t n = 0; n < count; n++) {
+		free(images[n].argv);
+		free(images[n].text);
+	}
+	free(images);
+}
+
+/*
+ * Read a batch file into images, one per line that isn't empty (or only a
+ * comment); argv0 becomes argv[0] of each.
+ */
+static int
+read_batch(const char *path, char *argv0, struct batch_image **imagesp,
+	size_t *countp)
+{
+	FILE *f = fopen(path, "r");
+	if (f == NULL) {
+		fprintf(stderr, "unable to open %s (%s)\n", path,
+			strerror(errno));
+		return -1;
+	}
+
+	struct batch_image *images = NULL;
+	size_t count = 0;
+	char *line = NULL;
+	size_t line_size = 0;
+	int lineno = 0;
+	int ret = 0;
+
+	while (ret == 0 && getline(&line, &line_size, f) >= 0) {
+		lineno++;
+
+		char *copy = strdup(line);
+		char **args = malloc(2 * sizeof(*args));
+		int nargs = 1;
+		if (copy == NULL || args == NULL) {
+			fprintf(stderr, "out of memory reading batch file\n");
+			free(copy);
+			free(args);
+			ret = -1;
+			break;
+		}
+		args[0] = argv0;
+		args[1] = NULL;
+		if (split_line(copy, &args, &nargs) != 0) {
+			fprintf(stderr, "%s:%d: invalid line\n", path, lineno);
+			ret = -1;
+		}
+
+		struct batch_image *tmp = NULL;
+		if (ret == 0 && nargs > 1) {
+			tmp = realloc(images, (count + 1) * sizeof(*tmp));
+			if (tmp == NULL) {
 				fprintf(stderr,
-					"partition type not specified %i\n",
-					cur_part_id);
-				return -1;
+					"out of memory reading batch file\n");
+				ret = -1;
 			}
+		}
+		if (tmp == NULL) {
+			free(args);
+			free(copy);
+			continue;
+		}
+		images = tmp;
+		images[count].line = lineno;
+		images[count].argc = nargs;
+		images[count].argv = args;
+		images[count].text = copy;
+		count++;
+	}
+	free(line);
+	fclose(f);
+
+	if (ret != 0) {
+		free_batch(images, count);
+		return -1;
+	}
+	*imagesp = images;
+	*countp = count;
+	return 0;
+}
 
-			if (parse_guid(argv[i], &cur_part->type) != 0) {
+/*
+ * Build the images in forked children, up to batch_jobs at a time, so one that
+ * fails (and exits, as mkgpt does on I/O errors) doesn't take the rest of the
+ * batch with it. Sources are measured up front so all children share that;
+ * pipes (and stdin, if it's one) can't be shared, so they're only allowed
+ * without --batch-jobs.
+ */
+static int
+fork_batch(const char *batch_path, struct batch_image *images, size_t count,
+	int batch_jobs)
+{
+	int failed = 0;
+
+	for (size_t n = 0; n < count; n++) {
+		for (int i = 1; i + 1 < images[n].argc; i++) {
+			if (strcmp(images[n].argv[i], "--part") &&
+				strcmp(images[n].argv[i], "-p")) {
+				continue;
+			}
+			struct source *src = open_source(images[n].argv[i + 1]);
+			if (src != NULL && src->stream && batch_jobs > 1) {
 				fprintf(stderr,
-					"invalid partition type (%s) for "
-					"partition %i\n",
-					argv[i], cur_part_id);
+					"%s:%d: partition image (%s) is a pipe, "
+					"it can't be used with --batch-jobs\n",
+					batch_path, images[n].line, src->path);
 				return -1;
 			}
+		}
+	}
 
-			i++;
-		} else if (!strcmp(argv[i], "--uuid") ||
-			   (!strcmp(argv[i], "-u"))) {
-			if (cur_part == NULL) {
-				fprintf(stderr, "--part must be specifed "
-						"before --uuid argument\n");
+	pid_t *pids = calloc(count, sizeof(*pids));
+	if (pids == NULL) {
+		fprintf(stderr, "out of memory starting batch\n");
+		return -1;
+	}
+	size_t next = 0;
+	int running = 0;
+	while (next < count || running > 0) {
+		if (next < count && running < batch_jobs) {
+			fflush(NULL);
+			pid_t pid = fork();
+			if (pid == 0) {
+				reseed_guid();
+				_exit(build_image(images[next].argc,
+					      images[next].argv) == 0
+						? EXIT_SUCCESS
+						: EXIT_FAILURE);
+			}
+			if (pid < 0) {
+				fprintf(stderr, "unable to fork (%s)\n",
+					strerror(errno));
+				failed++;
+			} else {
+				pids[next] = pid;
+				running++;
+			}
+			next++;
+			continue;
+		}
+
+		int status;
+		pid_t pid = wait(&status);
+		if (pid < 0) {
+			fprintf(stderr, "wait failed (%s)\n", strerror(errno));
+			free(pids);
+			return -1;
+		}
+		running--;
+		if (WIFEXITED(status) && WEXITSTATUS(status) == 0) {
+			continue;
+		}
+		for (size_t n = 0; n < count; n++) {
+			if (pids[n] == pid) {
+				fprintf(stderr, "%s:%d: image not built\n",
+					batch_path, images[n].line);
+			}
+		}
+		failed++;
+	}
+	free(pids);
+
+	return failed ? -1 : 0;
+}
+
+/*
+ * Build every image described in a batch file, one image per line with the
+ * same options a single mkgpt run would take. Images are built one after the
+ * other unless --batch-jobs asks for more; either way fork_batch() builds each
+ * in a child of its own.
+ */
+static int
+run_batch(int argc, char *argv[])
+{
+	const char *batch_path = NULL;
+	int batch_jobs = 1;
+
+	for (int i = 1; i < argc; i++) {
+		if (!strcmp(argv[i], "--batch") && i + 1 < argc) {
+			batch_path = argv[++i];
+		} else if (!strcmp(argv[i], "--batch-jobs") && i + 1 < argc) {
+			batch_jobs = atoi(argv[++i]);
+			if (batch_jobs < 1) {
+				fprintf(stderr, "need at least one batch job\n");
 				return -1;
 			}
+		} else {
+			fprintf(stderr, "unknown argument - %s\n", argv[i]);
+			dump_help(argv[0]);
+			return -1;
+		}
+	}
+	if (batch_path == NULL) {
+		fprintf(stderr, "no batch file specified\n");
+		return -1;
+	}
 
-			i++;
-			if (i == argc || argv[i][0] == '-') {
-				fprintf(stderr,
-					"partition uuid not specified %i\n",
-					cur_part_id);
+	struct batch_image *images;
+	size_t count;
+	if (read_batch(batch_path, argv[0], &images, &count) != 0) {
+		return -1;
+	}
+
+	int ret = fork_batch(batch_path, images, count, batch_jobs);
+	free_batch(images, count);
+	return ret;
+}
+
+/*
+ * Change the GPT of an existing image in place: the disk GUID and the name,
+ * type, UUID, and attributes of entries. Both entry arrays and headers are
+ * rewritten with fresh CRCs, partition data and everything else stays as is.
+ * A broken secondary GPT is recreated from the primary one.
+ */
+static int
+edit_image(int argc, char *argv[])
+{
+	const char *path = NULL;
+	size_t size = MIN_SECTOR_SIZE;
+	GUID guid;
+	int new_guid = 0;
+	struct edit {
+		struct partition part;
+		int opts;
+	} *edits = NULL;
+	int count = 0;
+
+	int i = 1;
+	while (i < argc) {
+		int opt;
+		const char *arg = i + 1 < argc ? argv[i + 1] : NULL;
+
+		if (!strcmp(argv[i], "--edit")) {
+			if (arg == NULL || arg[0] == '-') {
+				fprintf(stderr, "no image specified\n");
 				return -1;
 			}
+			path = arg;
+			i += 2;
+		} else if (!strcmp(argv[i], "--disk-guid")) {
+			if (arg == NULL || parse_guid(arg, &guid) != 0) {
+				fprintf(stderr, "invalid disk uuid (%s)\n",
+					arg != NULL ? arg : "");
+				return -1;
+			}
+			new_guid = 1;
+			i += 2;
+		} else if (!strcmp(argv[i], "--sector-size")) {
+			size = arg != NULL ? atoi(arg) : 0;
+			if (size < MIN_SECTOR_SIZE || size > MAX_SECTOR_SIZE ||
+				size % MIN_SECTOR_SIZE) {
+				fprintf(stderr, "invalid sector size\n");
+				return -1;
+			}
+			i += 2;
+		} else if (!strcmp(argv[i], "--entry")) {
+			int id = arg != NULL ? atoi(arg) : 0;
+			if (id < 1) {
+				fprintf(stderr, "invalid entry number\n");
+				return -1;
+			}
+			struct edit *tmp = realloc(edits,
+				(count + 1) * sizeof(*edits));
+			if (tmp == NULL) {
+				fprintf(stderr, "out of memory\n");
+				return -1;
+			}
+			edits = tmp;
+			memset(&edits[count], 0, sizeof(*edits));
+			edits[count].part.id = id;
+			count++;
+			i += 2;
+		} else if (count > 0 &&
+			   (opt = parse_part_opt(argc, argv, &i,
+				    &edits[count - 1].part)) != 0) {
+			if (opt < 0) {
+				return -1;
+			}
+			edits[count - 1].opts |= opt;
+		} else {
+			fprintf(stderr, "unknown argument - %s\n", argv[i]);
+			dump_help(argv[0]);
+			return -1;
+		}
+	}
+
+	int fd = open(path, O_RDWR);
+	if (fd < 0) {
+		fprintf(stderr, "unable to open %s (%s)\n", path,
+			strerror(errno));
+		return -1;
+	}
+
+	struct gpt primary, secondary;
+	if (gpt_read(fd, size, 1, &primary) != 0) {
+		close(fd);
+		return -1;
+	}
+
+	struct stat st;
+	if (fstat(fd, &st) != 0 ||
+		(off_t)(primary.alternate_lba * size) >= st.st_size) {
+		fprintf(stderr, "secondary GPT at LBA %llu is outside of %s\n",
+			(unsigned long long)primary.alternate_lba, path);
+		close(fd);
+		return -1;
+	}
+
+	if (gpt_read(fd, size, primary.alternate_lba, &secondary) != 0 ||
+		secondary.entry_count != primary.entry_count ||
+		secondary.entry_size != primary.entry_size) {
+		fprintf(stderr, "recreating secondary GPT from primary\n");
+		memcpy(secondary.header, primary.header, primary.header_size);
+		set_u64(secondary.header + 24, primary.alternate_lba);
+		set_u64(secondary.header + 32, 1);
+		set_u64(secondary.header + 72, primary.last_usable_lba + 1);
+	}
+	gpt_free(&secondary);
+
+	for (int n = 0; n < count; n++) {
+		struct partition *part = &edits[n].part;
+
+		if ((uint32_t)part->id > primary.entry_count) {
+			fprintf(stderr, "no entry %d in %s (only %u)\n",
+				part->id, path, primary.entry_count);
+			close(fd);
+			return -1;
+		}
+
+		uint8_t *entry = gpt_entry(&primary, part->id - 1);
+		GUID type;
+		bytestring_to_guid(&type, entry + GPT_ENTRY_TYPE);
+		if (guid_is_zero(&type) && !(edits[n].opts & PART_OPT_TYPE)) {
+			fprintf(stderr, "entry %d is unused, give it a type\n",
+				part->id);
+			close(fd);
+			return -1;
+		}
+
+		if (edits[n].opts & PART_OPT_TYPE) {
+			guid_to_bytestring(entry + GPT_ENTRY_TYPE, &part->type);
+		}
+		if (edits[n].opts & PART_OPT_UUID) {
+			guid_to_bytestring(entry + GPT_ENTRY_UUID, &part->uuid);
+		}
+		if (edits[n].opts & PART_OPT_ATTRS) {
+			set_u64(entry + GPT_ENTRY_ATTRS, part->attrs);
+		}
+		if (edits[n].opts & PART_OPT_NAME) {
+			gpt_set_name(entry, part->name);
+		}
+	}
+	free(edits);
+
+	if (new_guid) {
+		guid_to_bytestring(primary.header + 56, &guid);
+		guid_to_bytestring(secondary.header + 56, &guid);
+	}
+
+	/* secondary first, a crash in between still leaves a valid GPT */
+	int ret = 0;
+	if (gpt_write(fd, size, secondary.header, primary.entries) != 0 ||
+		gpt_write(fd, size, primary.header, primary.entries) != 0) {
+		ret = -1;
+	}
+	gpt_free(&primary);
+
+	if (close(fd) != 0) {
+		fprintf(stderr, "unable to write %s (%s)\n", path,
+			strerror(errno));
+		ret = -1;
+	}
+	return ret;
+}
+
+/*
+ * Check an existing image with verify_image(): the protective MBR and both
+ * GPTs, and if partition images are given with --part (in the order of the
+ * entries, like when the image was made), the partitions against them.
+ */
+static int
+verify_only(int argc, char *argv[])
+{
+	const char *path = NULL;
+	size_t size = MIN_SECTOR_SIZE;
+	int threads = 1;
+	const char **srcs = NULL;
+	int count = 0;
+
+	int i = 1;
+	while (i < argc) {
+		const char *arg = i + 1 < argc ? argv[i + 1] : NULL;
+
+		if (!strcmp(argv[i], "--verify")) {
+			if (arg == NULL || arg[0] == '-') {
+				fprintf(stderr, "no image specified\n");
+				free(srcs);
+				return -1;
+			}
+			path = arg;
+		} else if (!strcmp(argv[i], "--sector-size")) {
+			size = arg != NULL ? atoi(arg) : 0;
+			if (size < MIN_SECTOR_SIZE || size > MAX_SECTOR_SIZE ||
+				size % MIN_SECTOR_SIZE) {
+				fprintf(stderr, "invalid sector size\n");
+				free(srcs);
+				return -1;
+			}
+		} else if (!strcmp(argv[i], "--jobs") || !strcmp(argv[i], "-j")) {
+			threads = arg != NULL ? atoi(arg) : 0;
+			if (threads < 1) {
+				fprintf(stderr, "need at least one job\n");
+				free(srcs);
+				return -1;
+			}
+		} else if (!strcmp(argv[i], "--part") ||
+			   !strcmp(argv[i], "-p")) {
+			if (arg == NULL) {
+				fprintf(stderr, "no partition image specified\n");
+				free(srcs);
+				return -1;
+			}
+			const char **tmp =
+				realloc(srcs, (count + 1) * sizeof(*srcs));
+			if (tmp == NULL) {
+				fprintf(stderr, "out of memory\n");
+				free(srcs);
+				return -1;
+			}
+			srcs = tmp;
+			srcs[count++] = arg;
+		} else {
+			fprintf(stderr, "unknown argument - %s\n", argv[i]);
+			dump_help(argv[0]);
+			free(srcs);
+			return -1;
+		}
+		i += 2;
+	}
+
+	int ret = verify_image(path, size, srcs, count, threads);
+	free(srcs);
+	return ret;
+}
+
+/*
+ * Parse argv[*i] if it's one of the options describing a GPT entry, for both
+ * --part and --edit. Returns which one it was, 0 if it's none of them, or -1
+ * if its argument is missing or invalid.
+ */
+static int
+parse_part_opt(int argc, char *argv[], int *i, struct partition *part)
+{
+	const char *opt = argv[*i];
+	const char *arg = *i + 1 < argc ? argv[*i + 1] : NULL;
+
+	if (!strcmp(opt, "--name") || !strcmp(opt, "-n")) {
+		if (arg == NULL || arg[0] == '-') {
+			fprintf(stderr, "partition name not specified %i\n",
+				part->id);
+			return -1;
+		}
+
+		/*
+		 * TODO we would really need to check the number of
+		 * UTF-8 characters and not the number of bytes here...
+		 */
+		if (strlen(arg) > GPT_NAME_LENGTH) {
+			fprintf(stderr, "partition name too long (max %u)\n",
+				GPT_NAME_LENGTH);
+			return -1;
+		}
+		static_assert(sizeof(part->name) >= GPT_NAME_LENGTH,
+			"more space for name in struct partition");
+		strcpy(part->name, arg);
+
+		*i += 2;
+		return PART_OPT_NAME;
+	} else if (!strcmp(opt, "--type") || !strcmp(opt, "-t")) {
+		if (arg == NULL || arg[0] == '-') {
+			fprintf(stderr, "partition type not specified %i\n",
+				part->id);
+			return -1;
+		}
+
+		if (parse_guid(arg, &part->type) != 0) {
+			fprintf(stderr,
+				"invalid partition type (%s) for partition "
+				"%i\n",
+				arg, part->id);
+			return -1;
+		}
+
+		*i += 2;
+		return PART_OPT_TYPE;
+	} else if (!strcmp(opt, "--uuid") || !strcmp(opt, "-u")) {
+		if (arg == NULL || arg[0] == '-') {
+			fprintf(stderr, "partition uuid not specified %i\n",
+				part->id);
+			return -1;
+		}
+
+		if (parse_guid(arg, &part->uuid) != 0) {
+			fprintf(stderr,
+				"invalid partition uuid (%s) for partition "
+				"%i\n",
+				arg, part->id);
+			return -1;
+		}
+
+		*i += 2;
+		return PART_OPT_UUID;
+	} else if (!strcmp(opt, "--attributes")) {
+		if (arg == NULL || arg[0] == '-') {
+			fprintf(stderr,
+				"partition attributes not specified %i\n",
+				part->id);
+			return -1;
+		}
+
+		char *end;
+		errno = 0;
+		part->attrs = strtoull(arg, &end, 0);
+		if (errno != 0 || end == arg || *end != '\0') {
+			fprintf(stderr,
+				"invalid partition attributes (%s) for "
+				"partition %i\n",
+				arg, part->id);
+			return -1;
+		}
+
+		*i += 2;
+		return PART_OPT_ATTRS;
+	}
+
+	return 0;
+}
+
+/*
+ * Make room for one more partition at the end of parts. They all live in one
+ * array that doubles when it's full, so hundreds of them are still only a
+ * handful of allocations.
+ */
+static struct partition *
+add_part(void)
+{
+	if (part_count == part_alloc) {
+		int alloc = part_alloc > 0 ? 2 * part_alloc : 16;
+		struct partition *tmp = realloc(parts, alloc * sizeof(*tmp));
+		if (tmp == NULL) {
+			return NULL;
+		}
+		parts = tmp;
+		part_alloc = alloc;
+	}
+
+	struct partition *part = &parts[part_count++];
+	memset(part, 0, sizeof(*part));
+	return part;
+}
+
+static int
+parse_opts(int argc, char *argv[])
+{
+	int i = 1;
+	int opt;
+	int cur_part_id = 0;
+	struct partition *cur_part = NULL;
+
+	/* First, parse global options */
+	while (i < argc) {
+		if (!strcmp(argv[i], "--output") || !strcmp(argv[i], "-o")) {
+			i++;
+			if (i == argc ||
+				(argv[i][0] == '-' && argv[i][1] != '\0')) {
+				fprintf(stderr, "no output file specified\n");
+				return -1;
+			}
+
+			output_path = argv[i];
+			i++;
+		} else if (!strcmp(argv[i], "--disk-guid")) {
+			i++;
+			if (i == argc || argv[i][0] == '-') {
+				fprintf(stderr,
+					"no disk guid file specified\n");
+				return -1;
+			}
+
+			if (parse_guid(argv[i], &disk_guid) != 0) {
+				fprintf(stderr, "invalid disk uuid (%s)\n",
+					argv[i]);
+				return -1;
+			}
+			disk_guid_given = 1;
+
+			i++;
+		} else if (!strcmp(argv[i], "--help") ||
+			   !strcmp(argv[i], "-h")) {
+			dump_help(argv[0]);
+			return -1;
+		} else if (!strcmp(argv[i], "--sector-size")) {
+			i++;
+			if (i == argc || argv[i][0] == '-') {
+				fprintf(stderr, "sector size not specified\n");
+				return -1;
+			}
+
+			sect_size = atoi(argv[i]);
+
+			if (sect_size < MIN_SECTOR_SIZE ||
+				sect_size > MAX_SECTOR_SIZE ||
+				sect_size % MIN_SECTOR_SIZE) {
+				fprintf(stderr,
+					"invalid sector size (%zu) - must be "
+					">= %u and <= %u and "
+					"a multiple of %u",
+					sect_size, MIN_SECTOR_SIZE,
+					MAX_SECTOR_SIZE, MIN_SECTOR_SIZE);
+				return -1;
+			}
+			sect_size_given = 1;
+			i++;
+		} else if (!strcmp(argv[i], "--align")) {
+			i++;
+			if (i == argc || argv[i][0] == '-') {
+				fprintf(stderr, "alignment not specified\n");
+				return -1;
+			}
+
+			long align;
+			enum size_unit unit;
+
+			if (parse_size(argv[i], &align, &unit) != 0 ||
+				unit != SIZE_BYTES) {
+				fprintf(stderr, "invalid alignment (%s)\n",
+					argv[i]);
+				return -1;
+			}
+			align_bytes = align;
+
+			i++;
+		} else if (!strcmp(argv[i], "--entries")) {
+			i++;
+			if (i == argc || argv[i][0] == '-') {
+				fprintf(stderr, "entry count not specified\n");
+				return -1;
+			}
+
+			char *end;
+			entry_count = strtol(argv[i], &end, 10);
+			if (*end != '\0' || entry_count < 1 ||
+				entry_count > (long)GPT_MAX_ENTRIES) {
+				fprintf(stderr, "invalid entry count (%s)\n",
+					argv[i]);
+				return -1;
+			}
+
+			i++;
+		} else if (!strcmp(argv[i], "--minimum-image-size") ||
+			   !strcmp(argv[i], "-s")) {
+			i++;
+			if (i == argc || argv[i][0] == '-') {
+				fprintf(stderr,
+					"minimum image size not specified\n");
+				return -1;
+			}
+
+			min_image_sects = atol(argv[i]);
+
+			if (min_image_sects < 2048) {
+				fprintf(stderr, "minimum image size must be at "
+						"least 2048 sectors\n");
+				return -1;
+			}
+
+			i++;
+		} else if (!strcmp(argv[i], "--image-size")) {
+			i++;
+			if (i == argc || argv[i][0] == '-') {
+				fprintf(stderr, "image size not specified\n");
+				return -1;
+			}
+
+			image_sects = atol(argv[i]);
+
+			i++;
+		} else if (!strcmp(argv[i], "--discard")) {
+			discard = 1;
+			i++;
+		} else if (!strcmp(argv[i], "--update")) {
+			update = 1;
+			i++;
+		} else if (!strcmp(argv[i], "--sparse")) {
+			copy_flags |= COPY_SPARSE;
+			i++;
+		} else if (!strcmp(argv[i], "--io")) {
+			i++;
+			if (i == argc || argv[i][0] == '-') {
+				fprintf(stderr, "i/o method not specified\n");
+				return -1;
+			}
+
+			if (parse_io(argv[i]) != 0) {
+				fprintf(stderr, "invalid i/o method (%s)\n",
+					argv[i]);
+				return -1;
+			}
+
+			i++;
+		} else if (!strcmp(argv[i], "--format")) {
+			i++;
+			if (i == argc || argv[i][0] == '-') {
+				fprintf(stderr, "output format not specified\n");
+				return -1;
+			}
+
+			if (parse_format(argv[i]) != 0) {
+				fprintf(stderr, "invalid output format (%s)\n",
+					argv[i]);
+				return -1;
+			}
+
+			i++;
+		} else if (!strcmp(argv[i], "--direct")) {
+			direct |= 1;
+			i++;
+		} else if (!strcmp(argv[i], "--direct-input")) {
+			direct |= 1 | 2;
+			i++;
+		} else if (!strcmp(argv[i], "--manifest")) {
+			i++;
+			if (i == argc || argv[i][0] == '-') {
+				fprintf(stderr, "no manifest file specified\n");
+				return -1;
+			}
+
+			manifest_path = argv[i];
+
+			i++;
+		} else if (!strcmp(argv[i], "--deterministic")) {
+			i++;
+			if (i == argc) {
+				fprintf(stderr, "no seed specified\n");
+				return -1;
+			}
+
+			seed = argv[i];
+
+			i++;
+		} else if (!strcmp(argv[i], "--dedup")) {
+			dedup = 1;
+			i++;
+		} else if (!strcmp(argv[i], "--cache-dir")) {
+			i++;
+			if (i == argc || argv[i][0] == '-') {
+				fprintf(stderr, "no cache directory specified\n");
+				return -1;
+			}
+
+			cache_dir = argv[i];
+
+			i++;
+		} else if (!strcmp(argv[i], "--stats")) {
+			i++;
+			if (i == argc ||
+				(argv[i][0] == '-' && argv[i][1] != '\0')) {
+				fprintf(stderr, "no stats file specified\n");
+				return -1;
+			}
+
+			stats_path = argv[i];
+
+			i++;
+		} else if (!strcmp(argv[i], "--trace")) {
+			i++;
+			if (i == argc ||
+				(argv[i][0] == '-' && argv[i][1] != '\0')) {
+				fprintf(stderr, "no trace file specified\n");
+				return -1;
+			}
+
+			trace_path = argv[i];
+
+			i++;
+		} else if (!strcmp(argv[i], "--progress")) {
+			show_progress = 1;
+			i++;
+		} else if (!strcmp(argv[i], "--verify")) {
+			verify = 1;
+			i++;
+		} else if (!strcmp(argv[i], "--jobs") ||
+			   !strcmp(argv[i], "-j")) {
+			i++;
+			if (i == argc || argv[i][0] == '-') {
+				fprintf(stderr, "number of jobs not specified\n");
+				return -1;
+			}
+
+			jobs = atoi(argv[i]);
+
+			if (jobs < 1) {
+				fprintf(stderr, "need at least one job\n");
+				return -1;
+			}
+
+			i++;
+		} else if (!strcmp(argv[i], "--queue-depth")) {
+			i++;
+			if (i == argc || argv[i][0] == '-') {
+				fprintf(stderr, "queue depth not specified\n");
+				return -1;
+			}
+
+			int depth = atoi(argv[i]);
+
+			if (depth < 1 || depth > 4096) {
+				fprintf(stderr, "queue depth must be between 1 "
+						"and 4096\n");
+				return -1;
+			}
+			queue_depth = depth;
+
+			i++;
+		} else if (!strcmp(argv[i], "--part") || !strcmp(argv[i], "-p"))
+			break;
+		else {
+			fprintf(stderr, "unknown argument - %s\n", argv[i]);
+			dump_help(argv[0]);
+			return i;
+		}
+	}
+
+	/* Now parse partitions */
+	while (i < argc) {
+		if (!strcmp(argv[i], "--part") || !strcmp(argv[i], "-p")) {
+			/* Allocate a new partition structure */
+			cur_part = add_part();
+			if (cur_part == NULL) {
+				fprintf(stderr, "out of memory allocating "
+						"partition structure\n");
+				return -1;
+			}
+			cur_part_id++;
+			cur_part->id = cur_part_id;
+			snprintf(cur_part->name, sizeof(cur_part->name),
+				"part%i", cur_part_id);
+
+			/* Get the filename of the partition image */
+			i++;
+			if (i == argc ||
+				(argv[i][0] == '-' && argv[i][1] != '\0')) {
+				fprintf(stderr,
+					"no partition image specified for "
+					"partition %i\n",
+					cur_part_id);
+				return -1;
+			}
+			cur_part->src_path = argv[i];
+			cur_part->src_direct = -1;
+			struct source *src = open_source(argv[i]);
+			if (src == NULL) {
+				fprintf(stderr,
+					"unable to open partition image (%s) "
+					"for partition (%i) - %s\n",
+					argv[i], cur_part_id, strerror(errno));
+				return -1;
+			}
+			if (src->stream && src->used) {
+				fprintf(stderr,
+					"partition image (%s) for partition "
+					"(%i) can only be read once\n",
+					argv[i], cur_part_id);
+				return -1;
+			}
+			src->used = 1;
+			cur_part->source = src;
+			cur_part->src = src->fd;
+			cur_part->src_stream = src->stream;
+			cur_part->src_length = src->length;
+
+			i++;
+		} else if (!strcmp(argv[i], "--size")) {
+			i++;
+			if (i == argc || argv[i][0] == '-') {
+				fprintf(stderr,
+					"partition size not specified %i\n",
+					cur_part_id);
+				return -1;
+			}
+
+			if (parse_size(argv[i], &cur_part->size,
+				    &cur_part->size_unit) != 0) {
+				fprintf(stderr,
+					"invalid partition size (%s) for "
+					"partition %i\n",
+					argv[i], cur_part_id);
+				return -1;
+			}
+
+			i++;
+		} else if (!strcmp(argv[i], "--start")) {
+			i++;
+			if (i == argc || argv[i][0] == '-') {
+				fprintf(stderr,
+					"start sector not specified for "
+					"partition %i\n",
+					cur_part_id);
+				return -1;
+			}
+
+			long start = atol(argv[i]);
+
+			if (start < 1) {
+				fprintf(stderr,
+					"invalid start sector (%s) for "
+					"partition %i\n",
+					argv[i], cur_part_id);
+				return -1;
+			}
+			cur_part->sect_start = start;
+
+			i++;
+		} else if (cur_part != NULL &&
+			   (opt = parse_part_opt(argc, argv, &i, cur_part)) != 0) {
+			if (opt < 0) {
+				return -1;
+			}
+		} else {
+			fprintf(stderr, "unknown argument - %s\n", argv[i]);
+			dump_help(argv[0]);
+			return i;
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * Names for --io, the backend they select, and the copy methods they allow;
+ * the read/write loop is always allowed as a last resort.
+ */
+static const struct {
+	const char *name;
+	int backend;
+	int flags;
+} io_methods[] = {
+	{"auto", IO_WRITE, COPY_AUTO},
+	{"reflink", IO_WRITE, COPY_REFLINK},
+	{"copy-range", IO_WRITE, COPY_RANGE},
+	{"sendfile", IO_WRITE, COPY_SENDFILE},
+	{"buffered", IO_WRITE, 0},
+	{"mmap", IO_MMAP, 0},
+	{"uring", IO_URING, 0},
+};
+
+static int
+parse_io(const char *str)
+{
+	for (size_t i = 0; i < sizeof(io_methods) / sizeof(io_methods[0]);
+		i++) {
+		if (!strcmp(str, io_methods[i].name)) {
+			io_backend = io_methods[i].backend;
+			copy_flags = (copy_flags & COPY_SPARSE) |
+				     io_methods[i].flags;
+			return 0;
+		}
+	}
+	return -1;
+}
+
+static int
+parse_format(const char *str)
+{
+	if (!strcmp(str, "raw")) {
+		format = FORMAT_RAW;
+	} else if (!strcmp(str, "qcow2")) {
+		format = FORMAT_QCOW2;
+	} else if (!strcmp(str, "simg")) {
+		format = FORMAT_SIMG;
+	} else {
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Parse a size: bytes, optionally with a K, M, G or T suffix (powers of 1024),
+ * sectors with an s suffix, percent of the disk with a % suffix, or "rest" for
+ * whatever is left.
+ */
+static int
+parse_size(const char *str, long *size, enum size_unit *unit)
+{
+	static const char suffixes[] = "KMGT";
+	char *end;
+
+	if (!strcmp(str, "rest")) {
+		*size = 0;
+		*unit = SIZE_REST;
+		return 0;
+	}
+
+	errno = 0;
+	*size = strtol(str, &end, 10);
+	if (errno != 0 || end == str || *size < 1) {
+		return -1;
+	}
+
+	*unit = SIZE_BYTES;
+	if (*end == '\0') {
+		return 0;
+	}
+	if (end[1] != '\0') {
+		return -1;
+	}
+	if (*end == 's') {
+		*unit = SIZE_SECTORS;
+		return 0;
+	}
+	if (*end == '%') {
+		*unit = SIZE_PERCENT;
+		return *size <= 100 ? 0 : -1;
+	}
+
+	const char *suffix = strchr(suffixes, *end);
+	if (suffix == NULL) {
+		return -1;
+	}
+	for (const char *p = suffixes; p <= suffix; p++) {
+		if (*size > LONG_MAX / 1024) {
+			return -1;
+		}
+		*size *= 1024;
+	}
+	return 0;
+}
+
+static void
+dump_help(char *fname)
+{
+	printf("Usage: %s -o <output_file> [-h] [--disk-guid GUID] "
+	       "[--sector-size sect_size] [-s min_image_size] "
+	       "[--align bytes] [--entries count] [--update] "
+	       "[--discard] "
+	       "[--sparse] "
+	       "[--io method] [-j jobs] "
+	       "[--queue-depth depth] "
+	       "[--format raw|qcow2|simg] "
+	       "[--direct] [--direct-input] "
+	       "[--manifest file] "
+	       "[--deterministic seed] [--cache-dir dir] [--dedup] "
+	       "[--stats file] [--trace file] [--progress] [--verify] "
+	       "[partition def 0] [part def 1] ... [part def n]\n"
+	       "  Partition definition: --part <image_file> --type <type> "
+	       "[--uuid uuid] [--name name] [--attributes bits] "
+	       "[--size size] [--start sector]\n"
+	       "       %s --batch <batch_file> [--batch-jobs jobs]\n"
+	       "       %s --edit <image_file> [--sector-size sect_size] "
+	       "[--disk-guid GUID] [--entry <n> <entry options>] ...\n"
+	       "       %s --verify <image_file> [--sector-size sect_size] "
+	       "[-j jobs] [--part <image_file>] ...\n"
+	       "  Please see the README file for further information\n",
+		fname, fname, fname, fname);
+}
+
+/*
+ * Turn a --size in sectors or percent of the disk into bytes, now that the
+ * sector size and (if it's a block device or --image-size was given) the size
+ * of the disk are known. Without those, the disk is made to fit the
+ * partitions, so it can't be what their sizes are a percentage of. The rest of
+ * the disk is left to mkgpt_layout().
+ */
+static int
+resolve_size(struct partition *part)
+{
+	if (part->size_unit == SIZE_SECTORS) {
+		part->size *= sect_size;
+	} else if (part->size_unit == SIZE_PERCENT) {
+		if (image_sects == 0) {
+			fprintf(stderr,
+				"partition %i is a percentage of the disk, "
+				"that needs --image-size or a block device\n",
+				part->id);
+			return -1;
+		}
+		part->size = image_sects * part->size / 100 * sect_size;
+	}
+	part->size_unit = SIZE_BYTES;
+
+	if (part->size < 1) {
+		fprintf(stderr, "no room left on the disk for partition %i\n",
+			part->id);
+		return -1;
+	}
+	return 0;
+}
+
+/* See if the partition image fits, once the partition's size is known. */
+static int
+check_source(struct partition *part)
+{
+	if (part->size > 0) {
+		if (part->src_length > part->size) {
+			fprintf(stderr,
+				"partition image for partition %i is larger "
+				"than its --size\n",
+				part->id);
+			return -1;
+		}
+	} else if (part->src_stream) {
+		fprintf(stderr,
+			"partition image for partition %i can't be measured, "
+			"it needs a --size\n",
+			part->id);
+		return -1;
+	}
+	return 0;
+}
+
+/* Complain about whatever mkgpt_layout() didn't like. */
+static void
+layout_error(void)
+{
+	struct partition *part =
+		&parts[layout.failed < (size_t)part_count ? layout.failed : 0];
+
+	if (layout.error == MKGPT_ERR_ALIGNMENT) {
+		fprintf(stderr,
+			"alignment (%zu) is not a multiple of the sector size "
+			"(%zu)\n",
+			align_bytes, sect_size);
+	} else if (layout.error == MKGPT_ERR_ENTRIES) {
+		fprintf(stderr,
+			"--entries (%ld) is less than the number of partitions "
+			"(%i)\n",
+			entry_count, part_count);
+	} else if (layout.error == MKGPT_ERR_START) {
+		fprintf(stderr,
+			"unable to start partition %i at sector %llu "
+			"(would conflict with other data)\n",
+			part->id, (unsigned long long)part->sect_start);
+	} else if (layout.error == MKGPT_ERR_REST) {
+		fprintf(stderr,
+			"only the last partition can have the rest of the "
+			"disk, not partition %i\n",
+			part->id);
+	} else if (layout.error == MKGPT_ERR_NO_ROOM) {
+		fprintf(stderr, "no room left on the disk for partition %i\n",
+			part->id);
+	} else if (layout.error == MKGPT_ERR_TYPE) {
+		fprintf(stderr,
+			"partition type not specified for partition %i\n",
+			part->id);
+	} else if (layout.error == MKGPT_ERR_TOO_SMALL) {
+		fprintf(stderr,
+			"requested image size (%zu) is too small to hold the "
+			"partitions\n",
+			image_sects * sect_size);
+	} else {
+		fprintf(stderr, "%s\n", mkgpt_strerror(layout.error));
+	}
+}
+
+static int
+check_parts()
+{
+	/* Iterate through the partitions, checking validity */
+	int cur_part_id = 0;
+	struct partition *cur_part;
+
+	free(layout.parts);
+	memset(&layout, 0, sizeof(layout));
+	layout.parts = calloc(part_count > 0 ? part_count : 1,
+		sizeof(*layout.parts));
+	if (layout.parts == NULL) {
+		panic("calloc failed");
+	}
+	layout.count = part_count;
+	layout.sect_size = sect_size;
+	layout.align = align_bytes;
+	layout.entries = entry_count;
+	layout.sectors = image_sects;
+	layout.min_sectors = min_image_sects;
+
+	for (cur_part = parts; cur_part < parts + part_count; cur_part++) {
+		struct mkgpt_part *lp = &layout.parts[cur_part_id];
+
+		cur_part_id++;
+
+		if (cur_part->size_unit != SIZE_BYTES &&
+			cur_part->size_unit != SIZE_REST &&
+			resolve_size(cur_part) != 0) {
+			return -1;
+		}
+		if (cur_part->size_unit != SIZE_REST &&
+			check_source(cur_part) != 0) {
+			return -1;
+		}
+
+		/* TODO is this appropriate? check the spec! */
+		if (guid_is_zero(&cur_part->uuid)) {
+			/* --update keeps what the existing image had */
+			if (have_old_gpt &&
+				(uint32_t)cur_part_id <= old_gpt.entry_count) {
+				bytestring_to_guid(&cur_part->uuid,
+					gpt_entry(&old_gpt, cur_part_id - 1) +
+						GPT_ENTRY_UUID);
+			}
+			/* derive_guids() takes care of it */
+			if (guid_is_zero(&cur_part->uuid) && seed == NULL) {
+				random_guid(&cur_part->uuid);
+			}
+		}
+
+		lp->type = cur_part->type;
+		lp->uuid = cur_part->uuid;
+		lp->attrs = cur_part->attrs;
+		lp->name = cur_part->name;
+		lp->start_lba = cur_part->sect_start;
+		lp->bytes = cur_part->size > 0 ? cur_part->size
+					       : cur_part->src_length;
+		lp->rest = cur_part->size_unit == SIZE_REST;
+	}
+
+	if (mkgpt_layout(&layout) != 0) {
+		layout_error();
+		return -1;
+	}
+
+	cur_part_id = 0;
+	for (cur_part = parts; cur_part < parts + part_count; cur_part++) {
+		const struct mkgpt_part *lp = &layout.parts[cur_part_id++];
+
+		cur_part->sect_start = lp->first_lba;
+		cur_part->sect_length = lp->last_lba + 1 - lp->first_lba;
+		if (cur_part->size_unit == SIZE_REST) {
+			cur_part->size = (long)(cur_part->sect_length * sect_size);
+			cur_part->size_unit = SIZE_BYTES;
+			if (check_source(cur_part) != 0) {
+				return -1;
+			}
+		}
+	}
+
+	header_sectors = layout.entries_sectors;
+	first_usable_sector = layout.first_usable_lba;
+	image_sects = layout.sectors;
+	secondary_headers_sect = layout.secondary_entries_lba;
+	secondary_gpt_sect = layout.secondary_header_lba;
+
+	return 0;
+}
+
+/*
+ * If the output is a block device, the image covers all of it (unless told
+ * otherwise) and its sectors are the device's logical blocks.
+ */
+static int
+probe_device(void)
+{
+	struct stat st;
+
+	if (fstat(output, &st) != 0 || !S_ISBLK(st.st_mode)) {
+		return 0;
+	}
+
+#if defined(BLKGETSIZE64) && defined(BLKSSZGET) && defined(BLKPBSZGET)
+	uint64_t bytes;
+	int logical, physical;
+	if (ioctl(output, BLKGETSIZE64, &bytes) != 0 ||
+		ioctl(output, BLKSSZGET, &logical) != 0 ||
+		ioctl(output, BLKPBSZGET, &physical) != 0) {
+		fprintf(stderr, "unable to get the geometry of %s (%s)\n",
+			output_path, strerror(errno));
+		return -1;
+	}
+
+	if (!sect_size_given) {
+		sect_size = logical;
+	}
+	if ((size_t)logical != sect_size || sect_size < MIN_SECTOR_SIZE ||
+		sect_size > MAX_SECTOR_SIZE) {
+		fprintf(stderr,
+			"sector size (%zu) doesn't match the logical block "
+			"size of %s (%d)\n",
+			sect_size, output_path, logical);
+		return -1;
+	}
+
+	long sects = bytes / sect_size;
+	if (image_sects == 0) {
+		image_sects = sects;
+	} else if (image_sects > sects) {
+		fprintf(stderr, "requested image size (%ld sectors) is larger "
+				"than %s (%ld sectors)\n",
+			image_sects, output_path, sects);
+		return -1;
+	}
+
+	device_bytes = bytes;
+	physical_block = physical;
+	blkdev = 1;
+	return 0;
+#else
+	fprintf(stderr, "block devices are not supported on this platform\n");
+	return -1;
+#endif
+}
+
+/*
+ * Writes to a partition that doesn't start on a physical block boundary turn
+ * into read-modify-write cycles on the device, which is worth a warning.
+ */
+static void
+check_alignment(void)
+{
+	struct partition *cur_part;
+
+	for (cur_part = parts; cur_part < parts + part_count; cur_part++) {
+		if ((cur_part->sect_start * sect_size) % physical_block != 0) {
+			fprintf(stderr,
+				"warning: partition %i is not aligned to the "
+				"physical block size of %s (%zu)\n",
+				cur_part->id, output_path, physical_block);
+		}
+	}
+}
+
+/* Size of the output, which for block devices isn't what fstat() says. */
+static off_t
+output_length(void)
+{
+	struct stat st;
+
+	if (blkdev) {
+		return device_bytes;
+	}
+	return fstat(output, &st) == 0 ? st.st_size : -1;
+}
+
+/*
+ * For --update, see if there's a GPT in the output already. If there isn't
+ * (or it's broken) we simply build a new image as usual; the output wasn't
+ * opened with O_TRUNC, so whatever is in it has to go first (block devices
+ * get clear_unused() instead).
+ */
+static void
+read_old_gpt(void)
+{
+	struct stat st;
+
+	if (fstat(output, &st) != 0 || output_length() <= 0) {
+		return;
+	}
+	if (gpt_read(output, sect_size, 1, &old_gpt) != 0) {
+		fprintf(stderr, "rebuilding %s from scratch\n", output_path);
+		if (!blkdev && ftruncate(output, 0) != 0) {
+			panic("ftruncate failed");
+		}
+		return;
+	}
+	have_old_gpt = 1;
+
+	if (!disk_guid_given) {
+		disk_guid = old_gpt.disk_guid;
+	}
+}
+
+/*
+ * Name of the file next to the output where --update keeps track of which
+ * partition images went into it.
+ */
+static char *
+sources_list_path(void)
+{
+	size_t len = strlen(output_path) + sizeof(".mkgpt-sources");
+	char *path = malloc(len);
+	if (path == NULL) {
+		panic("malloc failed");
+	}
+	snprintf(path, len, "%s.mkgpt-sources", output_path);
+	return path;
+}
+
+/*
+ * One line of the sources list: everything that tells us a partition image is
+ * still the same file with the same contents. The path goes last since it may
+ * contain spaces.
+ */
+static void
+source_line(char *buf, size_t len, int i, const struct source *src)
+{
+	snprintf(buf, len, "%d %llu %llu %ld %lld.%09ld %lld.%09ld %s\n", i,
+		(unsigned long long)src->dev, (unsigned long long)src->ino,
+		src->length, (long long)src->mtime.tv_sec, src->mtime.tv_nsec,
+		(long long)src->ctime.tv_sec, src->ctime.tv_nsec, src->path);
+}
+
+/*
+ * For --update, find the partitions whose images are still exactly what the
+ * sources list says went into the output last time. Anything it doesn't know
+ * about (or no list at all) counts as changed. The list goes away before we
+ * write anything, so a run that doesn't finish can't leave a stale one.
+ */
+static void
+read_sources_list(void)
+{
+	char *path = sources_list_path();
+	FILE *f = fopen(path, "r");
+	char *line = NULL;
+	size_t cap = 0;
+	char want[PATH_MAX + 128];
+
+	for (int i = 0; f != NULL && getline(&line, &cap, f) > 0; i++) {
+		if (!have_old_gpt || i >= part_count ||
+			parts[i].source->stream) {
+			continue;
+		}
+		source_line(want, sizeof(want), i, parts[i].source);
+		parts[i].unchanged = !strcmp(line, want);
+	}
+
+	free(line);
+	if (f != NULL) {
+		fclose(f);
+	}
+	unlink(path);
+	free(path);
+}
+
+/* For --update, remember which partition images are in the output now. */
+static void
+write_sources_list(void)
+{
+	char *path = sources_list_path();
+	FILE *f = fopen(path, "w");
+	char line[PATH_MAX + 128];
+
+	if (f == NULL) {
+		fprintf(stderr, "unable to write %s (%s), the next --update "
+				"will copy everything\n",
+			path, strerror(errno));
+		free(path);
+		return;
+	}
+	for (int i = 0; i < part_count; i++) {
+		if (parts[i].source->stream) {
+			fputs("-\n", f);
+			continue;
+		}
+		source_line(line, sizeof(line), i, parts[i].source);
+		fputs(line, f);
+	}
+	if (fclose(f) != 0) {
+		unlink(path);
+	}
+	free(path);
+}
+
+/*
+ * For --update, compare the layout check_parts() came up with to the one in
+ * the output. If it's the same, partitions whose images are the same files
+ * as last time (see read_sources_list()) are left alone; otherwise the whole
+ * image gets rebuilt.
+ */
+static void
+plan_update(void)
+{
+	int same = output_length() == (off_t)image_sects * (off_t)sect_size &&
+		   old_gpt.alternate_lba == secondary_gpt_sect &&
+		   old_gpt.first_usable_lba == first_usable_sector &&
+		   old_gpt.last_usable_lba == secondary_headers_sect - 1 &&
+		   old_gpt.entries_lba == 2 &&
+		   old_gpt.entry_count == layout.entries &&
+		   old_gpt.entry_size == GPT_ENTRY_SIZE;
+
+	struct partition *cur_part;
+	int i = 0;
+	for (cur_part = parts; same && cur_part < parts + part_count;
+	     cur_part++) {
+		const uint8_t *entry = gpt_entry(&old_gpt, i++);
+		same = get_u64(entry + GPT_ENTRY_FIRST_LBA) ==
+			       cur_part->sect_start &&
+		       get_u64(entry + GPT_ENTRY_LAST_LBA) ==
+			       cur_part->sect_start + cur_part->sect_length - 1;
+	}
+
+	if (!same) {
+		fprintf(stderr, "layout of %s changed, rebuilding it\n",
+			output_path);
+		if (!blkdev && ftruncate(output, 0) != 0) {
+			panic("ftruncate failed");
+		}
+		gpt_free(&old_gpt);
+		have_old_gpt = 0;
+		return;
+	}
+
+}
+
+/*
+ * Open the output a second time, this time with O_DIRECT, and make sure the
+ * partition images can be opened like that too if they're supposed to. Data
+ * goes through those descriptors wherever the alignment rules allow it; the
+ * GPT and unaligned bits still use the page cache.
+ */
+static int
+open_direct(void)
+{
+#if defined(O_DIRECT)
+	if (io_backend != IO_WRITE) {
+		fprintf(stderr, "--direct only works with the write() based "
+				"i/o methods\n");
+		return -1;
+	}
+
+	output_direct = open(output_path, O_WRONLY | O_DIRECT);
+	if (output_direct < 0) {
+		fprintf(stderr, "unable to open %s with O_DIRECT (%s)\n",
+			output_path, strerror(errno));
+		return -1;
+	}
+
+	struct stat st;
+	if (fstat(output_direct, &st) == 0 && st.st_blksize > 0) {
+		direct_align = st.st_blksize;
+	}
+	if (direct_align < (size_t)sysconf(_SC_PAGESIZE)) {
+		direct_align = sysconf(_SC_PAGESIZE);
+	}
+	if (direct_align > COPY_BUFFER_SIZE ||
+		COPY_BUFFER_SIZE % direct_align) {
+		fprintf(stderr, "unsupported O_DIRECT alignment (%zu)\n",
+			direct_align);
+		return -1;
+	}
+
+	if (!(direct & 2)) {
+		return 0;
+	}
+
+	/* open_part() opens them for real, one window at a time */
+	struct partition *cur_part;
+	for (cur_part = parts; cur_part < parts + part_count; cur_part++) {
+		if (cur_part->src >= 0) {
+			continue;
+		}
+		int fd = open(cur_part->src_path, O_RDONLY | O_DIRECT);
+		if (fd < 0) {
+			fprintf(stderr,
+				"unable to open partition image (%s) with "
+				"O_DIRECT - %s\n",
+				cur_part->src_path, strerror(errno));
+			return -1;
+		}
+		close(fd);
+	}
+
+	return 0;
+#else
+	fprintf(stderr, "O_DIRECT is not supported on this platform\n");
+	return -1;
+#endif
+}
+
+static void
+panic(const char *msg)
+{
+	fprintf(stderr, "panic: %s", msg);
+	exit(EXIT_FAILURE);
+}
+
+/*
+ * Feed len bytes at offset off of the output (zeros if buf is NULL) into the
+ * digests for --manifest. This has to happen in order; anything we skipped
+ * over since the last call is zeros and gets digested as such, unless --update
+ * left it alone, in which case we read it back.
+ */
+static void
+digest(const uint8_t *buf, size_t len, off_t off)
+{
+	static const uint8_t zeros[64 * 1024];
+	static uint8_t old[64 * 1024];
+
+	if (off > digest_pos) {
+		digest(NULL, off - digest_pos, digest_pos);
+	}
+	assert(off == digest_pos);
+
+	while (len > 0) {
+		while (digest_part != NULL &&
+			digest_pos >= (off_t)(digest_part->sect_start +
+					     digest_part->sect_length) *
+					      (off_t)sect_size) {
+			digest_part = digest_part + 1 < parts + part_count
+					      ? digest_part + 1
+					      : NULL;
+		}
+
+		/* don't cross into or out of a partition */
+		size_t n = len;
+		int inside = 0;
+		if (digest_part != NULL) {
+			off_t start = (off_t)digest_part->sect_start * sect_size;
+			off_t end = start +
+				    (off_t)digest_part->sect_length * sect_size;
+			inside = digest_pos >= start;
+			off_t limit = inside ? end : start;
+			if ((off_t)n > limit - digest_pos) {
+				n = limit - digest_pos;
+			}
+		}
+		if (buf == NULL && n > sizeof(zeros)) {
+			n = sizeof(zeros);
+		}
+
+		const uint8_t *p = buf != NULL ? buf : zeros;
+		if (buf == NULL && have_old_gpt) {
+			/* --update didn't touch this, digest what's there */
+			if (pread(output, old, n, digest_pos) != (ssize_t)n) {
+				panic("pread failed");
+			}
+			p = old;
+		}
+		sha256_update(&image_sha, p, n);
+		image_crc = crc32_update(image_crc, p, n);
+		if (inside) {
+			sha256_update(&digest_part->sha, p, n);
+			digest_part->crc = crc32_update(digest_part->crc, p, n);
+		}
+
+		if (buf != NULL) {
+			buf += n;
+		}
+		len -= n;
+		digest_pos += n;
+	}
+}
+
+static void
+observe(void *ctx, const void *buf, size_t len, off_t off)
+{
+	(void)ctx;
+	digest(buf, len, off);
+}
+
+/* The copy sink for streaming and --format, write_at() does all the work. */
+static int
+sink(void *ctx, const void *buf, size_t len, off_t off)
+{
+	(void)ctx;
+	write_at(buf, len, off);
+	return 0;
+}
+
+static void
+write_stream(const void *buf, size_t len)
+{
+	const uint8_t *p = buf;
+
+	while (len > 0) {
+		ssize_t n = write(output, p, len);
+		if (n < 0 && errno == EINTR) {
+			continue;
+		}
+		if (n <= 0) {
+			panic("write failed");
+		}
+		p += n;
+		len -= n;
+		stream_pos += n;
+	}
+}
+
+/*
+ * Write len bytes from buf at offset off of int output (or rather, copy them
+ * into place if output is memory mapped). If output is a pipe, offsets must
+ * only go up and we fill in the zeros for anything skipped over.
+ */
+static void
+write_at(const void *buf, size_t len, off_t off)
+{
+	static const uint8_t zeros[64 * 1024];
+
+	if (manifest_path != NULL) {
+		digest(buf, len, off);
+	}
+
+	if (format_ctx != NULL) {
+		if (format_sink(format_ctx, buf, len, off) != 0) {
+			panic("writing the image failed");
+		}
+		return;
+	}
+
+	if (output_map != NULL) {
+		memcpy(output_map + off, buf, len);
+		return;
+	}
+
+	if (streaming) {
+		if (off < stream_pos) {
+			panic("output not written in order");
+		}
+		while (stream_pos < off) {
+			size_t n = sizeof(zeros);
+			if ((off_t)n > off - stream_pos) {
+				n = off - stream_pos;
+			}
+			write_stream(zeros, n);
+		}
+		write_stream(buf, len);
+		return;
+	}
+
+	const uint8_t *p = buf;
+	while (len > 0) {
+		ssize_t n = pwrite(output, p, len, off);
+		if (n < 0 && errno == EINTR) {
+			continue;
+		}
+		if (n <= 0) {
+			panic("pwrite failed");
+		}
+		p += n;
+		len -= n;
+		off += n;
+	}
+}
+
+/*
+ * Write len zeros at off, without digesting them (they'll be overwritten or
+ * were skipped, digest() deals with that).
+ */
+static void
+write_zeros(off_t off, off_t len)
+{
+	static const uint8_t zeros[64 * 1024];
+
+	while (len > 0) {
+		size_t n = sizeof(zeros);
+		if ((off_t)n > len) {
+			n = len;
+		}
+		if (output_map != NULL) {
+			memset(output_map + off, 0, n);
+		} else if (pwrite(output, zeros, n, off) != (ssize_t)n) {
+			panic("pwrite failed");
+		}
+		off += n;
+		len -= n;
+	}
+}
+
+/* Zero a range of the block device output, see clear_unused(). */
+static void
+zero_range(off_t off, off_t len)
+{
+	assert(off >= 0 && len >= 0);
+	if (len == 0) {
+		return;
+	}
+
+#if defined(BLKZEROOUT) && defined(BLKDISCARD)
+	uint64_t range[2] = {off, len};
+	if (ioctl(output, discard ? BLKDISCARD : BLKZEROOUT, range) == 0) {
+		return;
+	}
+#endif
+	write_zeros(off, len);
+}
+
+/*
+ * Before --update copies a partition image over the old one, anything we
+ * won't write (holes, zeros, the tail after the image) must become zeros.
+ * Punching a hole does that for free; without it we have to write it all.
+ */
+static void
+clear_partition(const struct partition *part)
+{
+	off_t start = (off_t)part->sect_start * sect_size;
+	off_t length = (off_t)part->sect_length * sect_size;
+
+#if defined(FALLOC_FL_PUNCH_HOLE)
+	if (fallocate(output, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+		    start, length) == 0) {
+		return;
+	}
+#endif
+
+	copy_flags &= ~COPY_SPARSE;
+
+	/* a stream may turn out shorter than its --size */
+	off_t data = part->src_stream ? 0 : part->src_length;
+	if (data < length) {
+		write_zeros(start + data, length - data);
+	}
+}
+
+/*
+ * The output of a fresh image is all zeros, unless it's a block device. Make
+ * sure everything we won't write is zeros there too, letting the device do
+ * the work: BLKZEROOUT, or BLKDISCARD for --discard. That's the gaps between
+ * partitions (and around them) and what the partition images don't cover.
+ */
+static void
+clear_unused(void)
+{
+	off_t pos = (off_t)first_usable_sector * sect_size;
+	struct partition *cur_part;
+
+	for (cur_part = parts; cur_part < parts + part_count; cur_part++) {
+		off_t start = (off_t)cur_part->sect_start * sect_size;
+		off_t end = start + (off_t)cur_part->sect_length * sect_size;
+		zero_range(pos, start - pos);
+
+		/* sparse copies and streams leave holes anywhere */
+		off_t data = 0;
+		if (!cur_part->src_stream && !(copy_flags & COPY_SPARSE)) {
+			data = cur_part->src_length;
+			data -= data % sect_size;
+		}
+		if (start + data < end) {
+			zero_range(start + data, end - start - data);
+		}
+		pos = end;
+	}
+
+	zero_range(pos, (off_t)secondary_headers_sect * sect_size - pos);
+}
+
+static double
+elapsed(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (ts.tv_sec - image_start.tv_sec) +
+	       (ts.tv_nsec - image_start.tv_nsec) / 1e9;
+}
+
+/* End the current phase (if any) and start the next one. */
+static void
+begin_phase(const char *name)
+{
+	end_phase();
+	if (phase_count < MAX_PHASES) {
+		phases[phase_count].name = name;
+		phases[phase_count].start = elapsed();
+		phase_count++;
+		phase_open = 1;
+	}
+}
+
+static void
+end_phase(void)
+{
+	if (phase_open) {
+		phases[phase_count - 1].end = elapsed();
+		phase_open = 0;
+	}
+}
+
+/* The --progress line, at most ten times a second unless it's the last one. */
+static void
+show_copied(int last)
+{
+	double now = elapsed();
+	double copy_start = phases[phase_count - 1].start;
+
+	if (!last && now - progress_shown < 0.1) {
+		return;
+	}
+	progress_shown = now;
+
+	double mib = progress_done / 1048576.0;
+	fprintf(stderr, "\rcopying: %3d%% (%.0f of %.0f MiB, %.1f MiB/s)%s",
+		progress_total > 0 ? (int)(100 * progress_done / progress_total)
+				   : 100,
+		mib, progress_total / 1048576.0,
+		now > copy_start ? mib / (now - copy_start) : 0.0,
+		last ? "\n" : "");
+}
+
+/*
+ * The copy progress callback: keep track of how much each partition got and
+ * when, and show how far along we are.
+ */
+static void
+account(void *ctx, const struct copy_chunk *chunk, off_t data, off_t holes)
+{
+	int lo = 0, hi = part_count;
+
+	(void)ctx;
+	/* the first partition that ends after the chunk starts */
+	while (lo < hi) {
+		int mid = lo + (hi - lo) / 2;
+		struct partition *p = &parts[mid];
+		off_t end = (off_t)(p->sect_start + p->sect_length) * sect_size;
+		if (chunk->out_off < end) {
+			hi = mid;
+		} else {
+			lo = mid + 1;
+		}
+	}
+	if (lo == part_count) {
+		return;
+	}
+	struct partition *part = &parts[lo];
+
+	pthread_mutex_lock(&progress_lock);
+	double now = elapsed();
+	if (!part->copy_started) {
+		part->copy_started = 1;
+		part->copy_start = now;
+	}
+	part->copy_end = now;
+	part->copied += data;
+	part->holes += holes;
+	progress_done += data + holes;
+	if (show_progress) {
+		show_copied(0);
+	}
+	pthread_mutex_unlock(&progress_lock);
+}
+
+/*
+ * Open a partition image for copying (twice for --direct-input), unless the
+ * source cache already has it open.
+ */
+static void
+open_part(struct partition *part)
+{
+	if (part->src >= 0) {
+		return;
+	}
+
+	part->src = open(part->src_path, O_RDONLY);
+	if (part->src < 0) {
+		fprintf(stderr,
+			"unable to open partition image (%s) for partition "
+			"(%i) - %s\n",
+			part->src_path, part->id, strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+	part->src_owned = 1;
+
+#if defined(O_DIRECT)
+	if (direct & 2) {
+		part->src_direct = open(part->src_path, O_RDONLY | O_DIRECT);
+		if (part->src_direct < 0) {
+			fprintf(stderr,
+				"unable to open partition image (%s) with "
+				"O_DIRECT - %s\n",
+				part->src_path, strerror(errno));
+			exit(EXIT_FAILURE);
+		}
+	}
+#endif
+}
+
+static void
+close_part(struct partition *part)
+{
+	if (part->src_owned) {
+		close(part->src);
+		part->src = -1;
+		part->src_owned = 0;
+	}
+	if (part->src_direct >= 0) {
+		close(part->src_direct);
+		part->src_direct = -1;
+	}
+}
+
+/* How much of a partition's image there is to copy. */
+static off_t
+copy_length(const struct partition *part)
+{
+	off_t length = (off_t)part->sect_length * sect_size;
+
+	if (part->src_stream) {
+		length = part->size;
+	} else if (part->src_length < length) {
+		length = part->src_length;
+	}
+	return length;
+}
+
+/*
+ * How many partitions copy_parts() opens at a time: leave some descriptors for
+ * the output, stdio and io_uring, and --direct-input needs two per image.
+ */
+static int
+open_window(void)
+{
+	struct rlimit rl;
+	int window = MAX_OPEN_PARTS;
+
+	if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur != RLIM_INFINITY &&
+		rl.rlim_cur < 2 * MAX_OPEN_PARTS + 16) {
+		window = rl.rlim_cur > 18 ? (rl.rlim_cur - 16) / 2 : 1;
+	}
+	return window;
+}
+
+/*
+ * Copy the partitions from first up to (not including) end; either the ones
+ * that are copied from their image or (dups) the duplicates of those, which
+ * have to wait until the data they copy is in the output.
+ */
+static void
+copy_window(const struct copy_output *out, int first, int end, int dups)
+{
+	off_t chunk_size = jobs > 1 ? COPY_CHUNK_SIZE : 0;
+	size_t count = 0;
+	struct copy_chunk *chunks = NULL;
+
+	/* first pass counts the chunks, second pass fills them in */
+	for (int pass = 0; pass < 2; pass++) {
+		count = 0;
+		for (int i = first; i < end; i++) {
+			struct partition *cur_part = &parts[i];
+			if (cur_part->unchanged ||
+				(cur_part->dup_of != NULL) != dups) {
+				continue;
+			}
+
+			off_t start = (off_t)cur_part->sect_start * sect_size;
+			off_t length = copy_length(cur_part);
+			int in_fd = cur_part->src;
+			int in_direct_fd = cur_part->src_direct;
+			off_t in_base = 0;
+			if (dups) {
+				in_fd = output;
+				in_direct_fd = -1;
+				in_base = (off_t)cur_part->dup_of->sect_start *
+					  sect_size;
+			}
+
+			off_t offset = 0;
+			do {
+				off_t n = length - offset;
+				if (chunk_size > 0 && n > chunk_size &&
+					!cur_part->src_stream) {
+					n = chunk_size;
+				}
+				if (chunks != NULL) {
+					struct copy_chunk *c = &chunks[count];
+					c->out_off = start + offset;
+					c->in_off = in_base + offset;
+					c->length = n;
+					c->in_fd = in_fd;
+					c->in_direct_fd = in_direct_fd;
+					c->in_stream = cur_part->src_stream;
+				}
+				count++;
+				offset += n;
+			} while (offset < length);
+		}
+
+		if (chunks == NULL) {
+			chunks = calloc(count > 0 ? count : 1, sizeof(*chunks));
+			if (chunks == NULL) {
+				panic("calloc failed");
+			}
+		}
+	}
+
+	if (count == 0) {
+		free(chunks);
+		return;
+	}
+
+	int ret = -1;
+	if (io_backend == IO_URING) {
+		ret = uring_copy(
+			out, chunks, count, queue_depth, sect_size, copy_flags);
+		if (ret != 0 && errno != ENOSYS) {
+			panic("copy failed");
+		}
+		if (ret != 0) {
+			fprintf(stderr,
+				"io_uring not available, writing instead\n");
+			io_backend = IO_WRITE;
+		}
+	}
+	if (ret != 0 && copy_chunks(out, chunks, count, jobs, sect_size,
+				copy_flags) != 0) {
+		panic("copy failed");
+	}
+
+	free(chunks);
+}
+
+/*
+ * Copy the partition images into their places in int output. In sparse mode
+ * we skip over holes in the images as well as all-zero sectors; since the
+ * output was truncated when we opened it, those simply end up as holes in the
+ * output as well. With more than one job, the images are split into chunks so
+ * a single large partition can still keep all threads busy. Partitions that
+ * --update found unchanged are skipped. Images are only open while their
+ * window of open_window() partitions is being copied, and duplicates (see
+ * find_duplicates()) are copied from the output once everything else is.
+ */
+static void
+copy_parts(void)
+{
+	struct partition *cur_part;
 
-			if (parse_guid(argv[i], &cur_part->uuid) != 0) {
-				fprintf(stderr,
-					"invalid partition uuid (%s) for "
-					"partition %i\n",
-					argv[i], cur_part_id);
-				return -1;
+	if (have_old_gpt) {
+		for (cur_part = parts; cur_part < parts + part_count; cur_part++) {
+			if (!cur_part->unchanged) {
+				clear_partition(cur_part);
 			}
+		}
+	}
 
-			i++;
-		} else {
-			fprintf(stderr, "unknown argument - %s\n", argv[i]);
-			dump_help(argv[0]);
-			return i;
+	progress_done = 0;
+	progress_total = 0;
+	progress_shown = 0;
+	for (cur_part = parts; cur_part < parts + part_count; cur_part++) {
+		if (!cur_part->unchanged) {
+			progress_total += copy_length(cur_part);
 		}
 	}
 
-	if (cur_part != NULL) {
-		if (last_part == NULL) {
-			first_part = last_part = cur_part;
-			cur_part->next = NULL;
-		} else {
-			last_part->next = cur_part;
-			last_part = cur_part;
-			cur_part->next = NULL;
+	struct copy_output out = {
+		.fd = output,
+		.direct_fd = output_direct,
+		.direct_align = direct_align,
+		.map = output_map,
+		.observe = manifest_path != NULL && !streaming && !format_ctx
+				   ? observe
+				   : NULL,
+		.sink = streaming || format_ctx ? sink : NULL,
+		.progress = stats_path != NULL || trace_path != NULL ||
+					    show_progress
+				    ? account
+				    : NULL,
+	};
+
+	int window = open_window();
+	for (int first = 0; first < part_count; first += window) {
+		int end = first + window < part_count ? first + window
+						      : part_count;
+
+		for (int i = first; i < end; i++) {
+			if (!parts[i].unchanged && parts[i].dup_of == NULL) {
+				open_part(&parts[i]);
+			}
+		}
+		copy_window(&out, first, end, 0);
+		for (int i = first; i < end; i++) {
+			close_part(&parts[i]);
 		}
 	}
+	copy_window(&out, 0, part_count, 1);
 
-	return 0;
+	if (show_progress) {
+		show_copied(1);
+	}
+
+	/* streams that had more to give than their --size are an error */
+	for (cur_part = parts; cur_part < parts + part_count; cur_part++) {
+		char c;
+		if (cur_part->src_stream && read(cur_part->src, &c, 1) > 0) {
+			fprintf(stderr,
+				"partition image for partition %i is larger "
+				"than its --size\n",
+				cur_part->id);
+			exit(EXIT_FAILURE);
+		}
+	}
 }
 
+/*
+ * Size int output to the whole image and map it into memory so we can build
+ * everything in place. If that doesn't work we just write() as usual.
+ */
 static void
-dump_help(char *fname)
+map_output(void)
 {
-	printf("Usage: %s -o <output_file> [-h] [--disk-guid GUID] "
-	       "[--sector-size sect_size] [-s min_image_size] "
-	       "[partition def 0] [part def 1] ... [part def n]\n"
-	       "  Partition definition: --part <image_file> --type <type> "
-	       "[--uuid uuid] [--name name]\n"
-	       "  Please see the README file for further information\n",
-		fname);
+	size_t length = (size_t)image_sects * sect_size;
+
+	if (ftruncate(output, length) != 0) {
+		fprintf(stderr, "unable to resize output (%s), not mapping it\n",
+			strerror(errno));
+		return;
+	}
+
+	void *map = mmap(
+		NULL, length, PROT_READ | PROT_WRITE, MAP_SHARED, output, 0);
+	if (map == MAP_FAILED) {
+		fprintf(stderr, "unable to map output (%s), writing instead\n",
+			strerror(errno));
+		return;
+	}
+
+	output_map = map;
+}
+
+static void
+unmap_output(void)
+{
+	if (output_map != NULL) {
+		munmap(output_map, (size_t)image_sects * sect_size);
+		output_map = NULL;
+	}
+}
+
+/*
+ * Set up the writer for --format; from here on write_at() passes everything
+ * to it.
+ */
+static void
+start_format(void)
+{
+	uint64_t length = (uint64_t)image_sects * sect_size;
+
+	if (format == FORMAT_QCOW2) {
+		format_sink = qcow2_write;
+		format_ctx = qcow2_create(output, length);
+	} else if (format == FORMAT_SIMG) {
+		size_t block = length % SIMG_BLOCK_SIZE == 0 ? SIMG_BLOCK_SIZE
+							     : sect_size;
+		if (length / block > UINT32_MAX) {
+			fprintf(stderr,
+				"image too large for --format simg (more than "
+				"2^32 blocks of %zu bytes)\n",
+				block);
+			exit(EXIT_FAILURE);
+		}
+		format_sink = simg_write;
+		format_ctx = simg_create(output, length, block);
+	}
+	if (format_ctx == NULL) {
+		panic("unable to set up the output format");
+	}
+}
+
+static void
+finish_format(void)
+{
+	int ret = format == FORMAT_QCOW2 ? qcow2_finish(format_ctx)
+					 : simg_finish(format_ctx);
+	if (ret != 0) {
+		panic("finishing the output format failed");
+	}
+	format_ctx = NULL;
 }
 
+/* For mkgpt_write_*(), write_at() doesn't come back if it fails. */
 static int
-check_parts()
+write_layout(void *ctx, const void *buf, size_t len, off_t off)
+{
+	(void)ctx;
+	write_at(buf, len, off);
+	return 0;
+}
+
+static void
+write_output(void)
 {
-	/* Iterate through the partitions, checking validity */
-	int cur_part_id = 0;
-	int cur_sect;
 	struct partition *cur_part;
-	int header_length;
-	int needed_file_length;
 
-	/* Count partitions */
-	cur_part = first_part;
-	part_count = 0;
-	while (cur_part) {
-		part_count++;
-		cur_part = cur_part->next;
+	begin_phase("write_gpt");
+
+	if (io_backend == IO_MMAP) {
+		map_output();
 	}
 
-	/* Determine the sectors needed for MBR, GPT header and partition
-	 * entries */
-	cur_sect = 2; /* MBR + GPT header */
-	header_length = part_count * PART_ENTRY_SIZE;
-	header_sectors = header_length / sect_size;
-	if (header_length % sect_size) {
-		header_sectors++;
+	if (format != FORMAT_RAW) {
+		start_format();
 	}
 
-	/* The GPT entry array must be a minimum of 16,384 bytes (reports
-	 * wikipedia and testdisk, but not the UEFI spec)
-	 */
-	if (header_sectors < (int)(16384 / sect_size)) {
-		header_sectors = (int)(16384 / sect_size);
+	sha256_init(&image_sha);
+	image_crc = crc32_init();
+	for (cur_part = parts; cur_part < parts + part_count; cur_part++) {
+		sha256_init(&cur_part->sha);
+		cur_part->crc = crc32_init();
 	}
+	digest_part = parts;
+	digest_pos = 0;
 
-	cur_sect += header_sectors;
-	first_usable_sector = cur_sect;
+	if (blkdev && !have_old_gpt) {
+		clear_unused();
+	}
 
-	cur_part = first_part;
-	while (cur_part) {
-		long cur_part_file_len;
+	/* plan_update() might have brought back the old disk GUID */
+	layout.disk_guid = disk_guid;
+	if (mkgpt_write_primary(&layout, write_layout, NULL) != 0) {
+		panic("building the GPT failed");
+	}
 
-		cur_part_id++;
+	/* Write partitions */
+	begin_phase("copy_parts");
+	copy_parts();
 
-		if (guid_is_zero(&cur_part->type)) {
-			fprintf(stderr,
-				"partition type not specified for partition "
-				"%i\n",
-				cur_part_id);
-			return -1;
-		}
+	/* Write secondary GPT partition headers and header */
+	begin_phase("write_secondary_gpt");
+	if (mkgpt_write_secondary(&layout, write_layout, NULL) != 0) {
+		panic("building the GPT failed");
+	}
 
-		/* TODO is this appropriate? check the spec! */
-		if (guid_is_zero(&cur_part->uuid)) {
-			random_guid(&cur_part->uuid);
+	unmap_output();
+
+	if (format != FORMAT_RAW) {
+		finish_format();
+	}
+}
+
+/* SHA-256 of a partition image, unless we have it already. */
+static int
+hash_source(struct source *src)
+{
+	if (src->hashed) {
+		return 0;
+	}
+	if (src->stream) {
+		fprintf(stderr,
+			"partition image (%s) is a pipe, it can't be hashed "
+			"for --deterministic, --cache-dir or --dedup\n",
+			src->path);
+		return -1;
+	}
+
+	int fd = src->fd >= 0 ? src->fd : open(src->path, O_RDONLY);
+	if (fd < 0) {
+		fprintf(stderr, "unable to open %s (%s)\n", src->path,
+			strerror(errno));
+		return -1;
+	}
+	uint8_t *buf = malloc(COPY_BUFFER_SIZE);
+	if (buf == NULL) {
+		panic("malloc failed");
+	}
+
+	struct sha256 sha;
+	sha256_init(&sha);
+	off_t off = 0;
+	ssize_t n;
+	while ((n = pread(fd, buf, COPY_BUFFER_SIZE, off)) != 0) {
+		if (n < 0 && errno == EINTR) {
+			continue;
+		}
+		if (n < 0) {
+			fprintf(stderr, "unable to read %s (%s)\n", src->path,
+				strerror(errno));
+			break;
 		}
+		sha256_update(&sha, buf, n);
+		off += n;
+	}
+	free(buf);
+	if (src->fd < 0) {
+		close(fd);
+	}
+	if (n < 0) {
+		return -1;
+	}
 
-		if (cur_part->sect_start == 0) {
-			cur_part->sect_start = cur_sect;
-		} else if (cur_part->sect_start < cur_sect) {
-			fprintf(stderr,
-				"unable to start partition %i at sector %i "
-				"(would conflict with other data)\n",
-				cur_part_id, cur_part->sect_start);
+	sha256_final(&sha, src->sha);
+	src->hashed = 1;
+	return 0;
+}
+
+/*
+ * SHA-256 of every partition image, for --deterministic and --cache-dir; each
+ * file is read once no matter how many partitions use it.
+ */
+static int
+hash_sources(void)
+{
+	struct partition *cur_part;
+
+	for (cur_part = parts; cur_part < parts + part_count; cur_part++) {
+		if (hash_source(cur_part->source) != 0) {
 			return -1;
 		}
+	}
+	return 0;
+}
 
-		fseek(cur_part->src, 0, SEEK_END);
-		cur_part_file_len = ftell(cur_part->src);
-		fseek(cur_part->src, 0, SEEK_SET);
+/*
+ * Read back the image we just wrote with verify_image(), comparing each
+ * partition against its image; pipes (and standard input) can't be read
+ * again, so those partitions are only checked as far as the GPT goes.
+ */
+static int
+verify_output(int threads)
+{
+	const char **srcs = calloc(part_count, sizeof(*srcs));
+	if (srcs == NULL) {
+		panic("calloc failed");
+	}
 
-		if (cur_part->sect_length == 0) {
-			cur_part->sect_length = cur_part_file_len / sect_size;
-			if (cur_part_file_len % sect_size) {
-				cur_part->sect_length++;
-			}
+	for (int i = 0; i < part_count; i++) {
+		struct source *src = parts[i].source;
+		if (!src->stream && strcmp(src->path, "-")) {
+			srcs[i] = src->path;
 		}
-		cur_sect = cur_part->sect_start + cur_part->sect_length;
-
-		cur_part = cur_part->next;
 	}
 
-	/* Add space for the secondary GPT */
-	needed_file_length = cur_sect + 1 + header_sectors;
+	int ret = verify_image(output_path, sect_size, srcs, part_count, threads);
+	free(srcs);
+	return ret;
+}
 
-	if (image_sects == 0) {
-		if (needed_file_length > min_image_sects) {
-			image_sects = needed_file_length;
-		} else {
-			image_sects = min_image_sects;
-		}
-	} else if (image_sects < needed_file_length) {
-		fprintf(stderr,
-			"requested image size (%zu) is too small to hold the "
-			"partitions\n",
-			image_sects * sect_size);
+/* Whether two partitions get the same data from their images. */
+static int
+same_data(struct partition *a, struct partition *b)
+{
+	if (a->src_stream || b->src_stream || a->src_length != b->src_length) {
+		return 0;
+	}
+	if (a->source->same == b->source->same) {
+		return 1;
+	}
+	if (!dedup && !(a->source->hashed && b->source->hashed)) {
+		return 0;
+	}
+	if (hash_source(a->source) != 0 || hash_source(b->source) != 0) {
 		return -1;
 	}
+	return !memcmp(a->source->sha, b->source->sha, SHA256_DIGEST_LENGTH);
+}
 
-	secondary_headers_sect = image_sects - 1 - header_sectors;
-	secondary_gpt_sect = image_sects - 1;
-
+/*
+ * Find partitions that get the same data as an earlier one: from the same file
+ * (under any name), or with the same contents if --dedup (or hash_sources())
+ * hashed them. Those are copied from the earlier partition's place in the
+ * output rather than from their image, which lets the file system share the
+ * extents (FICLONERANGE) if it can, and reads the image only once if not.
+ */
+static int
+find_duplicates(void)
+{
+	for (int i = 1; i < part_count; i++) {
+		for (int j = 0; j < i; j++) {
+			if (parts[j].dup_of != NULL) {
+				continue;
+			}
+			int same = same_data(&parts[i], &parts[j]);
+			if (same < 0) {
+				return -1;
+			}
+			if (same) {
+				parts[i].dup_of = &parts[j];
+				break;
+			}
+		}
+	}
 	return 0;
 }
 
+/* Add a line of text to a SHA-256. */
 static void
-panic(const char *msg)
+hash_line(struct sha256 *sha, const char *fmt, ...)
 {
-	fprintf(stderr, "panic: %s", msg);
-	exit(EXIT_FAILURE);
+	char line[256];
+	va_list ap;
+
+	va_start(ap, fmt);
+	int len = vsnprintf(line, sizeof(line), fmt, ap);
+	va_end(ap);
+	if (len < 0 || (size_t)len >= sizeof(line)) {
+		panic("hash_line overflow");
+	}
+	sha256_update(sha, line, len);
+}
+
+static void
+hex_digest(char *str, const uint8_t *digest)
+{
+	for (size_t i = 0; i < SHA256_DIGEST_LENGTH; i++) {
+		sprintf(str + 2 * i, "%02x", digest[i]);
+	}
 }
 
 /*
- * Write the "protective MBR" to FILE *output.
+ * Everything about the layout and the partitions' contents that ends up in
+ * the image, with or without the GUIDs (derive_guids() hasn't got them yet).
  */
 static void
-write_mbr(void)
+hash_layout(struct sha256 *sha, int guids)
 {
-	uint8_t mbr[MAX_SECTOR_SIZE] = {0};
-	assert(sect_size <= sizeof(mbr));
-
-	/* entry for "Partition 1" starts here */
-	uint8_t *p1 = mbr + 446;
+	char guid[GUID_STRING_LENGTH + 1];
+	char hex[2 * SHA256_DIGEST_LENGTH + 1];
+	struct partition *cur_part;
 
-	/* boot indicator = 0, start CHS = 0x000200 */
-	set_u32(p1 + 0, 0x00020000);
-	/* OSType 0xee = GPT Protective, EndingCHS = 0xffffff */
-	set_u32(p1 + 4, 0xffffffee);
-	/* StartingLBA = 1 */
-	set_u32(p1 + 8, 0x00000001);
-	/* number of sectors in partition */
-	if (image_sects > 0xffffffff) {
-		set_u32(p1 + 12, 0xffffffff);
-	} else {
-		assert(image_sects > 1); /* 0 sectors is not allowed */
-		set_u32(p1 + 12, image_sects - 1);
+	hash_line(sha, "sector_size %zu sectors %ld entries %zu\n", sect_size,
+		image_sects, layout.entries);
+	if (guids) {
+		guid_to_string(guid, &disk_guid);
+		hash_line(sha, "disk_guid %s\n", guid);
 	}
-	/* Signature */
-	set_u16(mbr + 510, 0xaa55);
 
-	if (fwrite(mbr, 1, sect_size, output) != sect_size) {
-		panic("fwrite failed");
+	for (cur_part = parts; cur_part < parts + part_count; cur_part++) {
+		guid_to_string(guid, &cur_part->type);
+		hex_digest(hex, cur_part->source->sha);
+		hash_line(sha,
+			"part %d type %s attrs %llx start %llu sectors %llu "
+			"length %ld sha256 %s name %s\n",
+			cur_part->id, guid,
+			(unsigned long long)cur_part->attrs,
+			(unsigned long long)cur_part->sect_start,
+			(unsigned long long)cur_part->sect_length,
+			cur_part->src_length, hex, cur_part->name);
+		if (guids) {
+			guid_to_string(guid, &cur_part->uuid);
+			hash_line(sha, "uuid %s\n", guid);
+		}
 	}
 }
 
+/*
+ * Make up GUID number n from base, as an RFC 9562 version 8 ("custom") one
+ * since it's neither random nor one of the standard name based ones.
+ */
+static void
+derive_guid(GUID *guid, const uint8_t *base, uint32_t n)
+{
+	struct sha256 sha;
+	uint8_t num[4];
+	uint8_t digest[SHA256_DIGEST_LENGTH];
+
+	set_be32(num, n);
+	sha256_init(&sha);
+	sha256_update(&sha, base, SHA256_DIGEST_LENGTH);
+	sha256_update(&sha, num, sizeof(num));
+	sha256_final(&sha, digest);
+
+	bytestring_to_guid(guid, digest);
+	guid->data3 = (guid->data3 & 0x0fff) | 0x8000;
+	guid->data4[0] = (guid->data4[0] & 0x3f) | 0x80;
+}
+
+/*
+ * --deterministic: instead of random ones, derive the disk GUID (0) and the
+ * partition GUIDs (their numbers) we weren't given from the seed, the layout
+ * and what's in the partition images.
+ */
 static void
-write_output(void)
+derive_guids(void)
 {
-	uint8_t *parts;
+	struct sha256 sha;
+	uint8_t base[SHA256_DIGEST_LENGTH];
 	struct partition *cur_part;
 
-	write_mbr();
-
-	/* Define GPT headers */
-	uint8_t gpt[MAX_SECTOR_SIZE] = {0};
-	assert(sect_size <= sizeof(gpt));
-	uint8_t gpt2[MAX_SECTOR_SIZE] = {0};
-	assert(sect_size <= sizeof(gpt2));
-
-	set_u64(gpt + 0, 0x5452415020494645ULL); /* Signature */
-	set_u32(gpt + 8, 0x00010000UL); /* Revision */
-	set_u32(gpt + 12, GPT_HEADER_SIZE); /* HeaderSize */
-	set_u32(gpt + 16, 0); /* HeaderCRC32 */
-	set_u32(gpt + 20, 0); /* Reserved */
-	set_u64(gpt + 24, 0x1); /* MyLBA */
-	set_u64(gpt + 32, secondary_gpt_sect); /* AlternateLBA */
-	set_u64(gpt + 40, first_usable_sector); /* FirstUsableLBA */
-	set_u64(gpt + 48, secondary_headers_sect - 1); /* LastUsableLBA */
-	guid_to_bytestring(gpt + 56, &disk_guid); /* DiskGUID */
-	set_u64(gpt + 72, 0x2); /* PartitionEntryLBA */
-	set_u32(gpt + 80, part_count); /* NumberOfPartitionEntries */
-	set_u32(gpt + 84, PART_ENTRY_SIZE); /* SizeOfPartitionEntry */
-	set_u32(gpt + 88, 0); /* PartitionEntryArrayCRC32 */
-
-	/* Define GPT partition entries */
-	parts = calloc(header_sectors, sect_size);
-	if (parts == NULL) {
-		panic("calloc failed");
+	sha256_init(&sha);
+	sha256_update(&sha, "mkgpt deterministic 1\n", 22);
+	sha256_update(&sha, seed, strlen(seed) + 1);
+	hash_layout(&sha, 0);
+	sha256_final(&sha, base);
+
+	if (!disk_guid_given && !have_old_gpt) {
+		derive_guid(&disk_guid, base, 0);
+	}
+	for (cur_part = parts; cur_part < parts + part_count; cur_part++) {
+		if (guid_is_zero(&cur_part->uuid)) {
+			derive_guid(&cur_part->uuid, base, cur_part->id);
+			layout.parts[cur_part - parts].uuid = cur_part->uuid;
+		}
 	}
+}
 
-	cur_part = first_part;
-	int i = 0;
-	while (cur_part) {
-		int char_id;
-
-		guid_to_bytestring(parts + i * PART_ENTRY_SIZE + 0,
-			&cur_part->type); /* PartitionTypeGUID */
-		guid_to_bytestring(parts + i * PART_ENTRY_SIZE + 16,
-			&cur_part->uuid); /* UniquePartitionGUID */
-		set_u64(parts + i * PART_ENTRY_SIZE + 32,
-			cur_part->sect_start); /* StartingLBA */
-		set_u64(parts + i * PART_ENTRY_SIZE + 40,
-			cur_part->sect_start + cur_part->sect_length -
-				1); /* EndingLBA */
-		set_u64(parts + i * PART_ENTRY_SIZE + 48,
-			cur_part->attrs); /* Attributes */
+static char *
+cache_path(void)
+{
+	size_t len = strlen(cache_dir) + sizeof(cache_key) + 8;
+	char *path = malloc(len);
+	if (path == NULL) {
+		panic("malloc failed");
+	}
+	snprintf(path, len, "%s/%s.img", cache_dir, cache_key);
+	return path;
+}
 
-		/*
-		 * TODO settle missing UTF-16LE conversion issue somehow,
-		 * possibly by simply limiting the tool to ASCII here?
-		 * TODO used to be "&& char_id < 35" but MAX_PART_NAME is 36
-		 * now so which is correct? do we need a "double zero" at the
-		 * end or not? what does the spec say? sfdisk works with 36
-		 * chars and if we try 37 it just ignores the extra one, so
-		 * there's some indication that no "double zero" is needed and
-		 * that 36 is indeed the correct limit
-		 */
-		int len = min(strlen(cur_part->name), MAX_PART_NAME);
-		for (char_id = 0; char_id < len; char_id++) {
-			set_u16(parts + i * PART_ENTRY_SIZE + 56 + char_id * 2,
-				cur_part->name[char_id]);
+/*
+ * --cache-dir: if the cache has the image already, make the output a copy of
+ * it, sharing its extents (reflink) if the file system can, or simply a copy;
+ * never a hard link, the output is ours to edit or rebuild later and the
+ * cached image has to stay the way it is. Returns 1 if the image came from
+ * the cache.
+ */
+static int
+cache_lookup(void)
+{
+	struct sha256 sha;
+	uint8_t digest[SHA256_DIGEST_LENGTH];
+
+	sha256_init(&sha);
+	sha256_update(&sha, "mkgpt image cache 1\n", 20);
+	hash_line(&sha, "format %d header_size %u entry_size %u\n", (int)format,
+		GPT_HEADER_SIZE, GPT_ENTRY_SIZE);
+	hash_layout(&sha, 1);
+	sha256_final(&sha, digest);
+	hex_digest(cache_key, digest);
+
+	char *path = cache_path();
+	int fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		free(path);
+		return 0;
+	}
+
+	int ret = -1;
+#if defined(FICLONE)
+	ret = ioctl(output, FICLONE, fd);
+#endif
+
+	struct stat st;
+	if (ret != 0 && fstat(fd, &st) == 0 &&
+		ftruncate(output, st.st_size) == 0) {
+		struct copy_output out = {.fd = output, .direct_fd = -1};
+		struct copy_chunk chunk = {.length = st.st_size,
+			.in_fd = fd,
+			.in_direct_fd = -1};
+		if (copy_range(&out, &chunk, sect_size,
+			    COPY_AUTO | COPY_SPARSE) == st.st_size) {
+			ret = 0;
+		}
+	}
+
+	close(fd);
+	if (ret != 0) {
+		fprintf(stderr, "unable to use cached image %s, building it\n",
+			path);
+	}
+	free(path);
+	return ret == 0;
+}
+
+/*
+ * Put the image we just built into the cache: copied (reflinked where that
+ * works) to a temporary file first and renamed into place, so the cache never
+ * has half an image in it.
+ */
+static void
+cache_store(void)
+{
+	size_t len = strlen(cache_dir) + 16;
+	char *tmp = malloc(len);
+	if (tmp == NULL) {
+		panic("malloc failed");
+	}
+	snprintf(tmp, len, "%s/.tmp-XXXXXX", cache_dir);
+
+	struct stat st;
+	int fd = mkstemp(tmp);
+	if (fd < 0 || fstat(output, &st) != 0 ||
+		ftruncate(fd, st.st_size) != 0) {
+		fprintf(stderr, "unable to add the image to %s (%s)\n",
+			cache_dir, strerror(errno));
+		if (fd >= 0) {
+			close(fd);
+			unlink(tmp);
 		}
+		free(tmp);
+		return;
+	}
+
+	struct copy_output out = {.fd = fd, .direct_fd = -1};
+	struct copy_chunk chunk = {
+		.length = st.st_size, .in_fd = output, .in_direct_fd = -1};
+	char *path = cache_path();
+	if (copy_range(&out, &chunk, sect_size, COPY_AUTO | COPY_SPARSE) !=
+			st.st_size ||
+		fchmod(fd, 0444) != 0 || rename(tmp, path) != 0) {
+		fprintf(stderr, "unable to add the image to %s (%s)\n",
+			cache_dir, strerror(errno));
+		unlink(tmp);
+	}
+	close(fd);
+	free(path);
+	free(tmp);
+}
 
-		i++;
-		cur_part = cur_part->next;
+static void
+json_string(FILE *f, const char *str)
+{
+	fputc('"', f);
+	for (; *str; str++) {
+		unsigned char c = *str;
+		if (c == '"' || c == '\\') {
+			fprintf(f, "\\%c", c);
+		} else if (c < 0x20) {
+			fprintf(f, "\\u%04x", c);
+		} else {
+			fputc(c, f);
+		}
 	}
+	fputc('"', f);
+}
+
+static void
+json_digest(FILE *f, struct sha256 *sha)
+{
+	uint8_t d[SHA256_DIGEST_LENGTH];
+	sha256_final(sha, d);
 
-	/* Do CRC calculations on the partition table entries and GPT headers */
-	uint32_t parts_crc;
-	CalculateCrc32(parts, part_count * PART_ENTRY_SIZE, &parts_crc);
-	set_u32(gpt + 88, parts_crc);
+	fputc('"', f);
+	for (size_t i = 0; i < sizeof(d); i++) {
+		fprintf(f, "%02x", d[i]);
+	}
+	fputc('"', f);
+}
 
-	uint32_t gpt_crc;
-	CalculateCrc32(gpt, GPT_HEADER_SIZE, &gpt_crc);
-	set_u32(gpt + 16, gpt_crc);
+/*
+ * Describe what we just built, including the digests we collected on the way,
+ * as JSON in manifest_path.
+ */
+static int
+write_manifest(void)
+{
+	char guid[GUID_STRING_LENGTH + 1];
 
-	memcpy(gpt2, gpt, GPT_HEADER_SIZE);
-	set_u32(gpt2 + 16, 0); /* HeaderCRC32 */
-	set_u64(gpt2 + 24, secondary_gpt_sect); /* MyLBA */
-	set_u64(gpt2 + 32, 0x1); /* AlternateLBA */
-	set_u64(gpt2 + 72, secondary_headers_sect); /* PartitionEntryLBA */
+	FILE *f = fopen(manifest_path, "w");
+	if (f == NULL) {
+		fprintf(stderr, "unable to open %s for writing (%s)\n",
+			manifest_path, strerror(errno));
+		return -1;
+	}
 
-	uint32_t gpt2_crc;
-	CalculateCrc32(gpt2, GPT_HEADER_SIZE, &gpt2_crc);
-	set_u32(gpt2 + 16, gpt2_crc);
+	fprintf(f, "{\n\t\"image\": ");
+	json_string(f, output_path);
+	fprintf(f, ",\n\t\"sector_size\": %zu,\n", sect_size);
+	fprintf(f, "\t\"sectors\": %ld,\n", image_sects);
+	fprintf(f, "\t\"size\": %lld,\n", (long long)image_sects * sect_size);
+	guid_to_string(guid, &disk_guid);
+	fprintf(f, "\t\"disk_guid\": \"%s\",\n", guid);
+	fprintf(f, "\t\"first_usable_lba\": %llu,\n",
+		(unsigned long long)first_usable_sector);
+	fprintf(f, "\t\"last_usable_lba\": %llu,\n",
+		(unsigned long long)secondary_headers_sect - 1);
+	fprintf(f, "\t\"crc32\": \"%08x\",\n", crc32_final(image_crc));
+	fprintf(f, "\t\"sha256\": ");
+	json_digest(f, &image_sha);
+	fprintf(f, ",\n\t\"partitions\": [");
 
-	/* Write primary GPT and headers */
-	if (fwrite(gpt, 1, sect_size, output) != sect_size) {
-		panic("fwrite failed");
+	struct partition *cur_part;
+	for (cur_part = parts; cur_part < parts + part_count; cur_part++) {
+		fprintf(f, "%s\n\t\t{\n", cur_part == parts ? "" : ",");
+		fprintf(f, "\t\t\t\"number\": %d,\n", cur_part->id);
+		fprintf(f, "\t\t\t\"name\": ");
+		json_string(f, cur_part->name);
+		fprintf(f, ",\n\t\t\t\"source\": ");
+		json_string(f, cur_part->src_path);
+		fprintf(f, ",\n\t\t\t\"source_size\": %ld,\n",
+			cur_part->src_length);
+		guid_to_string(guid, &cur_part->type);
+		fprintf(f, "\t\t\t\"type\": \"%s\",\n", guid);
+		guid_to_string(guid, &cur_part->uuid);
+		fprintf(f, "\t\t\t\"uuid\": \"%s\",\n", guid);
+		fprintf(f, "\t\t\t\"attributes\": %llu,\n",
+			(unsigned long long)cur_part->attrs);
+		fprintf(f, "\t\t\t\"first_lba\": %llu,\n",
+			(unsigned long long)cur_part->sect_start);
+		fprintf(f, "\t\t\t\"last_lba\": %llu,\n",
+			(unsigned long long)(cur_part->sect_start +
+					     cur_part->sect_length - 1));
+		fprintf(f, "\t\t\t\"sectors\": %llu,\n",
+			(unsigned long long)cur_part->sect_length);
+		fprintf(f, "\t\t\t\"crc32\": \"%08x\",\n",
+			crc32_final(cur_part->crc));
+		fprintf(f, "\t\t\t\"sha256\": ");
+		json_digest(f, &cur_part->sha);
+		fprintf(f, "\n\t\t}");
 	}
-	if (fwrite(parts, 1, header_sectors * sect_size, output) !=
-		header_sectors * sect_size) {
-		panic("fwrite failed");
+	fprintf(f, "\n\t]\n}\n");
+
+	if (fclose(f) != 0) {
+		fprintf(stderr, "unable to write %s (%s)\n", manifest_path,
+			strerror(errno));
+		return -1;
 	}
+	return 0;
+}
 
-	/* Write partitions */
-	cur_part = first_part;
-	uint8_t image_buf[MAX_SECTOR_SIZE] = {0};
-	assert(sect_size <= sizeof(image_buf));
-	while (cur_part) {
-		size_t bytes_read;
-		size_t bytes_written = 0;
+/* Open path for --stats or --trace, "-" is stderr. */
+static FILE *
+open_report(const char *path)
+{
+	FILE *f = !strcmp(path, "-") ? stderr : fopen(path, "w");
+	if (f == NULL) {
+		fprintf(stderr, "unable to open %s for writing (%s)\n", path,
+			strerror(errno));
+	}
+	return f;
+}
 
-		fseek(output, cur_part->sect_start * sect_size, SEEK_SET);
-		while ((bytes_read = fread(
-				image_buf, 1, sect_size, cur_part->src)) > 0) {
-			size_t bytes_to_write = bytes_read;
+static int
+close_report(FILE *f, const char *path)
+{
+	if (f == stderr ? fflush(f) != 0 : fclose(f) != 0) {
+		fprintf(stderr, "unable to write %s (%s)\n", path,
+			strerror(errno));
+		return -1;
+	}
+	return 0;
+}
 
-			/* Determine how much to write */
-			if ((bytes_written + bytes_to_write) >
-				(size_t)(cur_part->sect_length * sect_size))
-				bytes_to_write =
-					cur_part->sect_length * sect_size -
-					bytes_written;
+/*
+ * Tell where the time went as JSON in stats_path: how long each phase took
+ * and, for each partition, how much data was copied (and how many bytes of
+ * holes were skipped), when, and how fast. Times are in seconds since we
+ * started on the image.
+ */
+static int
+write_stats(void)
+{
+	FILE *f = open_report(stats_path);
+	if (f == NULL) {
+		return -1;
+	}
 
-			if (fwrite(image_buf, 1, bytes_to_write, output) !=
-				bytes_to_write) {
-				panic("fwrite failed");
-			}
+	off_t copied = 0, holes = 0;
+	struct partition *cur_part;
+	for (cur_part = parts; cur_part < parts + part_count; cur_part++) {
+		copied += cur_part->copied;
+		holes += cur_part->holes;
+	}
 
-			bytes_written += bytes_to_write;
-		}
+	fprintf(f, "{\n\t\"image\": ");
+	json_string(f, output_path);
+	fprintf(f, ",\n\t\"seconds\": %.6f,\n",
+		phase_count > 0 ? phases[phase_count - 1].end : 0.0);
+	fprintf(f, "\t\"copied\": %lld,\n", (long long)copied);
+	fprintf(f, "\t\"holes\": %lld,\n", (long long)holes);
+	fprintf(f, "\t\"phases\": [");
+	for (int i = 0; i < phase_count; i++) {
+		fprintf(f,
+			"%s\n\t\t{\"name\": \"%s\", \"start\": %.6f, "
+			"\"seconds\": %.6f}",
+			i == 0 ? "" : ",", phases[i].name, phases[i].start,
+			phases[i].end - phases[i].start);
+	}
+	fprintf(f, "\n\t],\n\t\"partitions\": [");
+
+	for (cur_part = parts; cur_part < parts + part_count; cur_part++) {
+		double secs = cur_part->copy_end - cur_part->copy_start;
+		fprintf(f, "%s\n\t\t{\n", cur_part == parts ? "" : ",");
+		fprintf(f, "\t\t\t\"number\": %d,\n", cur_part->id);
+		fprintf(f, "\t\t\t\"name\": ");
+		json_string(f, cur_part->name);
+		fprintf(f, ",\n\t\t\t\"copied\": %lld,\n",
+			(long long)cur_part->copied);
+		fprintf(f, "\t\t\t\"holes\": %lld,\n",
+			(long long)cur_part->holes);
+		fprintf(f, "\t\t\t\"start\": %.6f,\n", cur_part->copy_start);
+		fprintf(f, "\t\t\t\"seconds\": %.6f,\n", secs);
+		fprintf(f, "\t\t\t\"mib_per_second\": %.1f\n",
+			secs > 0 ? cur_part->copied / 1048576.0 / secs : 0.0);
+		fprintf(f, "\t\t}");
+	}
+	fprintf(f, "\n\t]\n}\n");
+
+	return close_report(f, stats_path);
+}
 
-		cur_part = cur_part->next;
+/*
+ * The same as a Chrome trace (chrome://tracing, Perfetto): the phases on one
+ * track, each partition's copy on a track of its own.
+ */
+static int
+write_trace(void)
+{
+	FILE *f = open_report(trace_path);
+	if (f == NULL) {
+		return -1;
 	}
 
-	/* Write secondary GPT partition headers and header */
-	fseek(output, secondary_headers_sect * sect_size, SEEK_SET);
-	if (fwrite(parts, 1, header_sectors * sect_size, output) !=
-		header_sectors * sect_size) {
-		panic("fwrite failed");
+	fprintf(f, "{\"traceEvents\": [");
+	for (int i = 0; i < phase_count; i++) {
+		fprintf(f,
+			"%s\n{\"name\": \"%s\", \"cat\": \"phase\", "
+			"\"ph\": \"X\", \"ts\": %.3f, \"dur\": %.3f, "
+			"\"pid\": %d, \"tid\": 0}",
+			i == 0 ? "" : ",", phases[i].name, phases[i].start * 1e6,
+			(phases[i].end - phases[i].start) * 1e6, (int)getpid());
 	}
-	fseek(output, secondary_gpt_sect * sect_size, SEEK_SET);
-	if (fwrite(gpt2, 1, sect_size, output) != sect_size) {
-		panic("fwrite failed");
+	struct partition *cur_part;
+	for (cur_part = parts; cur_part < parts + part_count; cur_part++) {
+		if (!cur_part->copy_started) {
+			continue;
+		}
+		fprintf(f, ",\n{\"name\": ");
+		json_string(f, cur_part->name);
+		fprintf(f,
+			", \"cat\": \"copy\", \"ph\": \"X\", \"ts\": %.3f, "
+			"\"dur\": %.3f, \"pid\": %d, \"tid\": %d, "
+			"\"args\": {\"copied\": %lld, \"holes\": %lld}}",
+			cur_part->copy_start * 1e6,
+			(cur_part->copy_end - cur_part->copy_start) * 1e6,
+			(int)getpid(), cur_part->id, (long long)cur_part->copied,
+			(long long)cur_part->holes);
 	}
+	fprintf(f, "\n], \"displayTimeUnit\": \"ms\"}\n");
 
-	free(parts);
+	return close_report(f, trace_path);
 }
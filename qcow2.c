@@ -0,0 +1,295 @@
+/* SPDX-License-Identifier: MIT */
+
+/*
+ * Writing qcow2 (version 3) images front to back. Guest data comes in order
+ * and goes out one cluster at a time, right after the header; clusters that
+ * are all zeros are simply not allocated. Once all the data is out, we know
+ * everything we need to append the L2 tables, the L1 table, and the refcount
+ * structures, and finally to write the header. See docs/interop/qcow2.txt in
+ * the QEMU sources for the format.
+ */
+
+#include "qcow2.h"
+#include "copy.h"
+#include "unaligned.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define QCOW2_MAGIC (0x514649fbU) /* "QFI\xfb" */
+#define QCOW2_VERSION (3U)
+#define QCOW2_HEADER_LENGTH (104U)
+#define QCOW2_REFCOUNT_ORDER (4U) /* 16 bit refcounts */
+#define QCOW2_OFLAG_COPIED (1ULL << 63) /* refcount is exactly 1 */
+
+struct qcow2 {
+	int fd;
+	uint64_t size; /* guest size in bytes */
+	size_t cluster; /* cluster size in bytes */
+	uint64_t clusters; /* guest clusters */
+	uint64_t *map; /* host offset of each guest cluster, 0 if none */
+	uint64_t next; /* next free host offset */
+	uint64_t pos; /* guest offset we're at, can only go up */
+	uint64_t cur; /* guest cluster in buf */
+	int dirty; /* buf holds data for cur */
+	uint8_t *buf;
+};
+
+static inline uint64_t
+div_up(uint64_t a, uint64_t b)
+{
+	return (a + b - 1) / b;
+}
+
+static int
+write_all(int fd, const uint8_t *buf, size_t len, off_t off)
+{
+	while (len > 0) {
+		ssize_t n = pwrite(fd, buf, len, off);
+		if (n < 0 && errno == EINTR) {
+			continue;
+		}
+		if (n <= 0) {
+			return -1;
+		}
+		buf += n;
+		len -= n;
+		off += n;
+	}
+	return 0;
+}
+
+/* Append buf as the next host cluster and tell where it went. */
+static int
+append(struct qcow2 *q, const uint8_t *buf, uint64_t *off)
+{
+	if (write_all(q->fd, buf, q->cluster, q->next) != 0) {
+		return -1;
+	}
+	if (off != NULL) {
+		*off = q->next;
+	}
+	q->next += q->cluster;
+	return 0;
+}
+
+/* Append a table of n big-endian 64 bit entries, in as many clusters. */
+static int
+append_table(struct qcow2 *q, const uint64_t *entries, uint64_t n,
+	uint64_t *off)
+{
+	uint64_t per_cluster = q->cluster / 8;
+
+	*off = q->next;
+	for (uint64_t i = 0; i < n || i == 0; i += per_cluster) {
+		memset(q->buf, 0, q->cluster);
+		for (uint64_t j = 0; j < per_cluster && i + j < n; j++) {
+			set_be64(q->buf + j * 8, entries[i + j]);
+		}
+		if (append(q, q->buf, NULL) != 0) {
+			return -1;
+		}
+	}
+	return 0;
+}
+
+static int
+flush(struct qcow2 *q)
+{
+	if (!q->dirty) {
+		return 0;
+	}
+	q->dirty = 0;
+
+	if (is_zero(q->buf, q->cluster)) {
+		return 0;
+	}
+	return append(q, q->buf, &q->map[q->cur]);
+}
+
+struct qcow2 *
+qcow2_create(int fd, uint64_t size)
+{
+	struct qcow2 *q = calloc(1, sizeof(*q));
+	if (q == NULL) {
+		return NULL;
+	}
+
+	q->fd = fd;
+	q->size = size;
+	q->cluster = 1U << QCOW2_CLUSTER_BITS;
+	q->clusters = div_up(size, q->cluster);
+	q->map = calloc(q->clusters > 0 ? q->clusters : 1, sizeof(*q->map));
+	q->buf = malloc(q->cluster);
+	if (q->map == NULL || q->buf == NULL) {
+		free(q->map);
+		free(q->buf);
+		free(q);
+		return NULL;
+	}
+	q->next = q->cluster; /* the header goes first */
+
+	return q;
+}
+
+/*
+ * Write len bytes at guest offset off. Offsets must never go back, anything
+ * skipped over reads as zeros.
+ */
+int
+qcow2_write(void *ctx, const void *buf, size_t len, off_t off)
+{
+	struct qcow2 *q = ctx;
+	const uint8_t *p = buf;
+
+	if ((uint64_t)off < q->pos || (uint64_t)off + len > q->size) {
+		errno = EINVAL;
+		return -1;
+	}
+	q->pos = off + len;
+
+	while (len > 0) {
+		uint64_t c = off / q->cluster;
+		size_t in = off % q->cluster;
+
+		if (!q->dirty || c != q->cur) {
+			if (flush(q) != 0) {
+				return -1;
+			}
+			q->cur = c;
+			q->dirty = 1;
+			memset(q->buf, 0, q->cluster);
+		}
+
+		size_t n = q->cluster - in;
+		if (n > len) {
+			n = len;
+		}
+		memcpy(q->buf + in, p, n);
+		p += n;
+		len -= n;
+		off += n;
+	}
+
+	return 0;
+}
+
+/* L2 tables (only where something is allocated) and the L1 table. */
+static int
+write_tables(struct qcow2 *q, uint64_t *l1_size, uint64_t *l1_offset)
+{
+	uint64_t per_l2 = q->cluster / 8;
+
+	*l1_size = div_up(q->clusters, per_l2);
+	uint64_t *l1 = calloc(*l1_size > 0 ? *l1_size : 1, sizeof(*l1));
+	if (l1 == NULL) {
+		return -1;
+	}
+
+	for (uint64_t i = 0; i < *l1_size; i++) {
+		uint64_t n = q->clusters - i * per_l2;
+		if (n > per_l2) {
+			n = per_l2;
+		}
+		uint64_t *l2 = q->map + i * per_l2;
+		if (is_zero(l2, n * sizeof(*l2))) {
+			continue;
+		}
+
+		for (uint64_t j = 0; j < n; j++) {
+			if (l2[j] != 0) {
+				l2[j] |= QCOW2_OFLAG_COPIED;
+			}
+		}
+		if (append_table(q, l2, n, &l1[i]) != 0) {
+			free(l1);
+			return -1;
+		}
+		l1[i] |= QCOW2_OFLAG_COPIED;
+	}
+
+	int ret = append_table(q, l1, *l1_size, l1_offset);
+	free(l1);
+	return ret;
+}
+
+/*
+ * Refcounts: every cluster is used exactly once, including the ones holding
+ * the refcounts themselves, so iterate until that adds up.
+ */
+static int
+write_refcounts(
+	struct qcow2 *q, uint64_t *table_offset, uint64_t *table_clusters)
+{
+	uint64_t per_block = q->cluster * 8 / (1U << QCOW2_REFCOUNT_ORDER);
+	uint64_t used = q->next / q->cluster;
+	uint64_t blocks = 0, total;
+
+	*table_clusters = 0;
+	for (;;) {
+		total = used + blocks + *table_clusters;
+		uint64_t b = div_up(total, per_block);
+		uint64_t t = div_up(b * 8, q->cluster);
+		if (b == blocks && t == *table_clusters) {
+			break;
+		}
+		blocks = b;
+		*table_clusters = t;
+	}
+
+	uint64_t *table = calloc(blocks, sizeof(*table));
+	if (table == NULL) {
+		return -1;
+	}
+	for (uint64_t b = 0; b < blocks; b++) {
+		memset(q->buf, 0, q->cluster);
+		for (uint64_t j = 0; j < per_block && b * per_block + j < total;
+			j++) {
+			set_be16(q->buf + j * 2, 1);
+		}
+		if (append(q, q->buf, &table[b]) != 0) {
+			free(table);
+			return -1;
+		}
+	}
+
+	int ret = append_table(q, table, blocks, table_offset);
+	free(table);
+	return ret;
+}
+
+/*
+ * Write out the last cluster and all the metadata, then free q. The layout
+ * is: header, data clusters, L2 tables, L1 table, refcount blocks, refcount
+ * table. The header goes last, once everything it points to exists.
+ */
+int
+qcow2_finish(struct qcow2 *q)
+{
+	uint64_t l1_size, l1_offset, table_offset, table_clusters;
+	int ret = -1;
+
+	if (flush(q) == 0 && write_tables(q, &l1_size, &l1_offset) == 0 &&
+		write_refcounts(q, &table_offset, &table_clusters) == 0) {
+		memset(q->buf, 0, q->cluster);
+		set_be32(q->buf + 0, QCOW2_MAGIC);
+		set_be32(q->buf + 4, QCOW2_VERSION);
+		set_be32(q->buf + 20, QCOW2_CLUSTER_BITS);
+		set_be64(q->buf + 24, q->size);
+		set_be32(q->buf + 36, l1_size);
+		set_be64(q->buf + 40, l1_offset);
+		set_be64(q->buf + 48, table_offset);
+		set_be32(q->buf + 56, table_clusters);
+		set_be32(q->buf + 96, QCOW2_REFCOUNT_ORDER);
+		set_be32(q->buf + 100, QCOW2_HEADER_LENGTH);
+		/* no header extensions, the end marker is all zeros */
+		ret = write_all(q->fd, q->buf, q->cluster, 0);
+	}
+
+	free(q->map);
+	free(q->buf);
+	free(q);
+	return ret;
+}
@@ -0,0 +1,24 @@
+#pragma once
+
+/* SPDX-License-Identifier: MIT */
+
+#ifndef QCOW2_H
+#define QCOW2_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+/* 64 KiB clusters, same as qemu-img's default. */
+#define QCOW2_CLUSTER_BITS (16U)
+
+struct qcow2;
+
+struct qcow2 *
+qcow2_create(int fd, uint64_t size);
+int
+qcow2_write(void *ctx, const void *buf, size_t len, off_t off);
+int
+qcow2_finish(struct qcow2 *q);
+
+#endif
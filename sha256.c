@@ -0,0 +1,145 @@
+/* SPDX-License-Identifier: MIT */
+
+/*
+ * SHA-256 as specified in FIPS 180-4, nothing fancy.
+ */
+
+#include "sha256.h"
+#include "unaligned.h"
+
+#include <string.h>
+
+static const uint32_t K[64] = {0x428a2f98, 0x71374491, 0xb5c0fbcf,
+	0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5, 0xd807aa98,
+	0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7,
+	0xc19bf174, 0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f,
+	0x4a7484aa, 0x5cb0a9dc, 0x76f988da, 0x983e5152, 0xa831c66d, 0xb00327c8,
+	0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967, 0x27b70a85,
+	0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e,
+	0x92722c85, 0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819,
+	0xd6990624, 0xf40e3585, 0x106aa070, 0x19a4c116, 0x1e376c08, 0x2748774c,
+	0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3, 0x748f82ee,
+	0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7,
+	0xc67178f2};
+
+static inline uint32_t
+ror(uint32_t x, int n)
+{
+	return x >> n | x << (32 - n);
+}
+
+static void
+compress(uint32_t state[8], const uint8_t *block)
+{
+	uint32_t w[64];
+
+	for (int i = 0; i < 16; i++) {
+		w[i] = get_be32(block + 4 * i);
+	}
+	for (int i = 16; i < 64; i++) {
+		uint32_t s0 = ror(w[i - 15], 7) ^ ror(w[i - 15], 18) ^
+			      w[i - 15] >> 3;
+		uint32_t s1 = ror(w[i - 2], 17) ^ ror(w[i - 2], 19) ^
+			      w[i - 2] >> 10;
+		w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+	}
+
+	uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+	uint32_t e = state[4], f = state[5], g = state[6], h = state[7];
+
+	for (int i = 0; i < 64; i++) {
+		uint32_t s1 = ror(e, 6) ^ ror(e, 11) ^ ror(e, 25);
+		uint32_t ch = (e & f) ^ (~e & g);
+		uint32_t t1 = h + s1 + ch + K[i] + w[i];
+		uint32_t s0 = ror(a, 2) ^ ror(a, 13) ^ ror(a, 22);
+		uint32_t maj = (a & b) ^ (a & c) ^ (b & c);
+		uint32_t t2 = s0 + maj;
+
+		h = g;
+		g = f;
+		f = e;
+		e = d + t1;
+		d = c;
+		c = b;
+		b = a;
+		a = t1 + t2;
+	}
+
+	state[0] += a;
+	state[1] += b;
+	state[2] += c;
+	state[3] += d;
+	state[4] += e;
+	state[5] += f;
+	state[6] += g;
+	state[7] += h;
+}
+
+void
+sha256_init(struct sha256 *ctx)
+{
+	static const uint32_t H[8] = {0x6a09e667, 0xbb67ae85, 0x3c6ef372,
+		0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19};
+
+	memcpy(ctx->state, H, sizeof(H));
+	ctx->length = 0;
+	ctx->used = 0;
+}
+
+void
+sha256_update(struct sha256 *ctx, const void *buf, size_t len)
+{
+	const uint8_t *p = buf;
+
+	ctx->length += len;
+
+	if (ctx->used > 0) {
+		size_t n = sizeof(ctx->block) - ctx->used;
+		if (n > len) {
+			n = len;
+		}
+		memcpy(ctx->block + ctx->used, p, n);
+		ctx->used += n;
+		p += n;
+		len -= n;
+		if (ctx->used < sizeof(ctx->block)) {
+			return;
+		}
+		compress(ctx->state, ctx->block);
+		ctx->used = 0;
+	}
+
+	while (len >= sizeof(ctx->block)) {
+		compress(ctx->state, p);
+		p += sizeof(ctx->block);
+		len -= sizeof(ctx->block);
+	}
+
+	memcpy(ctx->block, p, len);
+	ctx->used = len;
+}
+
+void
+sha256_final(struct sha256 *ctx, uint8_t digest[SHA256_DIGEST_LENGTH])
+{
+	uint64_t bits = ctx->length * 8;
+
+	ctx->block[ctx->used++] = 0x80;
+	if (ctx->used > 56) {
+		memset(ctx->block + ctx->used, 0, sizeof(ctx->block) - ctx->used);
+		compress(ctx->state, ctx->block);
+		ctx->used = 0;
+	}
+	memset(ctx->block + ctx->used, 0, 56 - ctx->used);
+	for (int i = 0; i < 8; i++) {
+		ctx->block[56 + i] = bits >> (56 - 8 * i);
+	}
+	compress(ctx->state, ctx->block);
+
+	for (int i = 0; i < 8; i++) {
+		digest[4 * i + 0] = ctx->state[i] >> 24;
+		digest[4 * i + 1] = ctx->state[i] >> 16;
+		digest[4 * i + 2] = ctx->state[i] >> 8;
+		digest[4 * i + 3] = ctx->state[i];
+	}
+}
@@ -0,0 +1,27 @@
+#pragma once
+
+/* SPDX-License-Identifier: MIT */
+
+#ifndef SHA256_H
+#define SHA256_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define SHA256_DIGEST_LENGTH 32
+
+struct sha256 {
+	uint32_t state[8];
+	uint64_t length; /* in bytes */
+	uint8_t block[64];
+	size_t used; /* bytes in block */
+};
+
+void
+sha256_init(struct sha256 *ctx);
+void
+sha256_update(struct sha256 *ctx, const void *buf, size_t len);
+void
+sha256_final(struct sha256 *ctx, uint8_t digest[SHA256_DIGEST_LENGTH]);
+
+#endif
@@ -0,0 +1,323 @@
+/* SPDX-License-Identifier: MIT */
+
+/*
+ * Writing Android sparse images (the ones fastboot flashes) front to back.
+ * Guest data comes in order and is cut into blocks: runs of blocks that are
+ * one 32 bit pattern repeated become FILL chunks, everything else is packed
+ * into RAW chunks, and anything we never got any data for is DONT_CARE. A
+ * CRC32 chunk over the whole image comes last. See libsparse/sparse_format.h
+ * in the Android sources for the format.
+ */
+
+#include "simg.h"
+#include "crc32.h"
+#include "unaligned.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define SIMG_MAGIC (0xed26ff3aU)
+#define SIMG_FILE_HEADER_SIZE (28U)
+#define SIMG_CHUNK_HEADER_SIZE (12U)
+#define SIMG_CHUNK_RAW (0xcac1U)
+#define SIMG_CHUNK_FILL (0xcac2U)
+#define SIMG_CHUNK_DONT_CARE (0xcac3U)
+#define SIMG_CHUNK_CRC32 (0xcac4U)
+
+/* RAW data is collected in memory before it's written out. */
+#define SIMG_RAW_BUFFER (1024U * 1024U)
+
+struct simg {
+	int fd;
+	size_t block; /* block size in bytes */
+	uint64_t blocks; /* blocks in the image */
+	uint64_t pos; /* guest offset we're at, can only go up */
+	uint64_t cur; /* block in buf */
+	int dirty; /* buf holds data for cur */
+	uint8_t *buf;
+	uint64_t done; /* blocks before this are in some chunk */
+	off_t next; /* next free offset in the file */
+	uint32_t chunks;
+	uint32_t crc;
+
+	/* the chunk we're still adding blocks to */
+	unsigned type; /* 0 if there isn't one */
+	uint32_t length; /* in blocks */
+	uint32_t fill; /* FILL pattern */
+	off_t header; /* where a RAW chunk's header goes */
+	uint8_t *raw;
+	size_t raw_used;
+};
+
+static int
+write_all(int fd, const uint8_t *buf, size_t len, off_t off)
+{
+	while (len > 0) {
+		ssize_t n = pwrite(fd, buf, len, off);
+		if (n < 0 && errno == EINTR) {
+			continue;
+		}
+		if (n <= 0) {
+			return -1;
+		}
+		buf += n;
+		len -= n;
+		off += n;
+	}
+	return 0;
+}
+
+/* Append a chunk header and data to the file. */
+static int
+append_chunk(struct simg *s, unsigned type, uint32_t length,
+	const uint8_t *data, size_t size)
+{
+	uint8_t header[SIMG_CHUNK_HEADER_SIZE] = {0};
+
+	set_u16(header + 0, type);
+	set_u32(header + 4, length);
+	set_u32(header + 8, SIMG_CHUNK_HEADER_SIZE + size);
+	if (write_all(s->fd, header, sizeof(header), s->next) != 0 ||
+		write_all(s->fd, data, size, s->next + sizeof(header)) != 0) {
+		return -1;
+	}
+	s->next += sizeof(header) + size;
+	s->chunks++;
+	return 0;
+}
+
+static int
+flush_raw(struct simg *s)
+{
+	if (write_all(s->fd, s->raw, s->raw_used, s->next) != 0) {
+		return -1;
+	}
+	s->next += s->raw_used;
+	s->raw_used = 0;
+	return 0;
+}
+
+/* Write out the chunk we've been adding to, if any. */
+static int
+close_chunk(struct simg *s)
+{
+	uint8_t data[4];
+	unsigned type = s->type;
+
+	s->type = 0;
+	if (type == SIMG_CHUNK_FILL) {
+		set_u32(data, s->fill);
+		return append_chunk(s, SIMG_CHUNK_FILL, s->length, data, 4);
+	}
+	if (type != SIMG_CHUNK_RAW) {
+		return 0;
+	}
+
+	uint8_t header[SIMG_CHUNK_HEADER_SIZE] = {0};
+	set_u16(header + 0, SIMG_CHUNK_RAW);
+	set_u32(header + 4, s->length);
+	set_u32(header + 8,
+		SIMG_CHUNK_HEADER_SIZE + (size_t)s->length * s->block);
+	if (flush_raw(s) != 0 ||
+		write_all(s->fd, header, sizeof(header), s->header) != 0) {
+		return -1;
+	}
+	s->chunks++;
+	return 0;
+}
+
+/* Skip over blocks we have no data for. */
+static int
+dont_care(struct simg *s, uint64_t blocks)
+{
+	if (close_chunk(s) != 0) {
+		return -1;
+	}
+	while (blocks > 0) {
+		uint32_t n = blocks > UINT32_MAX ? UINT32_MAX : blocks;
+		if (append_chunk(s, SIMG_CHUNK_DONT_CARE, n, NULL, 0) != 0) {
+			return -1;
+		}
+		s->crc = crc32_update_zeros(s->crc, (uint64_t)n * s->block);
+		s->done += n;
+		blocks -= n;
+	}
+	return 0;
+}
+
+/* Add the block in buf to the chunk it belongs in. */
+static int
+add_block(struct simg *s)
+{
+	const uint8_t *p = s->buf;
+	/* total_sz is 32 bits, keep RAW chunks well below that */
+	uint32_t max_raw = (UINT32_MAX / 2) / s->block;
+
+	if (s->cur > s->done && dont_care(s, s->cur - s->done) != 0) {
+		return -1;
+	}
+	s->crc = crc32_update(s->crc, p, s->block);
+	s->done++;
+
+	if (!memcmp(p, p + 4, s->block - 4)) {
+		uint32_t fill = get_u32(p);
+		if (s->type == SIMG_CHUNK_FILL && s->fill == fill &&
+			s->length < UINT32_MAX) {
+			s->length++;
+			return 0;
+		}
+		if (close_chunk(s) != 0) {
+			return -1;
+		}
+		s->type = SIMG_CHUNK_FILL;
+		s->fill = fill;
+		s->length = 1;
+		return 0;
+	}
+
+	if (s->type != SIMG_CHUNK_RAW || s->length == max_raw) {
+		if (close_chunk(s) != 0) {
+			return -1;
+		}
+		s->type = SIMG_CHUNK_RAW;
+		s->length = 0;
+		s->header = s->next;
+		s->next += SIMG_CHUNK_HEADER_SIZE;
+	}
+	if (s->raw_used + s->block > SIMG_RAW_BUFFER && flush_raw(s) != 0) {
+		return -1;
+	}
+	memcpy(s->raw + s->raw_used, p, s->block);
+	s->raw_used += s->block;
+	s->length++;
+	return 0;
+}
+
+/*
+ * block has to be a multiple of 4 (for FILL chunks) and size a multiple of
+ * block; the header only has 32 bits for the number of blocks, so anything
+ * larger than that fails with EFBIG.
+ */
+struct simg *
+simg_create(int fd, uint64_t size, size_t block)
+{
+	if (block < 4 || block % 4 != 0 || block > SIMG_RAW_BUFFER ||
+		size % block != 0) {
+		errno = EINVAL;
+		return NULL;
+	}
+	if (size / block > UINT32_MAX) {
+		errno = EFBIG;
+		return NULL;
+	}
+
+	struct simg *s = calloc(1, sizeof(*s));
+	if (s == NULL) {
+		return NULL;
+	}
+
+	s->fd = fd;
+	s->block = block;
+	s->blocks = size / block;
+	s->buf = malloc(block);
+	s->raw = malloc(SIMG_RAW_BUFFER);
+	if (s->buf == NULL || s->raw == NULL) {
+		free(s->buf);
+		free(s->raw);
+		free(s);
+		return NULL;
+	}
+	s->next = SIMG_FILE_HEADER_SIZE;
+	s->crc = crc32_init();
+
+	return s;
+}
+
+/*
+ * Write len bytes at guest offset off. Offsets must never go back, anything
+ * skipped over is left as DONT_CARE (if it covers whole blocks) or zeros.
+ */
+int
+simg_write(void *ctx, const void *buf, size_t len, off_t off)
+{
+	struct simg *s = ctx;
+	const uint8_t *p = buf;
+
+	if ((uint64_t)off < s->pos ||
+		(uint64_t)off + len > s->blocks * s->block) {
+		errno = EINVAL;
+		return -1;
+	}
+	s->pos = off + len;
+
+	while (len > 0) {
+		uint64_t b = off / s->block;
+		size_t in = off % s->block;
+
+		if (!s->dirty || b != s->cur) {
+			if (s->dirty && add_block(s) != 0) {
+				return -1;
+			}
+			s->cur = b;
+			s->dirty = 1;
+			memset(s->buf, 0, s->block);
+		}
+
+		size_t n = s->block - in;
+		if (n > len) {
+			n = len;
+		}
+		memcpy(s->buf + in, p, n);
+		p += n;
+		len -= n;
+		off += n;
+	}
+
+	return 0;
+}
+
+/*
+ * Write out the last block, the CRC32 chunk, and the file header (now that we
+ * know how many chunks there are).
+ */
+static int
+write_tail(struct simg *s)
+{
+	uint8_t header[SIMG_FILE_HEADER_SIZE] = {0};
+	uint8_t crc[4];
+
+	if ((s->dirty && add_block(s) != 0) ||
+		dont_care(s, s->blocks - s->done) != 0 || close_chunk(s) != 0) {
+		return -1;
+	}
+
+	set_u32(crc, crc32_final(s->crc));
+	if (append_chunk(s, SIMG_CHUNK_CRC32, 0, crc, sizeof(crc)) != 0) {
+		return -1;
+	}
+
+	set_u32(header + 0, SIMG_MAGIC);
+	set_u16(header + 4, 1); /* major_version */
+	set_u16(header + 6, 0); /* minor_version */
+	set_u16(header + 8, SIMG_FILE_HEADER_SIZE);
+	set_u16(header + 10, SIMG_CHUNK_HEADER_SIZE);
+	set_u32(header + 12, s->block);
+	set_u32(header + 16, s->blocks);
+	set_u32(header + 20, s->chunks);
+	set_u32(header + 24, 0); /* image_checksum, unused */
+	return write_all(s->fd, header, sizeof(header), 0);
+}
+
+/* Finish the image and free s. */
+int
+simg_finish(struct simg *s)
+{
+	int ret = write_tail(s);
+
+	free(s->buf);
+	free(s->raw);
+	free(s);
+	return ret;
+}
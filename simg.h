@@ -0,0 +1,24 @@
+#pragma once
+
+/* SPDX-License-Identifier: MIT */
+
+#ifndef SIMG_H
+#define SIMG_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+/* Preferred block size; images that aren't a multiple of it use sectors. */
+#define SIMG_BLOCK_SIZE (4096U)
+
+struct simg;
+
+struct simg *
+simg_create(int fd, uint64_t size, size_t block);
+int
+simg_write(void *ctx, const void *buf, size_t len, off_t off);
+int
+simg_finish(struct simg *s);
+
+#endif
@@ -9,6 +9,8 @@ if [ ! -x ./mkgpt ]; then
 	exit 1
 fi
 
+# leftovers of a failed run would only get in the way
+rm -rf ${tmpdir}
 mkdir -p ${tmpdir}
 for name in a.img b.img c.img d.img e.img; do
 	if which truncate 2>/dev/null; then
@@ -34,10 +36,571 @@ if [ "$(uname)" = "Linux" ]; then
 fi
 dd if=${tmpdir}/bla.img bs=512 count=1 | xxd -seek 446
 
+if ! ./mkgpt --verify ${tmpdir}/bla.img -j 2 \
+	--part ${tmpdir}/a.img --part ${tmpdir}/b.img --part ${tmpdir}/c.img \
+	--part ${tmpdir}/d.img --part ${tmpdir}/e.img; then
+	echo "image didn't verify, regression!"
+	exit 1
+fi
+
 checksum=$(md5sum ${tmpdir}/bla.img | cut -c1-32)
-if [ ! "${checksum}" = "a4abc130196a29288ab9af1c4489fe24" ]; then
+if [ ! "${checksum}" = "1e4df03d8d6ec8a4d8f5692c70231eb0" ]; then
 	echo "checksum didn't match, regression!"
 	exit 1
 fi
 
+# Partition images with actual data in them: random data with a hole in the
+# middle, an odd size, and zeros that aren't a hole. Everything below has to
+# make the same image as a plain build of them does.
+dd if=/dev/urandom of=${tmpdir}/r1.img bs=1M count=1 2>/dev/null
+dd if=/dev/urandom of=${tmpdir}/r1.img bs=1M count=1 seek=4 conv=notrunc \
+	2>/dev/null
+head -c 2621540 /dev/urandom >${tmpdir}/r2.img
+dd if=/dev/zero of=${tmpdir}/r3.img bs=1M count=2 2>/dev/null
+
+# build <output> [options]: the three of them with fixed GUIDs
+build() {
+	out="$1"
+	shift
+	./mkgpt -o "${out}" --disk-guid 1ABC2ABC-1111-2222-3333-1ABC2ABC3ABC "$@" \
+		--part ${tmpdir}/r1.img --type linux --uuid 11111111-1111-1111-1111-111111111111 \
+		--part ${tmpdir}/r2.img --type linux --uuid 22222222-2222-2222-2222-222222222222 \
+		--part ${tmpdir}/r3.img --type fat32 --uuid 33333333-3333-3333-3333-333333333333
+}
+
+# same <file> <what>: is it the plain build?
+same() {
+	if [ ! "$(md5sum <"$1" | cut -c1-32)" = "${plain}" ]; then
+		echo "$2 didn't match a plain build, regression!"
+		exit 1
+	fi
+}
+
+build ${tmpdir}/plain.img || exit 1
+plain=$(md5sum <${tmpdir}/plain.img | cut -c1-32)
+
+# holes and zero sectors are left out of the output, which has to read back
+# the same; and it actually has to have holes
+build ${tmpdir}/sparse.img --sparse || exit 1
+same ${tmpdir}/sparse.img "--sparse"
+if [ "$(du -k ${tmpdir}/sparse.img | cut -f1)" -ge \
+	"$(du -k ${tmpdir}/plain.img | cut -f1)" ]; then
+	echo "--sparse didn't leave any holes, regression!"
+	exit 1
+fi
+
+# every way of copying on its own
+for io in auto reflink copy-range sendfile buffered; do
+	build ${tmpdir}/io.img --io ${io} || exit 1
+	same ${tmpdir}/io.img "--io ${io}"
+done
+
+# -j splits the copies into chunks, which mustn't change a thing
+for io in auto buffered; do
+	build ${tmpdir}/jobs.img --io ${io} -j 4 || exit 1
+	same ${tmpdir}/jobs.img "--io ${io} -j 4"
+done
+build ${tmpdir}/jobs.img --sparse -j 3 || exit 1
+same ${tmpdir}/jobs.img "--sparse -j 3"
+
+# building the image in a memory mapped output
+build ${tmpdir}/mmap.img --io mmap || exit 1
+same ${tmpdir}/mmap.img "--io mmap"
+build ${tmpdir}/mmap.img --io mmap --sparse -j 4 || exit 1
+same ${tmpdir}/mmap.img "--io mmap --sparse -j 4"
+
+# O_DIRECT for the output, and the partition images as well
+build ${tmpdir}/direct.img --direct || exit 1
+same ${tmpdir}/direct.img "--direct"
+build ${tmpdir}/direct.img --direct --direct-input -j 2 || exit 1
+same ${tmpdir}/direct.img "--direct --direct-input -j 2"
+build ${tmpdir}/direct.img --direct --sparse || exit 1
+same ${tmpdir}/direct.img "--direct --sparse"
+
+# our CRC32 (whichever implementation the CPU gets) against the one in gzip's
+# trailer, over the whole image
+build ${tmpdir}/crc.img --manifest ${tmpdir}/crc.json || exit 1
+crc=$(gzip -1 -c ${tmpdir}/crc.img | tail -c8 | od -An -tx4 -N4 | tr -d ' ')
+if ! grep -q "\"crc32\": \"${crc}\"" ${tmpdir}/crc.json; then
+	echo "CRC32 of the image didn't match gzip's, regression!"
+	exit 1
+fi
+
+# the manifest digests the image as it's written, that mustn't change it, and
+# its SHA-256 has to be the image's
+build ${tmpdir}/manifest.img --manifest ${tmpdir}/manifest.json || exit 1
+same ${tmpdir}/manifest.img "--manifest"
+sha=$(sha256sum <${tmpdir}/manifest.img | cut -c1-64)
+if ! grep -q "\"sha256\": \"${sha}\"" ${tmpdir}/manifest.json; then
+	echo "SHA-256 in the manifest didn't match the image, regression!"
+	exit 1
+fi
+build ${tmpdir}/manifest.img --manifest ${tmpdir}/manifest.json --sparse || exit 1
+same ${tmpdir}/manifest.img "--manifest --sparse"
+if ! grep -q "\"sha256\": \"${sha}\"" ${tmpdir}/manifest.json; then
+	echo "SHA-256 in the manifest with --sparse didn't match, regression!"
+	exit 1
+fi
+
+# --edit changes the GPT in place and nothing else: changing a UUID and back
+# again leaves the plain build
+cp ${tmpdir}/plain.img ${tmpdir}/edit.img
+./mkgpt --edit ${tmpdir}/edit.img --entry 2 \
+	--uuid 44444444-4444-4444-4444-444444444444 --name edited || exit 1
+if cmp -s ${tmpdir}/edit.img ${tmpdir}/plain.img; then
+	echo "--edit didn't change anything, regression!"
+	exit 1
+fi
+./mkgpt --verify ${tmpdir}/edit.img -p ${tmpdir}/r1.img -p ${tmpdir}/r2.img \
+	-p ${tmpdir}/r3.img || exit 1
+./mkgpt --edit ${tmpdir}/edit.img --entry 2 \
+	--uuid 22222222-2222-2222-2222-222222222222 --name part2 || exit 1
+same ${tmpdir}/edit.img "--edit and back"
+
+# streaming the image to a pipe, and reading a partition image from stdin
+build - >${tmpdir}/stream.img || exit 1
+same ${tmpdir}/stream.img "-o -"
+build - --sparse | cat >${tmpdir}/stream.img || exit 1
+same ${tmpdir}/stream.img "-o - --sparse into a pipe"
+./mkgpt -o ${tmpdir}/stdin.img --disk-guid 1ABC2ABC-1111-2222-3333-1ABC2ABC3ABC \
+	--part - --type linux --uuid 11111111-1111-1111-1111-111111111111 \
+	--part ${tmpdir}/r2.img --type linux --uuid 22222222-2222-2222-2222-222222222222 \
+	--part ${tmpdir}/r3.img --type fat32 --uuid 33333333-3333-3333-3333-333333333333 \
+	<${tmpdir}/r1.img || exit 1
+same ${tmpdir}/stdin.img "a partition image on stdin"
+
+# partition images from pipes need a --size, here exactly what their files
+# would have taken
+cat ${tmpdir}/r2.img | ./mkgpt -o ${tmpdir}/pipe.img \
+	--disk-guid 1ABC2ABC-1111-2222-3333-1ABC2ABC3ABC \
+	--part ${tmpdir}/r1.img --type linux --uuid 11111111-1111-1111-1111-111111111111 \
+	--part - --type linux --uuid 22222222-2222-2222-2222-222222222222 --size 5121s \
+	--part ${tmpdir}/r3.img --type fat32 --uuid 33333333-3333-3333-3333-333333333333 ||
+	exit 1
+same ${tmpdir}/pipe.img "a partition image from a pipe"
+if cat ${tmpdir}/r2.img | ./mkgpt -o ${tmpdir}/pipe.img \
+	--part - --type linux 2>/dev/null; then
+	echo "a pipe without --size was taken, regression!"
+	exit 1
+fi
+
+# straight onto a block device full of junk, if we get to make a loop device:
+# everything without data has to be zeroed, and --verify has to find the image
+# on the larger device
+if [ "$(id -u)" = "0" ] && command -v losetup >/dev/null; then
+	dd if=/dev/urandom of=${tmpdir}/junk.img bs=1M count=16 2>/dev/null
+	dev=$(losetup -f --show ${tmpdir}/junk.img 2>/dev/null)
+	if [ -b "${dev}" ]; then
+		size=$(($(wc -c <${tmpdir}/plain.img) / 512))
+		build "${dev}" --image-size ${size} &&
+			head -c $((size * 512)) "${dev}" >${tmpdir}/device.img &&
+			./mkgpt --verify "${dev}" -p ${tmpdir}/r1.img \
+				-p ${tmpdir}/r2.img -p ${tmpdir}/r3.img
+		ok=$?
+		losetup -d "${dev}"
+		[ ${ok} = 0 ] || exit 1
+		same ${tmpdir}/device.img "a block device"
+	fi
+
+	# a device past 1 TiB, sparse, with junk right before the secondary
+	# GPT; --discard so the loop device punches holes instead of writing
+	# zeros
+	junk=$(((3000000000 - 33) * 512 / 1048576 - 1))
+	if truncate --size=1536000000000 ${tmpdir}/huge.img 2>/dev/null &&
+		dd if=/dev/urandom of=${tmpdir}/huge.img bs=1M seek=${junk} \
+			count=1 conv=notrunc 2>/dev/null; then
+		dev=$(losetup -f --show ${tmpdir}/huge.img 2>/dev/null)
+	else
+		dev=""
+	fi
+	if [ -b "${dev}" ]; then
+		./mkgpt -o "${dev}" --discard --part ${tmpdir}/r1.img --type linux &&
+			cmp -s -n 1048576 -i $((junk * 1048576)):0 "${dev}" /dev/zero
+		ok=$?
+		losetup -d "${dev}"
+		if [ ${ok} != 0 ]; then
+			echo "junk left before the secondary GPT, regression!"
+			exit 1
+		fi
+	fi
+	rm -f ${tmpdir}/huge.img
+fi
+
+# qcow2 images have to convert back to the raw image, with qemu-img or with
+# what follows if that's not around
+unqcow2() {
+	if command -v qemu-img >/dev/null; then
+		qemu-img convert -f qcow2 -O raw "$1" "$2"
+		return
+	fi
+	python3 - "$1" "$2" <<'EOF'
+import struct, sys
+f = open(sys.argv[1], "rb")
+hdr = f.read(104)
+magic, version = struct.unpack(">II", hdr[0:8])
+bits, size = struct.unpack(">IQ", hdr[20:32])
+l1_size, l1_off = struct.unpack(">IQ", hdr[36:48])
+assert magic == 0x514649FB and version in (2, 3)
+cluster = 1 << bits
+mask = 0x00FFFFFFFFFFFE00
+f.seek(l1_off)
+l1 = struct.unpack(">%dQ" % l1_size, f.read(8 * l1_size))
+out = open(sys.argv[2], "wb")
+per_l2 = cluster // 8
+for i, l1e in enumerate(l1):
+    if l1e & mask == 0:
+        continue
+    f.seek(l1e & mask)
+    for j, l2e in enumerate(struct.unpack(">%dQ" % per_l2, f.read(cluster))):
+        assert not l2e & (1 << 62)  # no compressed clusters
+        if l2e & mask == 0 or l2e & 1:
+            continue
+        f.seek(l2e & mask)
+        out.seek((i * per_l2 + j) * cluster)
+        out.write(f.read(cluster))
+out.truncate(size)
+EOF
+}
+build ${tmpdir}/qcow2.img --format qcow2 || exit 1
+unqcow2 ${tmpdir}/qcow2.img ${tmpdir}/unqcow2.img || exit 1
+same ${tmpdir}/unqcow2.img "--format qcow2"
+build ${tmpdir}/qcow2.img --format qcow2 --sparse || exit 1
+unqcow2 ${tmpdir}/qcow2.img ${tmpdir}/unqcow2.img || exit 1
+same ${tmpdir}/unqcow2.img "--format qcow2 --sparse"
+
+# the default alignment spelled out, and partitions placed with --start
+build ${tmpdir}/align.img --align 1M || exit 1
+same ${tmpdir}/align.img "--align 1M"
+./mkgpt -o ${tmpdir}/start.img --disk-guid 1ABC2ABC-1111-2222-3333-1ABC2ABC3ABC \
+	--part ${tmpdir}/r1.img --type linux --uuid 11111111-1111-1111-1111-111111111111 --start 2048 \
+	--part ${tmpdir}/r2.img --type linux --uuid 22222222-2222-2222-2222-222222222222 --start 12288 \
+	--part ${tmpdir}/r3.img --type fat32 --uuid 33333333-3333-3333-3333-333333333333 --start 18432 ||
+	exit 1
+same ${tmpdir}/start.img "--start"
+if ./mkgpt -o ${tmpdir}/start.img --align 1000 \
+	--part ${tmpdir}/r1.img --type linux 2>/dev/null; then
+	echo "--align took something that isn't a multiple of a sector, regression!"
+	exit 1
+fi
+
+# --stats, --trace and --progress only watch, and every byte of the partition
+# images is accounted for as copied or as a hole
+build ${tmpdir}/stats.img --stats ${tmpdir}/stats.json \
+	--trace ${tmpdir}/trace.json --progress -j 2 2>/dev/null || exit 1
+same ${tmpdir}/stats.img "--stats --trace --progress"
+total=$(($(wc -c <${tmpdir}/r1.img) + $(wc -c <${tmpdir}/r2.img) +
+	$(wc -c <${tmpdir}/r3.img)))
+if ! grep -q "\"copied\": ${total}," ${tmpdir}/stats.json ||
+	! grep -q '"traceEvents"' ${tmpdir}/trace.json; then
+	echo "--stats or --trace didn't add up, regression!"
+	exit 1
+fi
+
+# with --sparse, the hole in r1.img and all of r3.img (zeros) aren't written,
+# whichever way the data gets copied
+holes=$((3 * 1048576 + $(wc -c <${tmpdir}/r3.img)))
+for io in buffered mmap uring; do
+	build ${tmpdir}/stats.img --sparse --io ${io} \
+		--stats ${tmpdir}/stats.json || exit 1
+	if ! grep -q "^	\"copied\": $((total - holes))," ${tmpdir}/stats.json ||
+		! grep -q "^	\"holes\": ${holes}," ${tmpdir}/stats.json; then
+		echo "--stats for --sparse --io ${io} didn't add up, regression!"
+		exit 1
+	fi
+done
+
+# more entries than partitions, and --verify has to find its way around them
+build ${tmpdir}/entries.img --entries 256 || exit 1
+./mkgpt --verify ${tmpdir}/entries.img -p ${tmpdir}/r1.img \
+	-p ${tmpdir}/r2.img -p ${tmpdir}/r3.img || exit 1
+if cmp -s ${tmpdir}/entries.img ${tmpdir}/plain.img; then
+	echo "--entries 256 didn't change anything, regression!"
+	exit 1
+fi
+
+# a hundred partitions with far fewer descriptors than that
+head -c 4000 /dev/urandom >${tmpdir}/tiny.img
+args=""
+vargs=""
+for n in $(seq 100); do
+	cp ${tmpdir}/tiny.img ${tmpdir}/tiny${n}.img
+	args="${args} --part ${tmpdir}/tiny${n}.img --type linux"
+	vargs="${vargs} -p ${tmpdir}/tiny${n}.img"
+done
+# shellcheck disable=SC2086
+(ulimit -n 32 && ./mkgpt -o ${tmpdir}/many.img --align 4K -j 4 ${args}) ||
+	exit 1
+# shellcheck disable=SC2086
+./mkgpt --verify ${tmpdir}/many.img ${vargs} || exit 1
+
+# the same file twice, and a copy of it with --dedup, have to come out just
+# like two separate copies do
+cp ${tmpdir}/r1.img ${tmpdir}/r1-copy.img
+for how in same dedup separate; do
+	second=${tmpdir}/r1.img
+	opts=""
+	case ${how} in
+	dedup) second=${tmpdir}/r1-copy.img opts="--dedup" ;;
+	separate) second=${tmpdir}/r1-copy.img ;;
+	esac
+	# shellcheck disable=SC2086
+	./mkgpt -o ${tmpdir}/ab-${how}.img ${opts} \
+		--disk-guid 1ABC2ABC-1111-2222-3333-1ABC2ABC3ABC \
+		--part ${tmpdir}/r1.img --type linux --uuid 11111111-1111-1111-1111-111111111111 \
+		--part ${second} --type linux --uuid 22222222-2222-2222-2222-222222222222 ||
+		exit 1
+done
+if ! cmp -s ${tmpdir}/ab-same.img ${tmpdir}/ab-separate.img ||
+	! cmp -s ${tmpdir}/ab-dedup.img ${tmpdir}/ab-separate.img; then
+	echo "A/B partitions didn't match separate copies, regression!"
+	exit 1
+fi
+
+# the benchmark driver, if it's been built, on something tiny
+if [ -x ./bench-mkgpt ]; then
+	if ! ./bench-mkgpt --mkgpt ./mkgpt --dir ${tmpdir}/bench --parts 2 \
+		--part-size 1 --runs 1 --io buffered,mmap --sector-sizes 512 \
+		--jobs 1 --json >${tmpdir}/bench.json ||
+		! python3 -m json.tool ${tmpdir}/bench.json >/dev/null; then
+		echo "bench-mkgpt didn't produce its report, regression!"
+		exit 1
+	fi
+fi
+
+# the library on its own, if it's been built, has to lay a disk out just
+# like mkgpt does
+if [ -f ./libmkgpt.a ] && command -v cc >/dev/null; then
+	cat >${tmpdir}/lib.c <<'EOF'
+#define _XOPEN_SOURCE 700
+#include "libmkgpt.h"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+static int
+put(void *ctx, const void *buf, size_t len, off_t off)
+{
+	return pwrite(*(int *)ctx, buf, len, off) == (ssize_t)len ? 0 : -1;
+}
+
+int
+main(int argc, char *argv[])
+{
+	struct mkgpt_part part = {.name = "part1", .bytes = 2097152};
+	struct mkgpt_layout layout = {.sect_size = 512, .parts = &part,
+		.count = 1};
+
+	string_to_guid(&part.type, "0FC63DAF-8483-4772-8E79-3D69D8477DE4");
+	string_to_guid(&part.uuid, "11111111-1111-1111-1111-111111111111");
+	string_to_guid(&layout.disk_guid,
+		"1ABC2ABC-1111-2222-3333-1ABC2ABC3ABC");
+	int fd = argc == 2 ? open(argv[1], O_RDWR | O_CREAT | O_TRUNC, 0644) : -1;
+	if (fd == -1 || mkgpt_layout(&layout) != 0 ||
+		ftruncate(fd, layout.sectors * layout.sect_size) != 0 ||
+		mkgpt_write_primary(&layout, put, &fd) != 0 ||
+		mkgpt_write_secondary(&layout, put, &fd) != 0) {
+		fprintf(stderr, "%s\n", mkgpt_strerror(layout.error));
+		return 1;
+	}
+	return close(fd) != 0;
+}
+EOF
+	if ! cc -I. -o ${tmpdir}/lib ${tmpdir}/lib.c libmkgpt.a ||
+		! ${tmpdir}/lib ${tmpdir}/lib.img ||
+		! ./mkgpt -o ${tmpdir}/cli.img \
+			--disk-guid 1ABC2ABC-1111-2222-3333-1ABC2ABC3ABC \
+			--part ${tmpdir}/r3.img --type linux \
+			--uuid 11111111-1111-1111-1111-111111111111 ||
+		! cmp -s ${tmpdir}/lib.img ${tmpdir}/cli.img; then
+		echo "libmkgpt didn't match mkgpt, regression!"
+		exit 1
+	fi
+fi
+
+# a partition past 2^31 sectors (1 TiB), if the filesystem takes files that
+# large; it's all holes, but --verify has to find r1.img at its start
+if truncate --size=1536000000000 ${tmpdir}/huge.img 2>/dev/null; then
+	rm -f ${tmpdir}/huge.img
+	for size in rest 1400G 90%; do
+		if ! ./mkgpt -o ${tmpdir}/huge.img --image-size 3000000000 \
+			--part ${tmpdir}/r1.img --type linux --size ${size} ||
+			! ./mkgpt --verify ${tmpdir}/huge.img -p ${tmpdir}/r1.img; then
+			echo "--size ${size} past 1 TiB didn't verify, regression!"
+			exit 1
+		fi
+	done
+	rm -f ${tmpdir}/huge.img
+fi
+
+# io_uring, with few enough buffers that some have to be reused
+build ${tmpdir}/uring.img --io uring --queue-depth 2 || exit 1
+same ${tmpdir}/uring.img "--io uring"
+build ${tmpdir}/uring.img --io uring --sparse || exit 1
+same ${tmpdir}/uring.img "--io uring --sparse"
+
+# two images from a batch file, one after the other and in parallel; a pipe
+# can't be shared by parallel ones
+parts="--part ${tmpdir}/r1.img --type linux --uuid 11111111-1111-1111-1111-111111111111"
+parts="${parts} --part ${tmpdir}/r2.img --type linux --uuid 22222222-2222-2222-2222-222222222222"
+parts="${parts} --part ${tmpdir}/r3.img --type fat32 --uuid 33333333-3333-3333-3333-333333333333"
+for n in 1 2; do
+	echo "-o ${tmpdir}/batch${n}.img --disk-guid 1ABC2ABC-1111-2222-3333-1ABC2ABC3ABC ${parts} # image ${n}"
+done >${tmpdir}/batch.txt
+for jobs in 1 2; do
+	rm -f ${tmpdir}/batch1.img ${tmpdir}/batch2.img
+	./mkgpt --batch ${tmpdir}/batch.txt --batch-jobs ${jobs} || exit 1
+	same ${tmpdir}/batch1.img "--batch (first image, ${jobs} jobs)"
+	same ${tmpdir}/batch2.img "--batch (second image, ${jobs} jobs)"
+done
+echo "-o ${tmpdir}/batch3.img --part - --size 1M --type linux" >>${tmpdir}/batch.txt
+if cat ${tmpdir}/r1.img | ./mkgpt --batch ${tmpdir}/batch.txt --batch-jobs 2; then
+	echo "--batch-jobs shared a pipe, regression!"
+	exit 1
+fi
+# an image that fails to write (/dev/full) must not stop the ones after it,
+# one after the other a pipe is fine
+if [ -c /dev/full ]; then
+	{
+		echo "-o /dev/full ${parts}"
+		cat ${tmpdir}/batch.txt
+	} >${tmpdir}/batch-full.txt
+	rm -f ${tmpdir}/batch1.img ${tmpdir}/batch2.img ${tmpdir}/batch3.img
+	head -c 1048576 ${tmpdir}/r1.img >${tmpdir}/r1-head.img
+	if cat ${tmpdir}/r1-head.img |
+		./mkgpt --batch ${tmpdir}/batch-full.txt 2>/dev/null; then
+		echo "--batch didn't notice writing to /dev/full, regression!"
+		exit 1
+	fi
+	same ${tmpdir}/batch1.img "--batch (after a failed image)"
+	same ${tmpdir}/batch2.img "--batch (after a failed image)"
+	if ! ./mkgpt --verify ${tmpdir}/batch3.img -p ${tmpdir}/r1-head.img; then
+		echo "--batch after a failed image lost the pipe, regression!"
+		exit 1
+	fi
+fi
+
+# Android sparse images have to expand to the raw image again, with simg2img
+# or with what follows if that's not around; and they can't count more than
+# 2^32 blocks
+unsimg() {
+	if command -v simg2img >/dev/null; then
+		simg2img "$1" "$2"
+		return
+	fi
+	python3 - "$1" "$2" <<'EOF'
+import struct, sys
+f = open(sys.argv[1], "rb")
+magic, major, _, hdr, chdr, blk, blocks, chunks, _ = struct.unpack(
+    "<IHHHHIIII", f.read(28))
+assert magic == 0xED26FF3A and major == 1
+f.seek(hdr)
+out = open(sys.argv[2], "wb")
+for _ in range(chunks):
+    kind, _, n, total = struct.unpack("<HHII", f.read(12))
+    f.seek(chdr - 12, 1)
+    data = f.read(total - chdr)
+    if kind == 0xCAC1:
+        out.write(data)
+    elif kind == 0xCAC2:
+        out.write(data * (n * blk // 4))
+    elif kind == 0xCAC3:
+        out.write(bytes(n * blk))
+out.truncate(blocks * blk)
+EOF
+}
+build ${tmpdir}/simg.img --format simg || exit 1
+unsimg ${tmpdir}/simg.img ${tmpdir}/unsimg.img || exit 1
+same ${tmpdir}/unsimg.img "--format simg"
+build ${tmpdir}/simg.img --format simg --sparse || exit 1
+unsimg ${tmpdir}/simg.img ${tmpdir}/unsimg.img || exit 1
+same ${tmpdir}/unsimg.img "--format simg --sparse"
+if ./mkgpt -o ${tmpdir}/huge.img --format simg --sparse -s 4294967297 \
+	--part ${tmpdir}/r3.img --type linux 2>/dev/null; then
+	echo "--format simg wrote more than 2^32 blocks, regression!"
+	exit 1
+fi
+rm -f ${tmpdir}/huge.img
+
+# --verify finds a changed byte, and doesn't mind a disk larger than the image
+if ! ./mkgpt --verify ${tmpdir}/plain.img -j 3 -p ${tmpdir}/r1.img \
+	-p ${tmpdir}/r2.img --part ${tmpdir}/r3.img; then
+	echo "plain build didn't verify, regression!"
+	exit 1
+fi
+cp ${tmpdir}/plain.img ${tmpdir}/bad.img
+printf 'X' | dd of=${tmpdir}/bad.img bs=1 seek=6291456 conv=notrunc 2>/dev/null
+if ./mkgpt --verify ${tmpdir}/bad.img -p ${tmpdir}/r1.img -p ${tmpdir}/r2.img \
+	-p ${tmpdir}/r3.img; then
+	echo "--verify missed a changed byte, regression!"
+	exit 1
+fi
+cp ${tmpdir}/plain.img ${tmpdir}/disk.img
+truncate --size=+1M ${tmpdir}/disk.img
+if ! ./mkgpt --verify ${tmpdir}/disk.img -p ${tmpdir}/r1.img; then
+	echo "--verify wanted the image to fill the disk, regression!"
+	exit 1
+fi
+
+# the same --size in bytes, sectors and percent of the disk; a percentage
+# needs to know how large the disk is
+for size in 5M 10240s 25%; do
+	./mkgpt -o ${tmpdir}/size-${size}.img --image-size 40960 \
+		--disk-guid 1ABC2ABC-1111-2222-3333-1ABC2ABC3ABC \
+		--part ${tmpdir}/r2.img --type linux --size ${size} \
+		--uuid 22222222-2222-2222-2222-222222222222 || exit 1
+done
+if ! cmp -s ${tmpdir}/size-5M.img ${tmpdir}/size-10240s.img ||
+	! cmp -s ${tmpdir}/size-5M.img ${tmpdir}/size-25%.img; then
+	echo "--size in different units didn't match, regression!"
+	exit 1
+fi
+if ./mkgpt -o ${tmpdir}/size.img --part ${tmpdir}/r2.img --type linux \
+	--size 50% 2>/dev/null; then
+	echo "--size took a percentage of a disk of unknown size, regression!"
+	exit 1
+fi
+
+# the first --update copies everything, the second nothing; swapping in an
+# older partition image of the same size still has to copy that one
+build ${tmpdir}/up.img --update || exit 1
+same ${tmpdir}/up.img "--update (first)"
+build ${tmpdir}/up.img --update || exit 1
+same ${tmpdir}/up.img "--update (nothing changed)"
+mv ${tmpdir}/r2.img ${tmpdir}/r2.orig
+head -c 2621540 /dev/urandom >${tmpdir}/r2.img
+touch -d "2000-01-01" ${tmpdir}/r2.img
+build ${tmpdir}/up.img --update || exit 1
+build ${tmpdir}/new.img || exit 1
+if ! cmp -s ${tmpdir}/up.img ${tmpdir}/new.img; then
+	echo "--update kept an older partition image, regression!"
+	exit 1
+fi
+mv ${tmpdir}/r2.orig ${tmpdir}/r2.img
+build ${tmpdir}/up.img --update || exit 1
+same ${tmpdir}/up.img "--update (back to the original)"
+
+# something that isn't a GPT image at all, and larger than one
+head -c 20000000 /dev/urandom >${tmpdir}/up.img
+build ${tmpdir}/up.img --update || exit 1
+same ${tmpdir}/up.img "--update (over random junk)"
+
+# all the GUIDs are given, so there's nothing left for --deterministic to do
+build ${tmpdir}/det.img --deterministic seed || exit 1
+same ${tmpdir}/det.img "--deterministic"
+
+# the second one comes from the cache, and changing it (or building over it)
+# must leave the cache alone
+mkdir -p ${tmpdir}/cache
+build ${tmpdir}/cached.img --cache-dir ${tmpdir}/cache || exit 1
+same ${tmpdir}/cached.img "--cache-dir (miss)"
+build ${tmpdir}/cached.img --cache-dir ${tmpdir}/cache || exit 1
+same ${tmpdir}/cached.img "--cache-dir (hit)"
+./mkgpt --edit ${tmpdir}/cached.img --entry 1 --name edited || exit 1
+./mkgpt -o ${tmpdir}/cached.img --part ${tmpdir}/a.img --type linux || exit 1
+same ${tmpdir}/cache/*.img "--cache-dir after editing the output"
+build ${tmpdir}/cached.img --cache-dir ${tmpdir}/cache || exit 1
+same ${tmpdir}/cached.img "--cache-dir (hit after editing the output)"
+
 rm -rfv ${tmpdir}
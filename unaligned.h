@@ -34,6 +34,14 @@ get_u64(const uint8_t *buf)
 	       (uint64_t)buf[1] << 8 | (uint64_t)buf[0] << 0;
 }
 
+/* Big-endian, for the few formats that insist on it. */
+static inline uint32_t
+get_be32(const uint8_t *buf)
+{
+	return (uint32_t)buf[0] << 24 | (uint32_t)buf[1] << 16 |
+	       (uint32_t)buf[2] << 8 | (uint32_t)buf[3] << 0;
+}
+
 static inline void
 set_u16(uint8_t *buf, const uint16_t val)
 {
@@ -63,4 +71,27 @@ set_u64(uint8_t *buf, const uint64_t val)
 	buf[7] = val >> 56;
 }
 
+static inline void
+set_be16(uint8_t *buf, const uint16_t val)
+{
+	buf[0] = val >> 8;
+	buf[1] = val >> 0;
+}
+
+static inline void
+set_be32(uint8_t *buf, const uint32_t val)
+{
+	buf[0] = val >> 24;
+	buf[1] = val >> 16;
+	buf[2] = val >> 8;
+	buf[3] = val >> 0;
+}
+
+static inline void
+set_be64(uint8_t *buf, const uint64_t val)
+{
+	set_be32(buf + 0, val >> 32);
+	set_be32(buf + 4, val);
+}
+
 #endif
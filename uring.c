@@ -0,0 +1,492 @@
+/* SPDX-License-Identifier: MIT */
+
+#define _GNU_SOURCE /* SEEK_DATA, SEEK_HOLE */
+
+#include "uring.h"
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#define HAVE_IO_URING
+#endif
+#endif
+
+#if defined(HAVE_IO_URING)
+
+#include <linux/io_uring.h>
+#include <stdatomic.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+
+/*
+ * There's no liburing dependency here, we talk to the kernel directly. See
+ * io_uring_setup(2) for what all of this means; we keep at most one request
+ * per buffer in flight so the queues can never overflow.
+ */
+struct ring {
+	int fd;
+	unsigned entries;
+	unsigned *sq_head;
+	unsigned *sq_tail;
+	unsigned *sq_mask;
+	unsigned *sq_array;
+	unsigned *cq_head;
+	unsigned *cq_tail;
+	unsigned *cq_mask;
+	struct io_uring_sqe *sqes;
+	struct io_uring_cqe *cqes;
+	void *sq_ptr;
+	void *cq_ptr;
+	size_t sq_len;
+	size_t cq_len;
+	size_t sqes_len;
+	unsigned queued; /* prepared but not yet submitted */
+	unsigned inflight; /* submitted but not yet completed */
+	int fixed; /* did registering the buffers work? */
+};
+
+/* What a buffer is used for at the moment. */
+struct slot {
+	uint8_t *buf;
+	struct iovec iov; /* for READV/WRITEV if buffers aren't registered */
+	off_t out_off; /* where buf[0] goes in the output */
+	off_t in_off; /* where buf[0] comes from in the input */
+	size_t len; /* how much of buf is valid (once it's all read) */
+	size_t got; /* how much of buf is read */
+	size_t scan; /* how much of buf is written (or skipped) */
+	size_t wlen; /* size of the write in flight */
+	size_t written; /* how much of buf is written, the rest is zeros */
+	const struct copy_chunk *chunk; /* where the data comes from */
+};
+
+/* Walks the chunks in pieces that fit into a buffer. */
+struct pieces {
+	const struct copy_chunk *chunks;
+	size_t count;
+	size_t index;
+	off_t pos;
+	size_t block;
+	int sparse;
+	const struct copy_output *out; /* for out->progress */
+	size_t started; /* chunks we told out->progress about */
+};
+
+/* See copy_output.progress. */
+static void
+progress(const struct copy_output *out, const struct copy_chunk *chunk,
+	off_t data, off_t holes)
+{
+	if (out->progress != NULL) {
+		out->progress(out->progress_ctx, chunk, data, holes);
+	}
+}
+
+static unsigned
+load_acquire(const unsigned *p)
+{
+	return atomic_load_explicit(
+		(_Atomic unsigned *)p, memory_order_acquire);
+}
+
+static void
+store_release(unsigned *p, unsigned v)
+{
+	atomic_store_explicit((_Atomic unsigned *)p, v, memory_order_release);
+}
+
+static void
+ring_exit(struct ring *r)
+{
+	if (r->sqes != NULL && r->sqes != MAP_FAILED) {
+		munmap(r->sqes, r->sqes_len);
+	}
+	if (r->cq_ptr != NULL && r->cq_ptr != MAP_FAILED &&
+		r->cq_ptr != r->sq_ptr) {
+		munmap(r->cq_ptr, r->cq_len);
+	}
+	if (r->sq_ptr != NULL && r->sq_ptr != MAP_FAILED) {
+		munmap(r->sq_ptr, r->sq_len);
+	}
+	if (r->fd >= 0) {
+		close(r->fd);
+	}
+}
+
+static int
+ring_init(struct ring *r, unsigned entries)
+{
+	struct io_uring_params p;
+	memset(&p, 0, sizeof(p));
+	memset(r, 0, sizeof(*r));
+
+	r->fd = syscall(__NR_io_uring_setup, entries, &p);
+	if (r->fd < 0) {
+		return -1;
+	}
+	r->entries = p.sq_entries;
+
+	r->sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	r->cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		if (r->cq_len > r->sq_len) {
+			r->sq_len = r->cq_len;
+		}
+		r->cq_len = r->sq_len;
+	}
+
+	r->sq_ptr = mmap(NULL, r->sq_len, PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+	if (r->sq_ptr == MAP_FAILED) {
+		ring_exit(r);
+		return -1;
+	}
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		r->cq_ptr = r->sq_ptr;
+	} else {
+		r->cq_ptr = mmap(NULL, r->cq_len, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_CQ_RING);
+		if (r->cq_ptr == MAP_FAILED) {
+			ring_exit(r);
+			return -1;
+		}
+	}
+	r->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+	r->sqes = mmap(NULL, r->sqes_len, PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+	if (r->sqes == MAP_FAILED) {
+		ring_exit(r);
+		return -1;
+	}
+
+	uint8_t *sq = r->sq_ptr;
+	uint8_t *cq = r->cq_ptr;
+	r->sq_head = (unsigned *)(sq + p.sq_off.head);
+	r->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+	r->sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+	r->sq_array = (unsigned *)(sq + p.sq_off.array);
+	r->cq_head = (unsigned *)(cq + p.cq_off.head);
+	r->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+	r->cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+	r->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+
+	return 0;
+}
+
+static void
+ring_prep(struct ring *r, int write, int fd, unsigned index,
+	struct slot *slot, size_t len, off_t off)
+{
+	unsigned tail = *r->sq_tail;
+	unsigned i = tail & *r->sq_mask;
+	struct io_uring_sqe *sqe = &r->sqes[i];
+	uint8_t *buf = slot->buf + (write ? slot->scan : slot->got);
+
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->fd = fd;
+	sqe->off = off;
+	if (r->fixed) {
+		sqe->opcode = write ? IORING_OP_WRITE_FIXED
+				    : IORING_OP_READ_FIXED;
+		sqe->addr = (uintptr_t)buf;
+		sqe->len = len;
+		sqe->buf_index = index;
+	} else {
+		sqe->opcode = write ? IORING_OP_WRITEV : IORING_OP_READV;
+		slot->iov.iov_base = buf;
+		slot->iov.iov_len = len;
+		sqe->addr = (uintptr_t)&slot->iov;
+		sqe->len = 1;
+	}
+	sqe->user_data = (uint64_t)index << 1 | write;
+
+	r->sq_array[i] = i;
+	store_release(r->sq_tail, tail + 1);
+	r->queued++;
+	r->inflight++;
+}
+
+/*
+ * Submit whatever is queued and wait for at least one completion.
+ */
+static int
+ring_wait(struct ring *r)
+{
+	for (;;) {
+		int n = syscall(__NR_io_uring_enter, r->fd, r->queued, 1,
+			IORING_ENTER_GETEVENTS, NULL, 0);
+		if (n >= 0) {
+			r->queued -= n;
+			return 0;
+		}
+		if (errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+			return -1;
+		}
+	}
+}
+
+static int
+next_piece(struct pieces *it, const struct copy_chunk **chunk, off_t *pos,
+	size_t *len)
+{
+	while (it->index < it->count) {
+		const struct copy_chunk *c = &it->chunks[it->index];
+		off_t end = c->length;
+
+		if (it->started <= it->index) {
+			progress(it->out, c, 0, 0);
+			it->started = it->index + 1;
+		}
+
+		if (it->pos < end && it->sparse) {
+#if defined(SEEK_DATA) && defined(SEEK_HOLE)
+			off_t data = lseek(c->in_fd, c->in_off + it->pos,
+				SEEK_DATA);
+			if (data < 0 && errno == ENXIO) {
+				progress(it->out, c, 0, end - it->pos);
+				it->pos = end; /* only a hole left */
+			} else if (data >= 0) {
+				data -= c->in_off;
+				data -= data % it->block;
+				if (data > end) {
+					data = end;
+				}
+				if (data > it->pos) {
+					progress(it->out, c, 0, data - it->pos);
+					it->pos = data;
+				}
+				off_t hole = lseek(c->in_fd,
+					c->in_off + it->pos, SEEK_HOLE);
+				if (hole >= 0 && hole - c->in_off < end) {
+					end = hole - c->in_off;
+				}
+			}
+#endif
+		}
+		if (it->pos >= c->length) {
+			it->index++;
+			it->pos = 0;
+			continue;
+		}
+
+		*chunk = c;
+		*pos = it->pos;
+		*len = URING_BUFFER_SIZE;
+		if ((off_t)*len > end - it->pos) {
+			*len = end - it->pos;
+		}
+		it->pos += *len;
+		return 1;
+	}
+	return 0;
+}
+
+/*
+ * Queue the write for the next run of data in the slot. Returns 0 if there's
+ * nothing left to write.
+ */
+static int
+slot_advance(struct ring *r, int out_fd, unsigned index, struct slot *slot,
+	size_t block, int sparse)
+{
+	size_t start = slot->scan;
+	size_t end = slot->len;
+
+	if (sparse) {
+		while (start < slot->len) {
+			size_t n = slot->len - start < block ? slot->len - start
+							     : block;
+			if (!is_zero(slot->buf + start, n)) {
+				break;
+			}
+			start += n;
+		}
+		end = start;
+		while (end < slot->len) {
+			size_t n = slot->len - end < block ? slot->len - end
+							   : block;
+			if (is_zero(slot->buf + end, n)) {
+				break;
+			}
+			end += n;
+		}
+	}
+
+	slot->scan = start;
+	if (start >= end) {
+		return 0;
+	}
+
+	slot->wlen = end - start;
+	ring_prep(r, 1, out_fd, index, slot, slot->wlen, slot->out_off + start);
+	return 1;
+}
+
+/*
+ * Copy all the chunks keeping up to depth reads and writes in flight at the
+ * same time. Returns 0 on success, -1 on errors; if io_uring isn't available
+ * at all errno is ENOSYS and nothing has been copied yet.
+ */
+int
+uring_copy(const struct copy_output *out, const struct copy_chunk *chunks,
+	size_t count, unsigned depth, size_t block, int flags)
+{
+	int out_fd = out->fd;
+	struct ring ring;
+	if (ring_init(&ring, depth) != 0) {
+		errno = ENOSYS;
+		return -1;
+	}
+
+	struct slot *slots = calloc(depth, sizeof(*slots));
+	unsigned *idle = calloc(depth, sizeof(*idle));
+	struct iovec *iovs = calloc(depth, sizeof(*iovs));
+	uint8_t *bufs = NULL;
+	if (slots == NULL || idle == NULL || iovs == NULL ||
+		posix_memalign((void **)&bufs, sysconf(_SC_PAGESIZE),
+			(size_t)depth * URING_BUFFER_SIZE) != 0) {
+		free(slots);
+		free(idle);
+		free(iovs);
+		ring_exit(&ring);
+		return -1;
+	}
+
+	unsigned nidle = 0;
+	for (unsigned i = 0; i < depth; i++) {
+		slots[i].buf = bufs + (size_t)i * URING_BUFFER_SIZE;
+		iovs[i].iov_base = slots[i].buf;
+		iovs[i].iov_len = URING_BUFFER_SIZE;
+		idle[nidle++] = i;
+	}
+	ring.fixed = syscall(__NR_io_uring_register, ring.fd,
+			     IORING_REGISTER_BUFFERS, iovs, depth) == 0;
+
+	struct pieces it = {
+		.chunks = chunks,
+		.count = count,
+		.block = block,
+		.sparse = flags & COPY_SPARSE,
+		.out = out,
+	};
+	int failed = 0;
+
+	for (;;) {
+		const struct copy_chunk *c;
+		off_t pos;
+		size_t len;
+
+		while (!failed && nidle > 0 && next_piece(&it, &c, &pos, &len)) {
+			unsigned i = idle[--nidle];
+			slots[i].out_off = c->out_off + pos;
+			slots[i].in_off = c->in_off + pos;
+			slots[i].len = len;
+			slots[i].got = 0;
+			slots[i].scan = 0;
+			slots[i].written = 0;
+			slots[i].chunk = c;
+			ring_prep(&ring, 0, c->in_fd, i, &slots[i], len,
+				c->in_off + pos);
+		}
+
+		if (ring.inflight == 0) {
+			break;
+		}
+		if (ring_wait(&ring) != 0) {
+			failed = 1;
+			break;
+		}
+
+		unsigned head = *ring.cq_head;
+		while (head != load_acquire(ring.cq_tail)) {
+			struct io_uring_cqe *cqe = &ring.cqes[head & *ring.cq_mask];
+			unsigned i = cqe->user_data >> 1;
+			int write = cqe->user_data & 1;
+			int res = cqe->res;
+			struct slot *slot = &slots[i];
+
+			head++;
+			ring.inflight--;
+
+			if (res < 0) {
+				failed = 1;
+			} else if (failed) {
+				/* just let things drain */
+			} else if (!write && res == 0) {
+				/* the image shrunk under us */
+				failed = 1;
+			} else if (!write) {
+				slot->got += res;
+				if (slot->got < slot->len) {
+					/* short read, go for the rest */
+					ring_prep(&ring, 0, slot->chunk->in_fd,
+						i, slot, slot->len - slot->got,
+						slot->in_off + slot->got);
+					continue;
+				}
+				if (slot_advance(&ring, out_fd, i, slot, block,
+					    it.sparse)) {
+					continue;
+				}
+			} else if ((size_t)res < slot->wlen) {
+				if (res == 0) {
+					failed = 1;
+				} else {
+					slot->scan += res;
+					slot->written += res;
+					slot->wlen -= res;
+					ring_prep(&ring, 1, out_fd, i, slot,
+						slot->wlen,
+						slot->out_off + slot->scan);
+					continue;
+				}
+			} else {
+				slot->scan += res;
+				slot->written += res;
+				if (slot_advance(&ring, out_fd, i, slot, block,
+					    it.sparse)) {
+					continue;
+				}
+			}
+			if (!failed) {
+				/* zero blocks slot_advance() skipped */
+				progress(out, slot->chunk, slot->written,
+					slot->len - slot->written);
+			}
+			idle[nidle++] = i;
+		}
+		store_release(ring.cq_head, head);
+	}
+
+	/* an error in io_uring_enter leaves requests we can't wait for */
+	ring_exit(&ring);
+	free(bufs);
+	free(slots);
+	free(idle);
+	free(iovs);
+
+	return failed ? -1 : 0;
+}
+
+#else
+
+int
+uring_copy(const struct copy_output *out, const struct copy_chunk *chunks,
+	size_t count, unsigned depth, size_t block, int flags)
+{
+	(void)out;
+	(void)chunks;
+	(void)count;
+	(void)depth;
+	(void)block;
+	(void)flags;
+	errno = ENOSYS;
+	return -1;
+}
+
+#endif
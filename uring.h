@@ -0,0 +1,24 @@
+#pragma once
+
+/* SPDX-License-Identifier: MIT */
+
+#ifndef URING_H
+#define URING_H
+
+#include "copy.h"
+
+/* Size of each of the registered buffers. */
+#define URING_BUFFER_SIZE (256U * 1024U)
+
+/* Number of buffers (and therefore requests) in flight by default. */
+#define URING_DEFAULT_DEPTH (16U)
+
+/*
+ * Like copy_chunks(), but only out->fd and out->progress are used: no
+ * mapping, O_DIRECT, observing or sink.
+ */
+int
+uring_copy(const struct copy_output *out, const struct copy_chunk *chunks,
+	size_t count, unsigned depth, size_t block, int flags);
+
+#endif
@@ -0,0 +1,542 @@
+/* SPDX-License-Identifier: MIT */
+
+#define _GNU_SOURCE /* SEEK_DATA, SEEK_HOLE */
+
+/*
+ * Checking an image after the fact: the protective MBR, both GPTs, and the
+ * partitions against the images they were made from.
+ */
+
+#include "verify.h"
+#include "gpt.h"
+#include "guid.h"
+#include "unaligned.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+/* A partition we compare against its image. */
+struct target {
+	size_t entry; /* counting from 1 */
+	const char *path;
+	int fd;
+	off_t start; /* in the image */
+	off_t length; /* of its image */
+	off_t first_bad; /* offset of the first difference, -1 if none yet */
+	int failed; /* couldn't read it */
+};
+
+/* A piece of work for the checkers. */
+struct piece {
+	struct target *target;
+	off_t offset;
+	off_t length;
+};
+
+/*
+ * State shared by the checker threads. Pieces are handed out in order through
+ * next, just like copy_chunks() does it; lock protects the targets.
+ */
+struct checkers {
+	int fd; /* the image */
+	const struct piece *pieces;
+	size_t count;
+	atomic_size_t next;
+	pthread_mutex_t lock;
+};
+
+/*
+ * Check the protective MBR: the signature, and a partition of type 0xee that
+ * starts at LBA 1 and covers the whole disk (or as much of it as it can).
+ */
+static int
+check_mbr(int fd, uint64_t sectors)
+{
+	uint8_t mbr[512];
+
+	if (pread(fd, mbr, sizeof(mbr), 0) != (ssize_t)sizeof(mbr)) {
+		fprintf(stderr, "unable to read the MBR\n");
+		return -1;
+	}
+	if (get_u16(mbr + 510) != 0xaa55) {
+		fprintf(stderr, "no MBR signature\n");
+		return -1;
+	}
+
+	for (int i = 0; i < 4; i++) {
+		const uint8_t *p = mbr + 446 + 16 * i;
+		if (p[4] != 0xee) {
+			continue;
+		}
+
+		uint32_t want = sectors - 1 > 0xffffffff ? 0xffffffff
+							 : sectors - 1;
+		if (get_u32(p + 8) != 1 || get_u32(p + 12) != want) {
+			fprintf(stderr,
+				"protective MBR partition covers LBA %u to "
+				"%llu instead of 1 to %llu\n",
+				get_u32(p + 8),
+				(unsigned long long)get_u32(p + 8) +
+					get_u32(p + 12) - 1,
+				(unsigned long long)want);
+			return -1;
+		}
+		return 0;
+	}
+
+	fprintf(stderr, "no protective MBR partition\n");
+	return -1;
+}
+
+/*
+ * Check that the secondary GPT agrees with the primary one, and that the used
+ * entries stay inside the usable area and out of each other's way.
+ */
+static int
+check_gpts(const struct gpt *primary, const struct gpt *secondary)
+{
+	if (secondary->alternate_lba != 1 ||
+		secondary->first_usable_lba != primary->first_usable_lba ||
+		secondary->last_usable_lba != primary->last_usable_lba ||
+		memcmp(secondary->header + 56, primary->header + 56, 16) ||
+		secondary->entry_count != primary->entry_count ||
+		secondary->entry_size != primary->entry_size) {
+		fprintf(stderr, "primary and secondary GPT headers differ\n");
+		return -1;
+	}
+	if (memcmp(secondary->entries, primary->entries,
+		    (size_t)primary->entry_count * primary->entry_size)) {
+		fprintf(stderr, "primary and secondary GPT entries differ\n");
+		return -1;
+	}
+
+	int ret = 0;
+	for (uint32_t i = 0; i < primary->entry_count; i++) {
+		const uint8_t *entry = gpt_entry(primary, i);
+		GUID type;
+		bytestring_to_guid(&type, entry + GPT_ENTRY_TYPE);
+		uint64_t first = get_u64(entry + GPT_ENTRY_FIRST_LBA);
+		uint64_t last = get_u64(entry + GPT_ENTRY_LAST_LBA);
+		if (guid_is_zero(&type) || last + 1 == first) {
+			continue; /* unused or empty */
+		}
+
+		if (last < first || first < primary->first_usable_lba ||
+			last > primary->last_usable_lba) {
+			fprintf(stderr,
+				"entry %u (LBA %llu to %llu) is outside of "
+				"the usable LBAs %llu to %llu\n",
+				i + 1, (unsigned long long)first,
+				(unsigned long long)last,
+				(unsigned long long)primary->first_usable_lba,
+				(unsigned long long)primary->last_usable_lba);
+			ret = -1;
+			continue;
+		}
+
+		for (uint32_t j = 0; j < i; j++) {
+			const uint8_t *other = gpt_entry(primary, j);
+			bytestring_to_guid(&type, other + GPT_ENTRY_TYPE);
+			uint64_t o_first = get_u64(other + GPT_ENTRY_FIRST_LBA);
+			uint64_t o_last = get_u64(other + GPT_ENTRY_LAST_LBA);
+			if (!guid_is_zero(&type) && o_first <= o_last &&
+				first <= o_last && o_first <= last) {
+				fprintf(stderr, "entries %u and %u overlap\n",
+					j + 1, i + 1);
+				ret = -1;
+			}
+		}
+	}
+	return ret;
+}
+
+/*
+ * Whether fd has a hole at off, and where that hole (or the data) ends, but
+ * no further than end. Anything that can't tell us counts as data.
+ */
+static int
+hole_at(int fd, off_t off, off_t end, off_t *next)
+{
+	*next = end;
+#if defined(SEEK_DATA) && defined(SEEK_HOLE)
+	off_t data = lseek(fd, off, SEEK_DATA);
+	if (data < 0) {
+		return errno == ENXIO; /* only a hole left */
+	}
+	if (data > off) {
+		if (data < end) {
+			*next = data;
+		}
+		return 1;
+	}
+	off_t hole = lseek(fd, off, SEEK_HOLE);
+	if (hole > off && hole < end) {
+		*next = hole;
+	}
+#else
+	(void)fd;
+	(void)off;
+#endif
+	return 0;
+}
+
+/* Offset of the first byte that differs, or len if none does. */
+static size_t
+first_difference(const uint8_t *a, const uint8_t *b, size_t len)
+{
+	size_t i = 0;
+	while (i < len) {
+		size_t n = len - i < 4096 ? len - i : 4096;
+		if (memcmp(a + i, b + i, n)) {
+			while (a[i] == b[i]) {
+				i++;
+			}
+			return i;
+		}
+		i += n;
+	}
+	return len;
+}
+
+/* Map length bytes of fd at off; *base is what to munmap() later. */
+static const uint8_t *
+map_range(int fd, off_t off, off_t length, void **base, size_t *mapped)
+{
+	off_t delta = off % sysconf(_SC_PAGESIZE);
+
+	*mapped = length + delta;
+	*base = mmap(NULL, *mapped, PROT_READ, MAP_SHARED, fd, off - delta);
+	if (*base == MAP_FAILED) {
+		return NULL;
+	}
+	madvise(*base, *mapped, MADV_SEQUENTIAL);
+	return (const uint8_t *)*base + delta;
+}
+
+/*
+ * Compare a piece of a partition against its image, skipping the ranges that
+ * are holes in both. Returns the offset of the first difference (relative to
+ * the piece), the piece's length if there is none, or -1 on errors.
+ */
+static off_t
+check_piece(int fd, const struct piece *p)
+{
+	const struct target *t = p->target;
+	off_t img_off = t->start + p->offset;
+	void *img_base, *src_base;
+	size_t img_mapped, src_mapped;
+
+	const uint8_t *img =
+		map_range(fd, img_off, p->length, &img_base, &img_mapped);
+	if (img == NULL) {
+		return -1;
+	}
+	const uint8_t *src = map_range(
+		t->fd, p->offset, p->length, &src_base, &src_mapped);
+	if (src == NULL) {
+		munmap(img_base, img_mapped);
+		return -1;
+	}
+
+	off_t pos = 0;
+	while (pos < p->length) {
+		off_t img_next, src_next;
+		int holes = hole_at(fd, img_off + pos, img_off + p->length,
+				    &img_next) &
+			    hole_at(t->fd, p->offset + pos,
+				    p->offset + p->length, &src_next);
+		off_t next = img_next - img_off;
+		if (src_next - p->offset < next) {
+			next = src_next - p->offset;
+		}
+
+		if (!holes) {
+			size_t diff = first_difference(
+				img + pos, src + pos, next - pos);
+			if ((off_t)diff < next - pos) {
+				pos += diff;
+				break;
+			}
+		}
+		pos = next;
+	}
+
+	munmap(src_base, src_mapped);
+	munmap(img_base, img_mapped);
+	return pos;
+}
+
+static void *
+checker(void *arg)
+{
+	struct checkers *pool = arg;
+
+	for (;;) {
+		size_t i = atomic_fetch_add(&pool->next, 1);
+		if (i >= pool->count) {
+			break;
+		}
+
+		const struct piece *p = &pool->pieces[i];
+		struct target *t = p->target;
+
+		/* we only report the first difference, don't look past it */
+		pthread_mutex_lock(&pool->lock);
+		int skip = t->failed ||
+			   (t->first_bad >= 0 && t->first_bad < p->offset);
+		pthread_mutex_unlock(&pool->lock);
+		if (skip) {
+			continue;
+		}
+
+		off_t pos = check_piece(pool->fd, p);
+
+		pthread_mutex_lock(&pool->lock);
+		if (pos < 0) {
+			t->failed = 1;
+		} else if (pos < p->length &&
+			   (t->first_bad < 0 || p->offset + pos < t->first_bad)) {
+			t->first_bad = p->offset + pos;
+		}
+		pthread_mutex_unlock(&pool->lock);
+	}
+
+	return NULL;
+}
+
+/*
+ * Compare the partitions against their images using up to jobs threads, each
+ * partition split into pieces of VERIFY_CHUNK_SIZE.
+ */
+static int
+check_targets(int fd, struct target *targets, size_t count, int jobs)
+{
+	size_t total = 0;
+	for (size_t i = 0; i < count; i++) {
+		total += (targets[i].length + VERIFY_CHUNK_SIZE - 1) /
+			 VERIFY_CHUNK_SIZE;
+	}
+
+	struct piece *pieces = calloc(total > 0 ? total : 1, sizeof(*pieces));
+	if (pieces == NULL) {
+		fprintf(stderr, "out of memory verifying\n");
+		return -1;
+	}
+	size_t n = 0;
+	for (size_t i = 0; i < count; i++) {
+		for (off_t off = 0; off < targets[i].length;
+			off += VERIFY_CHUNK_SIZE) {
+			pieces[n].target = &targets[i];
+			pieces[n].offset = off;
+			pieces[n].length = targets[i].length - off;
+			if (pieces[n].length > VERIFY_CHUNK_SIZE) {
+				pieces[n].length = VERIFY_CHUNK_SIZE;
+			}
+			n++;
+		}
+	}
+
+	struct checkers pool = {
+		.fd = fd,
+		.pieces = pieces,
+		.count = total,
+	};
+	atomic_init(&pool.next, 0);
+	pthread_mutex_init(&pool.lock, NULL);
+
+	if ((size_t)jobs > total) {
+		jobs = total;
+	}
+	pthread_t *threads = NULL;
+	int started = 0;
+	if (jobs > 1) {
+		threads = calloc(jobs - 1, sizeof(*threads));
+	}
+	if (threads != NULL) {
+		while (started < jobs - 1 &&
+			pthread_create(&threads[started], NULL, checker,
+				&pool) == 0) {
+			started++;
+		}
+	}
+
+	/* the calling thread pitches in, so jobs == 1 needs no threads */
+	checker(&pool);
+
+	for (int i = 0; i < started; i++) {
+		pthread_join(threads[i], NULL);
+	}
+	free(threads);
+	pthread_mutex_destroy(&pool.lock);
+	free(pieces);
+	return 0;
+}
+
+/*
+ * Open the images to compare the partitions against; sources[i] is the one
+ * for entry i + 1, or NULL to not compare that one.
+ */
+static int
+open_targets(const struct gpt *gpt, size_t sect_size,
+	const char *const *sources, size_t count, struct target *targets,
+	size_t *opened)
+{
+	*opened = 0;
+	if (count > gpt->entry_count) {
+		fprintf(stderr, "%zu partition images but only %u entries\n",
+			count, gpt->entry_count);
+		return -1;
+	}
+
+	for (size_t i = 0; i < count; i++) {
+		if (sources[i] == NULL) {
+			continue;
+		}
+
+		const uint8_t *entry = gpt_entry(gpt, i);
+		GUID type;
+		bytestring_to_guid(&type, entry + GPT_ENTRY_TYPE);
+		if (guid_is_zero(&type)) {
+			fprintf(stderr, "entry %zu for %s is unused\n", i + 1,
+				sources[i]);
+			return -1;
+		}
+		uint64_t first = get_u64(entry + GPT_ENTRY_FIRST_LBA);
+		uint64_t last = get_u64(entry + GPT_ENTRY_LAST_LBA);
+
+		struct target *t = &targets[*opened];
+		memset(t, 0, sizeof(*t));
+		t->entry = i + 1;
+		t->path = sources[i];
+		t->start = (off_t)(first * sect_size);
+		t->first_bad = -1;
+		t->fd = open(sources[i], O_RDONLY);
+		if (t->fd < 0) {
+			fprintf(stderr, "unable to open %s (%s)\n", sources[i],
+				strerror(errno));
+			return -1;
+		}
+		(*opened)++;
+
+		t->length = lseek(t->fd, 0, SEEK_END);
+		if (t->length < 0) {
+			fprintf(stderr, "%s can't be verified (%s)\n",
+				sources[i], strerror(errno));
+			return -1;
+		}
+		if (t->length > (off_t)((last + 1 - first) * sect_size)) {
+			fprintf(stderr,
+				"%s doesn't fit entry %zu (%llu sectors)\n",
+				sources[i], i + 1,
+				(unsigned long long)(last + 1 - first));
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Check the image at path: the protective MBR, both GPT headers and entry
+ * arrays (CRCs included) and whether they agree, and then compare entry i + 1
+ * against sources[i] (unless that's NULL) with up to jobs threads. Complains
+ * on stderr, with the first LBA that's different for each partition that is,
+ * and returns -1 if anything doesn't check out.
+ */
+int
+verify_image(const char *path, size_t sect_size, const char *const *sources,
+	size_t count, int jobs)
+{
+	int fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		fprintf(stderr, "unable to open %s (%s)\n", path,
+			strerror(errno));
+		return -1;
+	}
+
+	off_t size = lseek(fd, 0, SEEK_END);
+	if (size < 0 || size / sect_size < 3) {
+		fprintf(stderr, "%s is too small for a GPT\n", path);
+		close(fd);
+		return -1;
+	}
+
+	struct gpt primary, secondary;
+	if (gpt_read(fd, sect_size, 1, &primary) != 0) {
+		close(fd);
+		return -1;
+	}
+
+	/*
+	 * The image ends with the secondary GPT, which on a block device isn't
+	 * necessarily the end of the device.
+	 */
+	int ret = 0;
+	uint64_t sectors = primary.alternate_lba + 1;
+	if (primary.alternate_lba < 2 ||
+		primary.alternate_lba >= (uint64_t)size / sect_size) {
+		fprintf(stderr,
+			"secondary GPT at LBA %llu is outside of %s (%llu "
+			"sectors)\n",
+			(unsigned long long)primary.alternate_lba, path,
+			(unsigned long long)(size / sect_size));
+		ret = -1;
+	} else {
+		if (check_mbr(fd, sectors) != 0) {
+			ret = -1;
+		}
+		if (gpt_read(fd, sect_size, primary.alternate_lba,
+			    &secondary) != 0) {
+			ret = -1;
+		} else {
+			if (check_gpts(&primary, &secondary) != 0) {
+				ret = -1;
+			}
+			gpt_free(&secondary);
+		}
+	}
+
+	struct target *targets = calloc(count > 0 ? count : 1, sizeof(*targets));
+	if (targets == NULL) {
+		fprintf(stderr, "out of memory verifying\n");
+		gpt_free(&primary);
+		close(fd);
+		return -1;
+	}
+
+	size_t opened;
+	if (open_targets(&primary, sect_size, sources, count, targets,
+		    &opened) != 0 ||
+		check_targets(fd, targets, opened, jobs) != 0) {
+		ret = -1;
+	}
+
+	for (size_t i = 0; i < opened; i++) {
+		struct target *t = &targets[i];
+		if (t->failed) {
+			fprintf(stderr,
+				"unable to compare entry %zu against %s\n",
+				t->entry, t->path);
+			ret = -1;
+		} else if (t->first_bad >= 0) {
+			fprintf(stderr,
+				"entry %zu differs from %s at LBA %llu\n",
+				t->entry, t->path,
+				(unsigned long long)((t->start + t->first_bad) /
+						     sect_size));
+			ret = -1;
+		}
+		close(t->fd);
+	}
+	free(targets);
+	gpt_free(&primary);
+	close(fd);
+	return ret;
+}
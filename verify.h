@@ -0,0 +1,17 @@
+#pragma once
+
+/* SPDX-License-Identifier: MIT */
+
+#ifndef VERIFY_H
+#define VERIFY_H
+
+#include <stddef.h>
+
+/* Size of the pieces verify_image() splits the comparisons into. */
+#define VERIFY_CHUNK_SIZE (16U * 1024U * 1024U)
+
+int
+verify_image(const char *path, size_t sect_size, const char *const *sources,
+	size_t count, int jobs);
+
+#endif